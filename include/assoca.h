@@ -4,22 +4,49 @@
 #include <string.h>
 
 #include "bloom.h"
+#include "buf.h"
+#include "cuckoo.h"
 #include "gdefs.h"
 #include "status.h"
 
 #ifndef EM_ASA_NO_SIMPLIFIED
 #define aa_make __em_asa_mk
+#define aa_make_hashed __em_asa_mkh
+#define aa_make_opts __em_asa_mkx
+#define aa_make_alloc __em_asa_mka
 #define aa_free __em_asa_destroy
 #define aa_count __em_asa_count
 #define aa_idtoidx __em_asa_getidx
 #define aa_idxtoid __em_asa_getid
+#define aa_idxtokey __em_asa_getkey
+#define aa_idxtoptr __em_asa_getvpi
+#define aa_next __em_asa_next
+#define aa_foreach __em_asa_foreach
+#define aa_foreach_par __em_asa_foreachp
 #define aa_in __em_asa_in
 #define aa_get __em_asa_get
+#define aa_idtoidx_many __em_asa_getidxm
+#define aa_get_many __em_asa_getpm
 #define aa_getptr __em_asa_getp
 #define aa_set __em_asa_set
+#define aa_set_ttl __em_asa_setttl
 #define aa_del __em_asa_rem
 #define aa_egc __em_asa_egc
 #define aa_empty __em_asa_emp
+#define aa_reserve __em_asa_reserve
+#define aa_save __em_asa_save
+#define aa_map __em_asa_map
+#define aa_publish __em_asa_publish
+#define aa_attach __em_asa_attach
+#define aa_refresh __em_asa_refresh
+#define aa_unpublish __em_asa_unpublish
+#define aa_stats __em_asa_stats
+#define aa_freeze __em_asa_freeze
+#define aa_cache __em_asa_cache
+#define aa_build __em_asa_build
+#define aa_merge __em_asa_merge
+#define aa_snapshot __em_asa_snapshot
+#define aa_snapshot_ok __em_asa_snapok
 #ifndef EM_ASA_NO_SIMPLE_HASHES
 #define aa_bh __em_asa_bh
 #define aa_sh __em_asa_sh
@@ -33,26 +60,107 @@
       em_i_asa_init((__em_i_asa_vcast(__84tmp)), sizeof(type));                \
       __84tmp;                                                                 \
    })
+#define __em_asa_mkh(type, h)                                                  \
+   ({                                                                          \
+      type *__87tmp = NULL;                                                    \
+      em_i_asa_inith((__em_i_asa_vcast(__87tmp)), sizeof(type), (h));          \
+      __87tmp;                                                                 \
+   })
+#define __em_asa_mkx(type, h, f)                                               \
+   ({                                                                          \
+      type *__88tmp = NULL;                                                    \
+      em_i_asa_initx((__em_i_asa_vcast(__88tmp)), sizeof(type), (h), (f));     \
+      __88tmp;                                                                 \
+   })
+#define __em_asa_mka(type, h, f, mi)                                           \
+   ({                                                                          \
+      type *__89tmp = NULL;                                                    \
+      em_i_asa_inita((__em_i_asa_vcast(__89tmp)), sizeof(type), (h), (f),      \
+                     (mi));                                                    \
+      __89tmp;                                                                 \
+   })
 #define __em_asa_destroy(m) (em_i_asa_destroy((__em_i_asa_vcast((m)))))
 #define __em_asa_count(m) ((__em_i_asa_hcast((m)))->elements)
 #define __em_asa_getidx(m, id) (em_i_asa_lookup((__em_i_asa_vcast((m))), (id)))
 #define __em_asa_getid(m, idx)                                                 \
-   ((__em_i_asa_ecast((em_i_asa_getip((__em_i_asa_vcast((m))), (idx)))))->id)
+   ({                                                                          \
+      long __86tmp = (idx);                                                    \
+      (*(em_i_asa_getidp((__em_i_asa_vcast((m))), __86tmp)));                  \
+   })
+#define __em_asa_getkey(m, idx, l)                                             \
+   (em_i_asa_getkey((__em_i_asa_vcast((m))), (idx), (l)))
+#define __em_asa_getvpi(m, idx)                                                \
+   ({                                                                          \
+      long __93tmp = (idx);                                                    \
+      ((__typeof__(m))(em_i_asa_getvpw((__em_i_asa_vcast((m))), __93tmp)));    \
+   })
+#define __em_asa_next(m, idx) (em_i_asa_next((__em_i_asa_vcast((m))), (idx)))
+#define __em_asa_foreach(m, i)                                                 \
+   for (long i = __em_asa_next((m), -1); i >= 0; i = __em_asa_next((m), i))
+#define __em_asa_foreachp(m, f, c, t)                                          \
+   (em_i_asa_foreach((__em_i_asa_vcast((m))), (f), (c), (t)))
 #define __em_asa_in(m, id) ((__em_asa_getidx((m), (id))) >= 0)
 #define __em_asa_getp(m, id)                                                   \
-   ((__typeof__(m))(                                                           \
-      (__em_i_asa_ecast((em_i_asa_getip((__em_i_asa_vcast((m))),               \
-                                        (__em_asa_getidx((m), (id))))))) +     \
-      1))
-#define __em_asa_get(m, id) (*(__em_asa_getp((m), (id))))
+   ({                                                                          \
+      long __85tmp = __em_asa_getidx((m), (id));                               \
+      ((__typeof__(m))(em_i_asa_getvpw((__em_i_asa_vcast((m))), __85tmp)));    \
+   })
+#define __em_asa_get(m, id)                                                    \
+   ({                                                                          \
+      long __95tmp = __em_asa_getidx((m), (id));                               \
+      (*((__typeof__(m))(em_i_asa_getvp((__em_i_asa_vcast((m))), __95tmp))));  \
+   })
+#define __em_asa_getidxm(m, ids, n, o)                                         \
+   (em_i_asa_lookup_batch((__em_i_asa_vcast((m))), (ids), (n), (o)))
+#define __em_asa_getpm(m, ids, n, o)                                           \
+   ({                                                                          \
+      __typeof__(m) *__81tmp = (o);                                            \
+      em_i_asa_getp_batch((__em_i_asa_vcast((m))), (ids), (n),                 \
+                          (void **)__81tmp);                                   \
+   })
 #define __em_asa_set(m, id, i)                                                 \
    ({                                                                          \
       __typeof__(m[0]) __83tmp = (i);                                          \
       em_i_asa_set((__em_i_asa_vcast((m))), (id), &__83tmp);                   \
    })
+#define __em_asa_setttl(m, id, i, t)                                           \
+   ({                                                                          \
+      __typeof__(m[0]) __90tmp = (i);                                          \
+      em_i_asa_setttl((__em_i_asa_vcast((m))), (id), &__90tmp, (t));           \
+   })
 #define __em_asa_rem(m, id) (em_i_asa_delete((__em_i_asa_vcast((m))), (id)))
 #define __em_asa_egc(m) (em_i_asa_reform((__em_i_asa_vcast((m))), true))
 #define __em_asa_emp(m) (em_i_asa_empty((__em_i_asa_vcast((m)))))
+#define __em_asa_reserve(m, n) (em_i_asa_reserve((__em_i_asa_vcast((m))), (n)))
+#define __em_asa_save(m, p) (em_i_asa_save((__em_i_asa_vcast((m))), (p)))
+#define __em_asa_map(m, p, f)                                                  \
+   (em_i_asa_map((__em_i_asa_vcast((m))), sizeof(*(m)), (p), (f)))
+#define __em_asa_publish(m, n) (em_i_asa_publish((__em_i_asa_vcast((m))), (n)))
+#define __em_asa_attach(m, n)                                                  \
+   (em_i_asa_attach((__em_i_asa_vcast((m))), sizeof(*(m)), (n)))
+#define __em_asa_refresh(m) (em_i_asa_refresh((__em_i_asa_vcast((m)))))
+#define __em_asa_unpublish(n) (em_i_asa_unpublish((n)))
+#define __em_asa_stats(m, o) (em_i_asa_stats((__em_i_asa_vcast((m))), (o)))
+#define __em_asa_freeze(m) (em_i_asa_freeze((__em_i_asa_vcast((m)))))
+#define __em_asa_cache(m, n, b, t)                                             \
+   (em_i_asa_cache((__em_i_asa_vcast((m))), (n), (b), (t)))
+#define __em_asa_build(m, k, ks, v, n, t)                                      \
+   ({                                                                          \
+      const __typeof__(m[0]) *__91tmp = (v);                                   \
+      em_i_asa_build((__em_i_asa_vcast((m))), (k), (ks), __91tmp, (n), (t));   \
+   })
+#define __em_asa_merge(m, s, t)                                                \
+   ({                                                                          \
+      __typeof__(m) __92tmp = (s);                                             \
+      em_i_asa_merge((__em_i_asa_vcast((m))), (__em_i_asa_vcast(__92tmp)),     \
+                     (t));                                                     \
+   })
+#define __em_asa_snapshot(m, s)                                                \
+   ({                                                                          \
+      __typeof__(m) *__94tmp = &(s);                                           \
+      em_i_asa_snapshot((__em_i_asa_vcast((m))), (void **)__94tmp);            \
+   })
+#define __em_asa_snapok(s) (em_i_asa_snapok((__em_i_asa_vcast((s)))))
 
 #define __em_asa_bh(m, r, s)                                                   \
    (em_i_asa_hrange((__em_i_asa_vcast((m))), (r), (s)))
@@ -63,18 +171,39 @@
       (__em_asa_bh((m), &__82tmp, sizeof(__82tmp)));                           \
    })
 
-#define __em_i_asa_ecast(m) ((struct em_asa_elhdr_s *)(m))
 #define __em_i_asa_hcast(m) ((struct em_asa_hdr_s *)(m))
 #define __em_i_asa_vcast(m) ((void **)&(m))
 
-/* Internal replacement macros */
-#define em_i_asa_getip(a, i)                                                   \
-   ((void *)((unsigned long)(i) > __em_i_asa_hcast(*(a))->highest_index ?      \
-                NULL :                                                         \
-                (char *)(*(a)) +                                               \
-                   (EM_ASA_HR_SZ +                                             \
-                    (i) * (__em_i_asa_hcast(*(a))->element_size +              \
-                           EM_ASA_EH_SZ))))
+/* Internal replacement macros
+ * Indices below em_i_asa_span() address the current slab. While a migration
+ * is running, the old slab's slots follow on directly after it.
+ */
+#define em_i_asa_span(h) (2UL << (h)->cur.tier)
+#define em_i_asa_slabof(a, i)                                                  \
+   ((unsigned long)(i) < em_i_asa_span(__em_i_asa_hcast(*(a))) ?               \
+       &__em_i_asa_hcast(*(a))->cur :                                          \
+       &__em_i_asa_hcast(*(a))->old)
+#define em_i_asa_slotof(a, i)                                                  \
+   ((unsigned long)(i) < em_i_asa_span(__em_i_asa_hcast(*(a))) ?               \
+       (unsigned long)(i) :                                                    \
+       (unsigned long)(i)-em_i_asa_span(__em_i_asa_hcast(*(a))))
+#define em_i_asa_inrange(a, i)                                                 \
+   (em_i_asa_slabof((a), (i))->ctrl &&                                         \
+    em_i_asa_slotof((a), (i)) <= em_i_asa_slabof((a), (i))->highest_index)
+#define em_i_asa_getidp(a, i)                                                  \
+   (em_i_asa_inrange((a), (i)) ?                                               \
+       em_i_asa_slabof((a), (i))->ids + em_i_asa_slotof((a), (i)) :            \
+       NULL)
+#define em_i_asa_getvp(a, i)                                                   \
+   ((void *)(em_i_asa_inrange((a), (i)) ?                                      \
+                (char *)em_i_asa_slabof((a), (i))->vals +                      \
+                   em_i_asa_slotof((a), (i)) *                                 \
+                      __em_i_asa_hcast(*(a))->element_size :                   \
+                NULL))
+/* For a value pointer that may be written through, see em_i_asa_getvpk */
+#define em_i_asa_getvpw(a, i)                                                  \
+   (__em_i_asa_hcast(*(a))->snaps ? em_i_asa_getvpk((a), (i)) :               \
+                                    em_i_asa_getvp((a), (i)))
 
 /* This value represents the amount of key bytes that are guaranteed to have
  * absolutely no collisions. By default it's 26, which means any bytes below or
@@ -86,53 +215,329 @@
  */
 #define EM_ASA_KEY_COLRES (size_t)26
 
+/* Hash functions a table can be made with, see aa_make_hashed. The choice is
+ * fixed for the table's lifetime, and every one of them is keyed with the
+ * table's random seed.
+ */
+enum em_asa_hash_e {
+   EM_ASA_HASH_XXH128 = 0, /* 128-bit xxHash3, the default */
+   EM_ASA_HASH_XXH64, /* 64-bit xxHash3, cheaper, but keys longer than
+                       * EM_ASA_KEY_COLRES only get 64 bits of it */
+   EM_ASA_HASH_INT, /* Integer mixer for keys of up to 8 bytes, and 64-bit
+                     * xxHash3 for anything longer */
+   EM_ASA_HASH_CRC32C /* Hardware CRC32C over seed-mixed words, and 128-bit
+                       * xxHash3 for keys longer than EM_ASA_KEY_COLRES,
+                       * where the CPU has CRC32C; 64-bit xxHash3 for all
+                       * keys where it doesn't */
+};
+
+/* Table options, see aa_make_opts.
+ *
+ * EM_ASA_EXACT_KEYS: Keys longer than EM_ASA_KEY_COLRES are kept verbatim in
+ * the table rather than folded into the id, so they're compared exactly and
+ * can be read back with aa_idxtokey. The id of such a key points at the key
+ * bytes, so the key has to outlive the id: hash long keys in place with
+ * aa_bh/aa_sh rather than through aa_vh's temporary copy.
+ *
+ * EM_ASA_ROBIN_HOOD: Inserts displace elements that sit closer to their home
+ * group than the new one would, and deletes shift later elements back rather
+ * than leaving tombstones. Probe lengths stay short and even, a miss can stop
+ * as soon as it passes elements closer to home than it would be, and the
+ * table is run up to 7/8 full instead of 2/3. The catch is that a set may move
+ * other elements around, so indices and value pointers don't survive it.
+ *
+ * EM_ASA_CUCKOO_FILTER: Slabs that get a prefilter (big ones, in tables that
+ * are mostly asked for keys they don't have) get a cuckoo filter with 8-bit
+ * fingerprints rather than a bloom filter. It costs a byte per slot instead of
+ * half a byte, but deletes take ids back out of it, so under heavy turnover it
+ * stays as sharp as when it was made, where a bloom filter piles up stale bits
+ * until the next rebuild.
+ *
+ * EM_ASA_CACHE: Every element gets a reference bit and an optional expiry
+ * time, kept in a 4-byte array alongside the slots. aa_cache then sets an
+ * entry and/or byte budget and a default TTL in seconds, aa_set_ttl sets
+ * one element's own. Lookups skip elements past their expiry and mark the
+ * ones they find as referenced; a set of a new key into a full table evicts
+ * first, sweeping a CLOCK hand over the slots that clears reference bits
+ * until it comes across an element that is expired or wasn't referenced
+ * since the last sweep. Expired elements still count towards aa_count until
+ * the hand gets to them or they're deleted. Cache tables can't be frozen or
+ * saved.
+ *
+ * EM_ASA_SNAPSHOTS: The table can be snapshotted with aa_snapshot, which gives
+ * a read-only table that goes on showing the elements as they were, for as
+ * long as it lives, while this one is changed. The two share their storage,
+ * which for that is mapped straight from the kernel rather than taken from
+ * the table's allocator, and the first write to a chunk of it after the
+ * snapshot copies that chunk out for the snapshot. A snapshot costs a few
+ * mappings up front, and then memory and time in proportion to what gets
+ * written, not to the size of the table. Value pointers taken before the
+ * snapshot mustn't be written through after it. Not for EM_ASA_EXACT_KEYS
+ * or EM_ASA_CACHE tables.
+ */
+enum em_asa_flag_e {
+   EM_ASA_EXACT_KEYS = 1 << 0,
+   EM_ASA_ROBIN_HOOD = 1 << 1,
+   EM_ASA_CUCKOO_FILTER = 1 << 2,
+   EM_ASA_CACHE = 1 << 3,
+   EM_ASA_SNAPSHOTS = 1 << 4
+};
+
+/* Options for aa_map.
+ *
+ * EM_ASA_MAP_WRITABLE: The table may be modified. Changes stay private to the
+ * process and are never written back to the image; the pages they touch
+ * are copied by the kernel, and storage that needs resizing by the table.
+ * Without it, set/delete/reserve/egc/empty fail with EM_READ_ONLY.
+ *
+ * EM_ASA_MAP_VERIFY: Check the checksum of the whole image up front, at the
+ * cost of reading all of it in. Only the image header is checked otherwise.
+ */
+enum em_asa_map_e { EM_ASA_MAP_WRITABLE = 1 << 0, EM_ASA_MAP_VERIFY = 1 << 1 };
+
 struct em_asa_id_s {
-   unsigned long probe;
+   unsigned long long probe;
    union {
       struct {
          unsigned long low32;
          unsigned long long high64;
       } isect;
+      struct {
+         unsigned long long high64;
+         const char *key;
+         size_t len;
+      } __attribute__((packed)) xsect; /* Long keys with EM_ASA_EXACT_KEYS */
       char colres[EM_ASA_KEY_COLRES];
    } usect;
-   unsigned char llen;
+   unsigned char llen; /* EM_ASA_LLEN_EXACT for ids using xsect */
 } __attribute__((packed));
 
+#define EM_ASA_LLEN_EXACT 0xFF
+
 typedef struct em_asa_id_s em_asa_id_t;
 
-struct em_asa_hdr_s {
+struct em_asa_slab_s {
    unsigned char tier;
    unsigned long highest_index;
-   unsigned long elements;
    unsigned long ld_elements;
    unsigned long ddepth;
+
+   /* Slot storage is kept as three parallel arrays, so probes only ever
+    * touch control bytes and ids, and values keep their natural alignment.
+    *
+    * CONTROL BYTES: One per slot.
+    * 1 0 0 0 0 0 0 0 - Empty
+    * 1 1 1 1 1 1 1 0 - Lazy-deleted
+    * 0 x x x x x x x - Occupied, low 7 bits are a tag from the probe hash
+    */
+   signed char *ctrl;
+   em_asa_id_t *ids;
+   void *vals;
+
+   /* EM_ASA_ROBIN_HOOD tables only, NULL otherwise: per slot, how many groups
+    * past its home group the element sits, saturating at 254. Tombstones,
+    * which only turn up in an old slab being migrated, are 255. */
+   unsigned char *dist;
+
+   /* EM_ASA_CACHE tables only, NULL otherwise: per slot, the reference bit
+    * (the top one) and the expiry, in seconds past the table's cache epoch
+    * (0 for none). */
+   unsigned int *meta;
+
+   /* Key bytes of the EM_ASA_EXACT_KEYS long keys placed in this slab, in
+    * append-only chunks so ids can point straight into them. Dead bytes are
+    * left behind until the slab is rebuilt. */
+   struct em_asa_kchunk_s *keys;
+   size_t keys_live;
+   size_t keys_dead;
+
+   /* Prefilter over the ids placed in this slab, sized for its tier. Only
+    * present on slabs big enough for it to pay off; filter is NULL otherwise.
+    * EM_ASA_CUCKOO_FILTER tables use cuckoo instead, with table NULL when
+    * there isn't one. */
+   em_bloom_t bloom;
+   em_cuckoo_t cuckoo;
+};
+
+/* Rebuild and lookup counters kept in the table header. The rebuild and
+ * eviction counts are always kept, the rest only when the library is built
+ * with EM_ASA_STATS (the assoca_stats meson option), as they cost a few
+ * stores per lookup.
+ */
+struct em_asa_counters_s {
+   unsigned long grows;
+   unsigned long shrinks;
+   unsigned long compactions; /* Rebuilds at the same tier */
+   unsigned long reforms;
+   unsigned long evictions; /* EM_ASA_CACHE elements evicted by the hand */
+   unsigned long expirations; /* Of those, the ones that had expired */
+
+   /* Of whichever prefilter the table uses */
+   unsigned long bloom_queries;
+   unsigned long bloom_rejects; /* Probes the filter saved */
+   unsigned long bloom_false_positives; /* Passed the filter, then missed */
+};
+
+/* Budget and state of an EM_ASA_CACHE table, see em_i_asa_cache */
+struct em_asa_cache_s {
+   unsigned long limit; /* Elements kept before evicting, 0 for no limit */
+   unsigned char tier; /* Tier the table doesn't grow past, 0 for any */
+   unsigned long ttl; /* Default for aa_set, in seconds, 0 for none */
+   unsigned long long epoch; /* Monotonic clock second expiries count from */
+   unsigned long hand; /* Index the CLOCK sweep carries on from */
+};
+
+struct em_asa_hdr_s {
+   unsigned long elements;
    size_t element_size;
    unsigned long long seed;
-   em_bloom_t bloom;
+   unsigned char hash; /* enum em_asa_hash_e */
+   unsigned int flags; /* enum em_asa_flag_e */
+
+   /* Every element lives in cur, placed for cur's tier. After a growth, old
+    * holds the previous slab until it has been migrated over; old.ctrl is
+    * NULL the rest of the time. */
+   struct em_asa_slab_s cur;
+   struct em_asa_slab_s old;
+   unsigned long mig_pos;
 
-   /* TODO: Support bloom filter */
+   /* Element count set by em_i_asa_reserve that the table won't shrink below */
+   unsigned long reserved;
+
+   /* Decayed lookup/miss counts, used to decide whether slabs have a
+    * prefilter at all */
+   unsigned long lookups;
+   unsigned long misses;
+
+   struct em_asa_counters_s counters;
+   struct em_asa_cache_s cache;
+
+   /* Image the table was mapped from by em_i_asa_map, if any. Storage inside
+    * it is never freed or resized in place. */
+   void *map;
+   size_t map_len;
+   bool map_rdonly;
+
+   /* Set for tables made by em_i_asa_attach, which are mapped as above: the
+    * published table's control object, its name, and the generation the
+    * image is of. NULL otherwise. */
+   struct em_asa_shm_s *shm;
+   char *shm_name;
+   unsigned long long shm_gen;
+
+   /* Set by em_i_asa_freeze: one displacement per bucket of the perfect hash
+    * that cur's elements were packed with, see there. NULL otherwise. A
+    * frozen table is read-only for good, and can't be saved as an image. */
+   unsigned long long *frozen;
+   unsigned long frozen_buckets;
+   unsigned long long frozen_salt;
+
+   /* Where the table, its slabs, key arenas and prefilters are allocated,
+    * see aa_make_alloc */
+   const em_alloc_t *mi;
+
+   /* If set, memory the table lets go of is passed here rather than freed.
+    * The hook then frees it through mi. */
+   void (*retire)(void *ctx, void *ptr);
+   void *retire_ctx;
+
+   /* EM_ASA_SNAPSHOTS tables: the snapshots taken of the table that are still
+    * around. Snapshots made by em_i_asa_snapshot have this NULL and their own
+    * entry in there in snap instead. */
+   struct em_asa_snaps_s *snaps;
+   struct em_asa_snap_s *snap;
 };
 
-struct em_asa_elhdr_s {
-   /* FLAG LAYOUT:
-    * 0 0 0 0 0 0 0 0
-    *           | | \- Occupied
-    *           | \--- Lazy-delete
-    *           \----- Collided
-    */
-   em_asa_id_t id;
-   unsigned char flags;
-} __attribute__((packed));
+#define EM_ASA_STATS_HIST 16
+
+/* Occupancy of one slab, see em_asa_stats_s */
+struct em_asa_slab_stats_s {
+   unsigned char tier;
+   unsigned long capacity; /* Slots addressed by the tier */
+   unsigned long allocated; /* Slots actually backed by storage so far */
+   unsigned long live;
+   unsigned long tombstones;
+   double load; /* (live + tombstones) / capacity */
+   unsigned long max_probe; /* Furthest any element sits from its home group */
+};
+
+/* A snapshot of a table's shape, filled in by aa_stats. Occupancy and probe
+ * lengths are worked out by walking every slot, so this costs about as much
+ * as iterating over the table - it's meant for sizing and monitoring, not for
+ * calling on every operation.
+ *
+ * probe_hist[n] counts the live elements that sit n groups past their home
+ * group, i.e. that take n + 1 group loads to find; the last bucket also takes
+ * everything further out. A healthy table has nearly everything in the first
+ * bucket or two, a long tail means clustered keys or a table that is
+ * overdue for a rebuild.
+ */
+struct em_asa_stats_s {
+   unsigned long elements;
+   size_t bytes; /* Heap memory held by the table */
+   size_t mapped_bytes; /* Image mapped by aa_map, if any */
+
+   struct em_asa_slab_stats_s cur;
+   struct em_asa_slab_stats_s old; /* All zero unless a migration is running */
+
+   unsigned long probe_hist[EM_ASA_STATS_HIST];
+   double probe_mean;
+
+   bool counting; /* Whether the lookup counters below are being kept, which
+                   * they aren't for read-only tables */
+   struct em_asa_counters_s counters;
+};
 
 #define EM_ASA_ID_SZ sizeof(struct em_asa_id_s)
 #define EM_ASA_HR_SZ sizeof(struct em_asa_hdr_s)
-#define EM_ASA_EH_SZ sizeof(struct em_asa_elhdr_s)
 
 EM_EXTERN em_asa_id_t em_i_asa_hrange(void **a, const void *key, size_t amt);
 EM_EXTERN em_status_t em_i_asa_init(void **a, size_t el_size);
+EM_EXTERN em_status_t em_i_asa_inith(void **a, size_t el_size,
+                                     enum em_asa_hash_e hash);
+EM_EXTERN em_status_t em_i_asa_initx(void **a, size_t el_size,
+                                     enum em_asa_hash_e hash,
+                                     unsigned int flags);
+EM_EXTERN em_status_t em_i_asa_inita(void **a, size_t el_size,
+                                     enum em_asa_hash_e hash,
+                                     unsigned int flags,
+                                     const em_alloc_t *allocator);
+EM_EXTERN const void *em_i_asa_getkey(void **a, long idx, size_t *len);
+EM_EXTERN em_status_t em_i_asa_save(void **a, const char *path);
+EM_EXTERN em_status_t em_i_asa_map(void **a, size_t el_size, const char *path,
+                                   unsigned int flags);
+EM_EXTERN em_status_t em_i_asa_publish(void **a, const char *name);
+EM_EXTERN em_status_t em_i_asa_attach(void **a, size_t el_size,
+                                      const char *name);
+EM_EXTERN em_status_t em_i_asa_refresh(void **a);
+EM_EXTERN em_status_t em_i_asa_unpublish(const char *name);
+EM_EXTERN em_status_t em_i_asa_stats(void **a, struct em_asa_stats_s *out);
+EM_EXTERN em_status_t em_i_asa_freeze(void **a);
+EM_EXTERN em_status_t em_i_asa_cache(void **a, unsigned long max_elements,
+                                     size_t max_bytes, unsigned long ttl);
 EM_EXTERN void em_i_asa_destroy(void **a);
 EM_EXTERN em_status_t em_i_asa_empty(void **a);
+EM_EXTERN em_status_t em_i_asa_reserve(void **a, unsigned long n);
+EM_EXTERN em_status_t em_i_asa_build(void **a, const void *keys,
+                                     size_t key_size, const void *values,
+                                     size_t n, unsigned int threads);
+EM_EXTERN em_status_t em_i_asa_merge(void **a, void **src,
+                                     unsigned int threads);
+EM_EXTERN em_status_t em_i_asa_snapshot(void **a, void **out);
+EM_EXTERN bool em_i_asa_snapok(void **a);
+EM_EXTERN void *em_i_asa_getvpk(void **a, long idx);
+EM_EXTERN long em_i_asa_next(void **a, long idx);
+EM_EXTERN em_status_t em_i_asa_foreach(void **a,
+                                       void (*fn)(long idx, unsigned int t,
+                                                  void *ctx),
+                                       void *ctx, unsigned int threads);
 EM_EXTERN long em_i_asa_lookup(void **a, em_asa_id_t id);
+EM_EXTERN size_t em_i_asa_lookup_batch(void **a, const em_asa_id_t *ids,
+                                       size_t n, long *out);
+EM_EXTERN size_t em_i_asa_getp_batch(void **a, const em_asa_id_t *ids,
+                                     size_t n, void **out);
 EM_EXTERN em_status_t em_i_asa_set(void **a, em_asa_id_t id, void *value);
+EM_EXTERN em_status_t em_i_asa_setttl(void **a, em_asa_id_t id, void *value,
+                                      unsigned long ttl);
 EM_EXTERN em_status_t em_i_asa_reform(void **a, bool forced);
 EM_EXTERN em_status_t em_i_asa_delete(void **a, em_asa_id_t id);
@@ -3,20 +3,85 @@
 #include <stdbool.h>
 #include <stddef.h>
 
+#include "buf.h"
 #include "status.h"
 
+/* Bloom filter. Made with em_bloom_mk/mkk/mka, each of an id's k bits may be
+ * anywhere in the filter. Made with em_bloom_mkb/mkba, the filter is blocked
+ * (Putze et al., "Cache-, Hash- and Space-Efficient Bloom Filters"): an id
+ * picks one EM_BLOOM_BLOCK byte block and sets all k of its bits in there, so
+ * a test is one cache miss and a single SIMD compare whatever k is, for a
+ * slightly higher false positive rate at the same size. Blocks sit on cache
+ * lines and there's a power of two of them, the size being rounded up. */
+
+#define EM_BLOOM_BLOCK 64
+
 struct em_bloom_s {
    size_t bytes;
    size_t capacity;
+   unsigned int hashes;
 
    char *filter;
    unsigned long long seed;
+
+   /* Blocked filters only, 0 otherwise: the number of blocks, and where the
+    * first of them starts in filter, which is allocated with room to spare
+    * to line them up. bytes leaves that out. */
+   size_t blocks;
+   size_t offset;
+
+   const em_alloc_t *mi;
 };
 
 typedef struct em_bloom_s em_bloom_t;
 
 em_status_t em_bloom_mk(em_bloom_t *target, size_t bytes);
+em_status_t em_bloom_mkk(em_bloom_t *target, size_t bytes,
+                         unsigned int hashes);
+em_status_t em_bloom_mka(em_bloom_t *target, size_t bytes, unsigned int hashes,
+                         const em_alloc_t *allocator);
+em_status_t em_bloom_mkb(em_bloom_t *target, size_t bytes,
+                         unsigned int hashes);
+em_status_t em_bloom_mkba(em_bloom_t *target, size_t bytes,
+                          unsigned int hashes, const em_alloc_t *allocator);
+
+/* Sized for a number of items and a false positive rate to hold them at, as
+ * a classic filter with the fewest bits that do, and the k that suits them */
+em_status_t em_bloom_mkp(em_bloom_t *target, size_t items, double fpr);
+em_status_t em_bloom_mkpa(em_bloom_t *target, size_t items, double fpr,
+                          const em_alloc_t *allocator);
 void em_bloom_add(em_bloom_t *target, const void *data, size_t size);
 bool em_bloom_in(em_bloom_t *target, const void *data, size_t size);
+
+/* Split-phase variants: hash once with em_bloom_hash(), then prefetch, add or
+ * test using the hash. Lets callers overlap the filter's cache misses. Any
+ * well mixed 64-bit hash will do, so callers that already hold one for the
+ * key can skip em_bloom_hash() entirely. */
+unsigned long long em_bloom_hash(em_bloom_t *target, const void *data,
+                                 size_t size);
+void em_bloom_addh(em_bloom_t *target, unsigned long long hash);
+bool em_bloom_inh(const em_bloom_t *target, unsigned long long hash);
+void em_bloom_prefetch(const em_bloom_t *target, unsigned long long hash);
 void em_bloom_empty(em_bloom_t *target);
 void em_bloom_free(em_bloom_t *target);
+
+/* Set operations, into target. Both filters need the same size, k, seed and
+ * kind, which filters made apart only have if the seed of one is copied to
+ * the other before anything is added, or if they're both loaded from one
+ * em_bloom_save(). A union is exactly the filter of both sets; an
+ * intersection may hold bits of ids in only one of them, so it lets a few
+ * more of those through than a filter of just the shared ids would. */
+em_status_t em_bloom_union(em_bloom_t *target, const em_bloom_t *other);
+em_status_t em_bloom_intersect(em_bloom_t *target, const em_bloom_t *other);
+
+/* Estimated number of distinct ids added, from the bits set. INFINITY once
+ * every bit is. */
+double em_bloom_card(const em_bloom_t *target);
+
+/* A filter as a self-contained run of bytes, to be sent elsewhere and made
+ * into a filter again with em_bloom_load(), which checks it over and returns
+ * EM_BAD_IMAGE if anything is off. out is resized to fit. Everything is
+ * written little-endian, so a filter loads on a host of either byte order. */
+em_status_t em_bloom_save(const em_bloom_t *target, em_buf_t *out);
+em_status_t em_bloom_load(em_bloom_t *target, const em_buf_t *in,
+                          const em_alloc_t *allocator);
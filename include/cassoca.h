@@ -0,0 +1,66 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "assoca.h"
+#include "gdefs.h"
+#include "status.h"
+
+/* Concurrent assoca. The table is split into 2^bits shards, each an ordinary
+ * assoca guarded by its own writer mutex and sequence counter. Readers never
+ * lock: they validate what they read against the shard's sequence counter and
+ * retry if a writer got in the way, while memory the writers let go of is only
+ * freed once every reader that might still see it has finished.
+ *
+ * Values are copied out rather than handed back by pointer, since a pointer
+ * into a shard could be invalidated by a writer at any moment. Ids must come
+ * from ca_bh/ca_sh/ca_vh, as every shard shares the same hash seed.
+ */
+
+#ifndef EM_CASA_NO_SIMPLIFIED
+#define ca_make __em_casa_mk
+#define ca_free __em_casa_destroy
+#define ca_count __em_casa_count
+#define ca_in __em_casa_in
+#define ca_get __em_casa_get
+#define ca_set __em_casa_set
+#define ca_del __em_casa_rem
+#ifndef EM_CASA_NO_SIMPLE_HASHES
+#define ca_bh __em_casa_bh
+#define ca_sh __em_casa_sh
+#define ca_vh __em_casa_vh
+#endif
+#endif
+
+#define __em_casa_mk(type, bits)                                               \
+   ((type *)em_i_casa_init(sizeof(type), (bits)))
+#define __em_casa_destroy(m) (em_i_casa_destroy((m)), (m) = NULL)
+#define __em_casa_count(m) (em_i_casa_count((m)))
+#define __em_casa_in(m, id) (em_i_casa_get((m), (id), NULL))
+#define __em_casa_get(m, id, o)                                                \
+   ({                                                                          \
+      __typeof__(m) __80tmp = (o);                                             \
+      em_i_casa_get((m), (id), __80tmp);                                       \
+   })
+#define __em_casa_set(m, id, i)                                                \
+   ({                                                                          \
+      __typeof__(m[0]) __79tmp = (i);                                          \
+      em_i_casa_set((m), (id), &__79tmp);                                      \
+   })
+#define __em_casa_rem(m, id) (em_i_casa_delete((m), (id)))
+
+#define __em_casa_bh(m, r, s) (em_i_casa_hrange((m), (r), (s)))
+#define __em_casa_sh(m, t) (__em_casa_bh((m), (t), strlen((t))))
+#define __em_casa_vh(m, v)                                                     \
+   ({                                                                          \
+      __typeof__(v) __78tmp = (v);                                             \
+      (__em_casa_bh((m), &__78tmp, sizeof(__78tmp)));                          \
+   })
+
+EM_EXTERN void *em_i_casa_init(size_t el_size, unsigned int bits);
+EM_EXTERN void em_i_casa_destroy(void *c);
+EM_EXTERN em_asa_id_t em_i_casa_hrange(void *c, const void *key, size_t amt);
+EM_EXTERN unsigned long em_i_casa_count(void *c);
+EM_EXTERN bool em_i_casa_get(void *c, em_asa_id_t id, void *out);
+EM_EXTERN em_status_t em_i_casa_set(void *c, em_asa_id_t id, void *value);
+EM_EXTERN em_status_t em_i_casa_delete(void *c, em_asa_id_t id);
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "buf.h"
+#include "status.h"
+
+/* Cuckoo filter (Fan et al., "Cuckoo Filter: Practically Better Than Bloom").
+ * Like a bloom filter it answers "maybe" or "definitely not", but it stores a
+ * small fingerprint per entry in one of two candidate buckets, so entries can
+ * be deleted again. Only delete what was actually added, or the fingerprint of
+ * something else may go with it.
+ *
+ * Buckets hold EM_CUCKOO_SLOTS fingerprints of 8 or 16 bits; 16-bit ones cost
+ * twice the memory for a false positive rate about 256 times lower. Both
+ * candidate buckets are matched in a single SSE2 compare where available.
+ */
+
+#define EM_CUCKOO_SLOTS 4
+
+struct em_cuckoo_s {
+   size_t buckets; /* Always a power of two */
+   size_t count;
+   unsigned int fp_bits;
+
+   void *table;
+   unsigned long long seed;
+
+   /* An insert that runs out of kicks leaves the last fingerprint it
+    * displaced here, and the filter counts as full until a delete makes
+    * room for it again. */
+   size_t victim_bucket;
+   uint16_t victim_fp; /* 0 if there is no victim */
+
+   const em_alloc_t *mi;
+};
+
+typedef struct em_cuckoo_s em_cuckoo_t;
+
+em_status_t em_cuckoo_mk(em_cuckoo_t *target, size_t capacity);
+em_status_t em_cuckoo_mkf(em_cuckoo_t *target, size_t capacity,
+                          unsigned int fp_bits);
+em_status_t em_cuckoo_mka(em_cuckoo_t *target, size_t capacity,
+                          unsigned int fp_bits, const em_alloc_t *allocator);
+em_status_t em_cuckoo_add(em_cuckoo_t *target, const void *data, size_t size);
+bool em_cuckoo_in(const em_cuckoo_t *target, const void *data, size_t size);
+em_status_t em_cuckoo_del(em_cuckoo_t *target, const void *data, size_t size);
+
+/* Split-phase variants, as with em_bloom_hash(). The low bits of the hash pick
+ * the bucket and the top bits make the fingerprint, so a caller passing in a
+ * hash it already has should make sure those two are independent. */
+unsigned long long em_cuckoo_hash(const em_cuckoo_t *target, const void *data,
+                                  size_t size);
+em_status_t em_cuckoo_addh(em_cuckoo_t *target, unsigned long long hash);
+bool em_cuckoo_inh(const em_cuckoo_t *target, unsigned long long hash);
+em_status_t em_cuckoo_delh(em_cuckoo_t *target, unsigned long long hash);
+void em_cuckoo_prefetch(const em_cuckoo_t *target, unsigned long long hash);
+size_t em_cuckoo_bytes(const em_cuckoo_t *target);
+void em_cuckoo_empty(em_cuckoo_t *target);
+void em_cuckoo_free(em_cuckoo_t *target);
@@ -3,11 +3,14 @@
 #include "assoca.h"
 #include "bloom.h"
 #include "buf.h"
+#include "cassoca.h"
+#include "cuckoo.h"
 #include "entropygen.h"
 #include "gdefs.h"
 #include "mt19937-64.h"
 #include "pstruct.h"
 #include "status.h"
 #include "svec.h"
+#include "tassoca.h"
 #include "util.h"
 #include "pdrt.h"
@@ -14,7 +14,10 @@ enum em_status_codes_e {
    EM_EL_NOT_FOUND,
    EM_INT_OVERFLOW,
    EM_CF_FAILURE,
-   EM_INIT_FAILURE
+   EM_INIT_FAILURE,
+   EM_IO_FAILURE,
+   EM_BAD_IMAGE,
+   EM_READ_ONLY
 };
 
 typedef unsigned char em_status_t;
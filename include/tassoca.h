@@ -0,0 +1,325 @@
+#pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "buf.h"
+#include "gdefs.h"
+#include "status.h"
+
+/* Typed assoca. EM_TASA_DEFINE(name, ktype, vtype) generates a table type,
+ * em_tasa_name_t, and static inline functions for it, for keys of an integer
+ * or pointer type of up to 8 bytes. Where an assoca turns every key into a
+ * packed em_asa_id_t and compares those, these keep the key itself in the
+ * slot, compare it with a single ==, and hash it with an inlined 64-bit mixer
+ * under a per-table random seed. A slot costs a control byte plus the key and
+ * the value: 13 bytes for a uint64_t -> uint32_t map.
+ *
+ * The slots are matched 16 at a time against control bytes like an assoca's,
+ * with groups probed in a triangular sequence, but the table is rebuilt all
+ * at once when it fills up rather than migrated bit by bit, and never shrinks
+ * by itself. Value pointers are only good until the next set.
+ *
+ * Define EM_TASA_DEFINE once per key/value pair in a translation unit (or a
+ * header, the functions are static), then use the ta_* macros with its name:
+ *
+ *    EM_TASA_DEFINE(u64u32, uint64_t, uint32_t)
+ *
+ *    em_tasa_u64u32_t *t = ta_make(u64u32);
+ *    ta_set(u64u32, t, 42, 7);
+ *    uint32_t *v = ta_getptr(u64u32, t, 42);
+ */
+
+#ifndef EM_TASA_NO_SIMPLIFIED
+#define ta_make(n) (em_tasa_##n##_mka(NULL))
+#define ta_make_alloc(n, mi) (em_tasa_##n##_mka((mi)))
+#define ta_free(n, t) (em_tasa_##n##_free((t)), (t) = NULL)
+#define ta_count(n, t) ((t)->count)
+#define ta_in(n, t, k) (em_tasa_##n##_getp((t), (k)) != NULL)
+#define ta_getptr(n, t, k) (em_tasa_##n##_getp((t), (k)))
+#define ta_get(n, t, k) (*(em_tasa_##n##_getp((t), (k))))
+#define ta_set(n, t, k, v) (em_tasa_##n##_set((t), (k), (v)))
+#define ta_del(n, t, k) (em_tasa_##n##_del((t), (k)))
+#define ta_reserve(n, t, c) (em_tasa_##n##_reserve((t), (c)))
+#endif
+
+#define EM_TASA_GRP_LOG2 4
+#define EM_TASA_GROUP (1 << EM_TASA_GRP_LOG2)
+
+/* EVERYTHING BELOW THIS LINE IS PRIVATE */
+
+#define EM_I_TASA_EMPTY ((signed char)-128)
+#define EM_I_TASA_DELETE ((signed char)-2)
+#define EM_I_TASA_TAG(h) ((signed char)((h) >> 57)) /* Top 7 bits */
+#define EM_I_TASA_MAXLOAD(t) (((t)->mask + 1) * EM_TASA_GROUP / 8 * 7)
+
+EM_EXTERN unsigned long long em_i_tasa_seed(void);
+
+static inline unsigned long long em_i_tasa_hash(const void *key, size_t size,
+                                                unsigned long long seed)
+{
+   /* The key's bits, zero-extended to 64, through the MurmurHash3 finalizer.
+    * Low bits pick the home group and the top 7 make the control tag. */
+
+   unsigned long long k = 0;
+
+   memcpy(&k, key, size);
+
+   k ^= seed;
+   k ^= k >> 33;
+   k *= 0xFF51AFD7ED558CCDULL;
+   k ^= k >> 33;
+   k *= 0xC4CEB9FE1A85EC53ULL;
+   k ^= k >> 33;
+
+   return k;
+}
+
+static inline unsigned em_i_tasa_gmatch(const signed char *g, signed char c)
+{
+   /* Returns a bitmask of the slots in the group whose control byte is c */
+
+#ifdef __SSE2__
+   return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(
+      _mm_loadu_si128((const __m128i *)g), _mm_set1_epi8(c)));
+#else
+   unsigned int m = 0;
+
+   for (unsigned int x = 0; x < EM_TASA_GROUP; x++)
+      m |= (unsigned int)(g[x] == c) << x;
+
+   return m;
+#endif
+}
+
+static inline unsigned em_i_tasa_gfree(const signed char *g)
+{
+   /* Returns a bitmask of the empty or deleted slots in the group */
+
+#ifdef __SSE2__
+   return (unsigned)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)g));
+#else
+   unsigned int m = 0;
+
+   for (unsigned int x = 0; x < EM_TASA_GROUP; x++)
+      m |= (unsigned int)(g[x] < 0) << x;
+
+   return m;
+#endif
+}
+
+#define EM_TASA_DEFINE(name, ktype, vtype)                                     \
+   _Static_assert(sizeof(ktype) <= 8, "typed assoca keys are up to 8 bytes");  \
+                                                                               \
+   typedef struct em_tasa_##name##_s {                                         \
+      size_t count;                                                            \
+      size_t deleted; /* Tombstones */                                         \
+      size_t mask;    /* Groups - 1, always a power of two less one */         \
+      unsigned long long seed;                                                 \
+      signed char *ctrl;                                                       \
+      ktype *keys;                                                             \
+      vtype *vals;                                                             \
+      const em_alloc_t *mi;                                                    \
+   } em_tasa_##name##_t;                                                       \
+                                                                               \
+   static inline void em_i_tasa_##name##_place(                                \
+      em_tasa_##name##_t *t, ktype key, vtype value, unsigned long long h)     \
+   {                                                                           \
+      /* Puts a key that isn't in the table into its first free slot */       \
+      size_t g = h & t->mask;                                                  \
+      unsigned int m;                                                          \
+                                                                               \
+      for (size_t step = 1;                                                    \
+           !(m = em_i_tasa_gfree(t->ctrl + (g << EM_TASA_GRP_LOG2)));          \
+           step++)                                                             \
+         g = (g + step) & t->mask;                                             \
+                                                                               \
+      size_t slot = (g << EM_TASA_GRP_LOG2) + __builtin_ctz(m);                \
+                                                                               \
+      if (t->ctrl[slot] == EM_I_TASA_DELETE)                                   \
+         t->deleted--;                                                         \
+                                                                               \
+      t->ctrl[slot] = EM_I_TASA_TAG(h);                                        \
+      t->keys[slot] = key;                                                     \
+      t->vals[slot] = value;                                                   \
+      t->count++;                                                              \
+   }                                                                           \
+                                                                               \
+   static inline em_status_t em_i_tasa_##name##_rehash(em_tasa_##name##_t *t, \
+                                                       size_t groups)          \
+   {                                                                           \
+      /* Moves everything into freshly allocated arrays of `groups` groups, \
+       * leaving the tombstones behind. The table is left as it was if that \
+       * can't be allocated. */                                                \
+      size_t slots = groups << EM_TASA_GRP_LOG2;                               \
+      em_tasa_##name##_t fresh = { .mask = groups - 1,                         \
+                                   .seed = t->seed,                            \
+                                   .mi = t->mi };                              \
+                                                                               \
+      fresh.ctrl = t->mi->realloc(t->mi->udata, NULL, slots);                  \
+      fresh.keys = t->mi->realloc(t->mi->udata, NULL, slots * sizeof(ktype));  \
+      fresh.vals = t->mi->realloc(t->mi->udata, NULL, slots * sizeof(vtype));  \
+                                                                               \
+      if (!fresh.ctrl || !fresh.keys || !fresh.vals) {                         \
+         t->mi->free(t->mi->udata, fresh.ctrl);                                \
+         t->mi->free(t->mi->udata, fresh.keys);                                \
+         t->mi->free(t->mi->udata, fresh.vals);                                \
+         return EM_OUT_OF_MEMORY;                                              \
+      }                                                                        \
+                                                                               \
+      memset(fresh.ctrl, EM_I_TASA_EMPTY, slots);                              \
+                                                                               \
+      for (size_t x = 0; t->ctrl && x <= (t->mask << EM_TASA_GRP_LOG2 |        \
+                                          (EM_TASA_GROUP - 1));                \
+           x++)                                                                \
+         if (t->ctrl[x] >= 0)                                                  \
+            em_i_tasa_##name##_place(                                          \
+               &fresh, t->keys[x], t->vals[x],                                 \
+               em_i_tasa_hash(&t->keys[x], sizeof(ktype), t->seed));           \
+                                                                               \
+      t->mi->free(t->mi->udata, t->ctrl);                                      \
+      t->mi->free(t->mi->udata, t->keys);                                      \
+      t->mi->free(t->mi->udata, t->vals);                                      \
+      *t = fresh;                                                              \
+                                                                               \
+      return EM_STATUS_OKAY;                                                   \
+   }                                                                           \
+                                                                               \
+   static inline long em_i_tasa_##name##_find(const em_tasa_##name##_t *t,    \
+                                              ktype key,                       \
+                                              unsigned long long h)            \
+   {                                                                           \
+      /* A group with an empty slot never had a probe run on past it */       \
+      signed char tag = EM_I_TASA_TAG(h);                                      \
+      size_t g = h & t->mask;                                                  \
+                                                                               \
+      for (size_t step = 1; step <= t->mask + 1; g = (g + step++) & t->mask) { \
+         const signed char *ctrl = t->ctrl + (g << EM_TASA_GRP_LOG2);          \
+                                                                               \
+         for (unsigned int m = em_i_tasa_gmatch(ctrl, tag); m; m &= m - 1) {   \
+            size_t slot = (g << EM_TASA_GRP_LOG2) + __builtin_ctz(m);          \
+            if (t->keys[slot] == key)                                          \
+               return (long)slot;                                              \
+         }                                                                     \
+                                                                               \
+         if (em_i_tasa_gmatch(ctrl, EM_I_TASA_EMPTY))                          \
+            break;                                                             \
+      }                                                                        \
+                                                                               \
+      return -1;                                                               \
+   }                                                                           \
+                                                                               \
+   static inline em_tasa_##name##_t *em_tasa_##name##_mka(                     \
+      const em_alloc_t *allocator)                                             \
+   {                                                                           \
+      const em_alloc_t *mi = allocator ? allocator : EM_GLOBAL_ALLOC;          \
+      em_tasa_##name##_t *t = mi->realloc(mi->udata, NULL, sizeof(*t));        \
+                                                                               \
+      if (!t)                                                                  \
+         return NULL;                                                          \
+                                                                               \
+      *t = (em_tasa_##name##_t){ .seed = em_i_tasa_seed(), .mi = mi };         \
+                                                                               \
+      if (em_i_tasa_##name##_rehash(t, 1) != EM_STATUS_OKAY) {                 \
+         mi->free(mi->udata, t);                                               \
+         return NULL;                                                          \
+      }                                                                        \
+                                                                               \
+      return t;                                                                \
+   }                                                                           \
+                                                                               \
+   static inline void em_tasa_##name##_free(em_tasa_##name##_t *t)             \
+   {                                                                           \
+      if (!t)                                                                  \
+         return;                                                               \
+                                                                               \
+      t->mi->free(t->mi->udata, t->ctrl);                                      \
+      t->mi->free(t->mi->udata, t->keys);                                      \
+      t->mi->free(t->mi->udata, t->vals);                                      \
+      t->mi->free(t->mi->udata, t);                                            \
+   }                                                                           \
+                                                                               \
+   static inline vtype *em_tasa_##name##_getp(const em_tasa_##name##_t *t,    \
+                                              ktype key)                       \
+   {                                                                           \
+      long slot = em_i_tasa_##name##_find(                                     \
+         t, key, em_i_tasa_hash(&key, sizeof(ktype), t->seed));                \
+                                                                               \
+      return slot < 0 ? NULL : &t->vals[slot];                                 \
+   }                                                                           \
+                                                                               \
+   static inline em_status_t em_tasa_##name##_set(em_tasa_##name##_t *t,      \
+                                                  ktype key, vtype value)      \
+   {                                                                           \
+      /* Past the max load, grows if live elements fill over half of it, and \
+       * just clears the tombstones out otherwise */                           \
+      unsigned long long h = em_i_tasa_hash(&key, sizeof(ktype), t->seed);     \
+      long slot = em_i_tasa_##name##_find(t, key, h);                          \
+                                                                               \
+      if (slot >= 0) {                                                         \
+         t->vals[slot] = value;                                                \
+         return EM_STATUS_OKAY;                                                \
+      }                                                                        \
+                                                                               \
+      if (t->count + t->deleted >= EM_I_TASA_MAXLOAD(t)) {                     \
+         size_t groups = t->mask + 1;                                          \
+                                                                               \
+         if (t->count >= EM_I_TASA_MAXLOAD(t) / 2) {                           \
+            if (groups > SIZE_MAX / 2 / EM_TASA_GROUP / sizeof(ktype))         \
+               return EM_INT_OVERFLOW;                                         \
+            groups *= 2;                                                       \
+         }                                                                     \
+                                                                               \
+         em_status_t stat = em_i_tasa_##name##_rehash(t, groups);              \
+         if (stat != EM_STATUS_OKAY)                                           \
+            return stat;                                                       \
+      }                                                                        \
+                                                                               \
+      em_i_tasa_##name##_place(t, key, value, h);                              \
+                                                                               \
+      return EM_STATUS_OKAY;                                                   \
+   }                                                                           \
+                                                                               \
+   static inline em_status_t em_tasa_##name##_del(em_tasa_##name##_t *t,      \
+                                                  ktype key)                   \
+   {                                                                           \
+      long slot = em_i_tasa_##name##_find(                                     \
+         t, key, em_i_tasa_hash(&key, sizeof(ktype), t->seed));                \
+                                                                               \
+      if (slot < 0)                                                            \
+         return EM_EL_NOT_FOUND;                                               \
+                                                                               \
+      /* As in an assoca, a group that still has an empty slot can have its \
+       * slot emptied, anything else needs a tombstone */                      \
+      if (em_i_tasa_gmatch(t->ctrl + (slot & ~(long)(EM_TASA_GROUP - 1)),      \
+                           EM_I_TASA_EMPTY)) {                                 \
+         t->ctrl[slot] = EM_I_TASA_EMPTY;                                      \
+      } else {                                                                 \
+         t->ctrl[slot] = EM_I_TASA_DELETE;                                     \
+         t->deleted++;                                                         \
+      }                                                                        \
+                                                                               \
+      t->count--;                                                              \
+                                                                               \
+      return EM_STATUS_OKAY;                                                   \
+   }                                                                           \
+                                                                               \
+   static inline em_status_t em_tasa_##name##_reserve(em_tasa_##name##_t *t,  \
+                                                      size_t n)                \
+   {                                                                           \
+      /* Grows the table so n elements fit without a rebuild */               \
+      size_t groups = t->mask + 1;                                             \
+                                                                               \
+      while (n > groups * EM_TASA_GROUP / 8 * 7) {                             \
+         if (groups > SIZE_MAX / 2 / EM_TASA_GROUP / sizeof(ktype))            \
+            return EM_INT_OVERFLOW;                                            \
+         groups *= 2;                                                          \
+      }                                                                        \
+                                                                               \
+      return groups > t->mask + 1 ? em_i_tasa_##name##_rehash(t, groups) :    \
+                                    EM_STATUS_OKAY;                            \
+   }
@@ -13,45 +13,419 @@
  *   Copyright (c) Naphtha Nepanthez 2021 <naphtha@lotte.link>
  * \*-------------------------------------------------------------------------*/
 
+#define _GNU_SOURCE /* For mremap */
+
 #include "../include/assoca.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#define XXH_STATIC_LINKING_ONLY /* For a stack-allocated XXH3_state_t */
 #include <xxhash.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define EM_ASA_HAVE_CRC32C
+#endif
 
 #include "../include/mt19937-64.h"
 #include "../include/util.h"
 
-#define EM_ASA_MIN_TIER 2
-#define EM_ASA_MAX_TIER 30
-#define EM_ASA_BLOOM_SZ 4096
+#define EM_ASA_MIN_TIER 3 /* A table must hold at least one control group */
+#define EM_ASA_MAX_TIER 46 /* Keeps home group bits below the control tag */
+#define EM_ASA_BLOOM_MIN_TIER 12 /* Smaller slabs are cheap enough to probe */
+#define EM_ASA_BLOOM_K 4 /* Bits per id, the filter holds 4 bits per slot */
+#define EM_ASA_BLOOM_SAMPLE 1024 /* Lookups needed to judge the miss rate */
+#define EM_ASA_BATCH 16 /* Keys in flight per em_i_asa_lookup_batch round */
+#define EM_ASA_GRP_LOG2 4
+#define EM_ASA_GROUP (1 << EM_ASA_GRP_LOG2) /* Slots matched per SSE2 load */
+#define EM_ASA_MIG_STEP 32 /* Old slots migrated per set/delete */
+#define EM_ASA_SHRINK_DIV 8 /* Shrink below 1/8 of the max load */
+#define EM_ASA_KCHUNK 65536 /* Key arena chunk size */
+#define EM_ASA_KSLACK 65536 /* Dead key bytes tolerated before compacting */
+#define EM_ASA_RH_MAX 254 /* Robin Hood distances saturate here */
+#define EM_ASA_RH_DEAD 255 /* Distance of a tombstone, see em_asa_slab_s */
+#define EM_ASA_RH_CARRY 256 /* Displaced values up to this size go on stack */
+#define EM_ASA_FROZEN_LAMBDA 4 /* Elements per perfect hash bucket */
+#define EM_ASA_FROZEN_D0 16 /* Second hash multiples tried per bucket */
+#define EM_ASA_FROZEN_MAXB 64 /* Bigger buckets just mean a bad salt */
+#define EM_ASA_FROZEN_TRIES 8 /* Salts tried before em_i_asa_freeze gives up */
+#define EM_ASA_CACHE_REF 0x80000000U /* Reference bit of a cache meta entry */
+#define EM_ASA_BULK_MIN 16384 /* Elements a bulk insert thread is started for */
+#define EM_ASA_BULK_PARTS 8 /* Partitions per thread, to even the load out */
+#define EM_ASA_EACH_MIN 65536 /* Slots a foreach thread is started for */
+#define EM_ASA_IMG_MAGIC "EMASAIMG"
+#define EM_ASA_IMG_VERSION 4
+#define EM_ASA_IMG_SECTS 5
+#define EM_ASA_IMG_ORDER 0x01020304 /* Reads back differently across endians */
+#define EM_ASA_IMG_ALIGN 64 /* Image sections start on a cache line */
+#define EM_ASA_SHM_MAGIC "EMASASHM"
+#define EM_ASA_SHM_NAME 256 /* Longest shared memory name, and then some */
+#define EM_ASA_HUGE_MIN (4UL << 20) /* Arrays given huge pages from this size */
+#define EM_ASA_HUGE_PAGE (2UL << 20)
+#define EM_ASA_SNAP_PAD 64 /* Ahead of a shared array, holding its length */
+#define EM_ASA_SNAP_CHUNK (64UL << 10) /* Least a snapshot copies out at once */
+#define EM_ASA_SNAP_CHUNKS 4096 /* Most chunks an array is split into */
+#define EM_ASA_SNAP_ARRAYS 4 /* Control bytes, ids, values, distances */
 
 #define I_PREPHDR struct em_asa_hdr_s *header = *a;
 #define I_REINHDR header = *a;
-#define I_TELS_HS (header->element_size + EM_ASA_EH_SZ)
+#define I_VALP(s, i) ((char *)(s)->vals + (size_t)(i)*header->element_size)
 
-#define I_TIERCLM(x) (0xFFFFFFFF >> (31 - (x))) /* TM i31 UU */
-#define I_LOG2LNG(n) (31 - __builtin_clz(n))
+#define I_TIERCLM(x) (~0ULL >> (63 - (x)))
+#define I_LOG2LNG(n) (63 - __builtin_clzll(n))
 #define I_KEYICMP(a, b) (memcmp((a), (b), sizeof(em_asa_id_t)) == 0)
-#define I_PROBEMC(k, t) ((5 * k + (header->seed | 1)) & I_TIERCLM(t))
-
-enum em_asa_flags_e { FL_OCCUPY = 1, FL_DELETE = 2, FL_COLLIS = 4 };
+#define I_ISEXACT(id)                                                          \
+   (header->flags & EM_ASA_EXACT_KEYS && (id)->llen == EM_ASA_LLEN_EXACT)
+#define I_GRPMASK(t) (I_TIERCLM(t) >> EM_ASA_GRP_LOG2)
+#define I_PROBEGC(g, t) ((5 * (g) + (header->seed | 1)) & I_GRPMASK(t))
+#define I_HOMEGRP(p, t) (((p)&I_TIERCLM(t)) >> EM_ASA_GRP_LOG2)
+#define I_CTRLTAG(p) ((signed char)(((p) >> (EM_ASA_MAX_TIER + 1)) & 0x7F))
+#define I_ISRH (header->flags & EM_ASA_ROBIN_HOOD)
+#define I_MAXLOAD(t)                                                           \
+   ((unsigned long)((I_ISRH ? 7.0L / 8.0L : 2.0L / 3.0L) *                     \
+                    (double)(I_TIERCLM(t) + 1)))
+#define I_BLOOMH(p) ((p) >> 32 | (p) << 32) /* Upper probe bits come first */
+#define I_PFHAS(s) ((s)->bloom.filter || (s)->cuckoo.table)
+#define I_RDONLY (header->map_rdonly || header->frozen)
+#define I_ISCACHE (header->flags & EM_ASA_CACHE)
+#define I_CACHELIM(t) (I_MAXLOAD(t) / 4 * 3) /* Leaves room for tombstones */
+#define I_FRANGE(x, n) ((unsigned long)((uint64_t)(uint32_t)(x) * (n) >> 32))
+#define I_FHASH(p) em_i_asa_fmix((p) ^ header->frozen_salt)
+#define I_FBUCKET(h) I_FRANGE((h) >> 32, header->frozen_buckets)
+#define I_FWRAP(s, n) ((s) >= (n) ? (s) - (n) : (s)) /* For s below 2n */
+#define I_BULKCUT(b, t, of) ((of) * (t) / (b)->threads) /* Thread t's share */
+#define I_BULKPART(b, p)                                                       \
+   (I_HOMEGRP((p), header->cur.tier) >> ((b)->gbits - (b)->pbits))
+#define I_BULKVAL(b, x)                                                        \
+   ((b)->vals + ((b)->smap ? (b)->smap[x] : (x)) * header->element_size)
+#define I_IMGALIGN(o)                                                          \
+   (((o) + EM_ASA_IMG_ALIGN - 1) & ~(uint64_t)(EM_ASA_IMG_ALIGN - 1))
+/* Read-only tables, snapshots among them, may be read from many threads at
+ * once, so lookups on them leave the counters be */
+#define I_TALLIES (!header->map_rdonly)
+#ifdef EM_ASA_STATS
+#define I_COUNT(f) (I_TALLIES ? (void)header->counters.f++ : (void)0)
+#else
+#define I_COUNT(f) ((void)0)
+#endif
+#define I_KEEP(s, lo, hi)                                                      \
+   (header->snaps && __atomic_load_n(&header->snaps->list, __ATOMIC_ACQUIRE) ? \
+       em_i_asa_keep(header, (s), (lo), (hi)) :                                \
+       (void)0)
+#define I_MIGSTEP(h)                                                           \
+   ((unsigned long)EM_ASA_MIG_STEP                                             \
+    << ((h)->old.tier > (h)->cur.tier ? (h)->old.tier - (h)->cur.tier : 0))
+
+/* Control byte values. A full slot holds a 7-bit tag taken from its probe
+ * hash, so both special values have the sign bit set and a group's free slots
+ * fall straight out of a movemask. */
+enum em_asa_ctrl_e { CT_EMPTY = -128, CT_DELETE = -2 };
+
+/* A chunk of a slab's key arena. Chunks are never resized, so ids can keep
+ * pointers into them for as long as the slab lives. */
+struct em_asa_kchunk_s {
+   struct em_asa_kchunk_s *next;
+   size_t used;
+   size_t size;
+   char data[];
+};
+
+/* Header of a table image written by em_i_asa_save. Everything past it is the
+ * current slab's control bytes, ids, values, Robin Hood distances and bloom
+ * filter, in that order
+ * and each at its offset, so a mapped image can be probed in place. Fields are
+ * fixed-width and ordered so the struct has no padding, and ids and values are
+ * stored exactly as they are in memory - an image only reads back on a build
+ * with the same id layout and byte order, which is what the checks are for.
+ */
+struct em_asa_image_s {
+   char magic[8];
+   uint32_t version;
+   uint32_t byte_order;
+   uint32_t header_size;
+   uint32_t id_size;
+   uint64_t element_size;
+   uint64_t elements;
+   uint64_t seed;
+   uint64_t hash;
+   uint64_t flags;
+   uint64_t reserved;
+   uint64_t tier;
+   uint64_t highest_index;
+   uint64_t ld_elements;
+   uint64_t ddepth;
+   uint64_t ctrl_off;
+   uint64_t ids_off;
+   uint64_t vals_off;
+   uint64_t dist_off;
+   uint64_t bloom_off;
+   uint64_t bloom_bytes;
+   uint64_t bloom_hashes;
+   uint64_t bloom_seed;
+   uint64_t bloom_blocks; /* 0 if the filter isn't blocked */
+   uint64_t size;        /* Of the whole image */
+   uint64_t payload_sum; /* XXH3 over the sections, padding excluded */
+   uint64_t header_sum;  /* XXH3 over this header, with header_sum as 0 */
+};
+
+/* Control object of a table published by em_i_asa_publish. It never changes
+ * but for the generation, which names the shared memory object holding the
+ * latest image, and only moves on once that image is complete. */
+struct em_asa_shm_s {
+   char magic[8];
+   uint64_t generation; /* 0 until the first publish */
+};
+
+/* Scratch space for building a frozen table's perfect hash, one entry per
+ * element or per bucket */
+struct em_asa_fbuild_s {
+   unsigned long n;
+   unsigned long buckets;
+   uint32_t *src;     /* Slot each element sits in before freezing */
+   uint64_t *hash;    /* Each element's I_FHASH */
+   uint32_t *members; /* Elements, grouped by bucket */
+   uint32_t *start;   /* Where each bucket's members start, plus the end */
+   uint32_t *order;   /* Buckets, biggest first */
+   uint32_t *place;   /* Slot each element is given */
+   uint64_t *taken;   /* Bitmap of the slots given out so far */
+   unsigned long long *disp;
+};
+
+/* State shared by the threads of an em_i_asa_build or em_i_asa_merge. Every
+ * phase hands each thread its own run of the elements, or of the partitions,
+ * so no two threads ever write to the same thing. */
+struct em_asa_bulk_s {
+   struct em_asa_hdr_s *header;
+   size_t n;
+   unsigned int threads;
+   unsigned int gbits; /* Bits in a home group of the current slab */
+   unsigned int pbits; /* The top ones of which pick the partition */
+
+   /* Element x comes from keys + x * key_size for a build, or from slot
+    * smap[x] of the source table's current slab for a merge, with rehash set
+    * if its id doesn't hold for this table as it is. Its value is at
+    * I_BULKVAL. */
+   const char *keys;
+   size_t key_size;
+   const struct em_asa_hdr_s *src;
+   const unsigned long *smap;
+   bool rehash;
+   const char *vals;
+
+   em_asa_id_t *ids;
+   size_t *hist;   /* Per thread and partition: elements, then where they go */
+   size_t *order;  /* Elements, by partition and in input order within one */
+   size_t *pstart; /* Where each partition starts in order, plus the end */
+   size_t *over;   /* Per partition, elements left for the serial pass */
+   unsigned char *fresh; /* Elements new to the table, with a prefilter */
+   unsigned long *added; /* Per thread */
+   unsigned long *reused; /* Per thread, tombstones filled */
+   bool *lost; /* Per thread, met a source key that can't be hashed again */
+};
+
+/* State shared by the threads of an em_i_asa_foreach. Slots are numbered
+ * across both slabs as if they were one, the current slab's in-use slots
+ * first, and every thread walks its own run of them. */
+struct em_asa_each_s {
+   const struct em_asa_hdr_s *header;
+   unsigned int threads;
+   unsigned long ncur;  /* Slots of the current slab in use */
+   unsigned long total; /* And of both slabs */
+   unsigned long now;   /* For EM_ASA_CACHE tables */
+   void (*fn)(long idx, unsigned int t, void *ctx);
+   void *ctx;
+};
+
+/* One of a snapshot's slab arrays: a second, read-only mapping of the table's
+ * shared one, whose chunks are swapped for private copies as the table is
+ * about to write to them. */
+struct em_asa_sview_s {
+   const char *src; /* The table's mapping, NULL once it has let go of it */
+   char *view;
+   size_t len;   /* Of both, EM_ASA_SNAP_PAD included */
+   size_t chunk; /* Bytes copied out at once, a multiple of the page size */
+   uint64_t *kept; /* Bitmap of the chunks copied out so far */
+};
+
+struct em_asa_snap_s {
+   struct em_asa_snap_s *next;
+   struct em_asa_snaps_s *reg;
+   struct em_asa_sview_s views[EM_ASA_SNAP_ARRAYS];
+   bool stale; /* A chunk couldn't be copied out before it was written to */
+};
+
+/* The snapshots of an EM_ASA_SNAPSHOTS table. Held by the table and by each
+ * of them, as they can go in any order and from any thread. */
+struct em_asa_snaps_s {
+   pthread_mutex_t lock;
+   unsigned long refs;
+   struct em_asa_snap_s *list;
+};
+
+struct em_asa_runw_s {
+   void *ctx;
+   unsigned int t;
+   void (*fn)(void *ctx, unsigned int t);
+};
 
 /* Static Declarations & Constant Variables --------------------------------- */
 
-static const struct em_asa_hdr_s em_asa_defhr = { .tier = EM_ASA_MIN_TIER };
-
-static unsigned long em_i_asa_rup2f32(unsigned long v);
-static em_status_t em_i_asa_ensurei(void **a, unsigned long high_as);
-static em_status_t em_i_asa_grow(void **a);
+static const struct em_asa_hdr_s em_asa_defhr = { 0 };
+
+static XXH128_hash_t em_i_asa_hash(const struct em_asa_hdr_s *header,
+                                   const void *key, size_t amt);
+static inline unsigned long long em_i_asa_fmix(unsigned long long k);
+static inline unsigned long long em_i_asa_loadw(const unsigned char *p,
+                                                size_t amt);
+#ifdef EM_ASA_HAVE_CRC32C
+static XXH128_hash_t em_i_asa_hcrc(const void *key, size_t amt,
+                                   unsigned long long seed);
+#endif
+static unsigned char em_i_asa_fittier(const struct em_asa_hdr_s *header,
+                                      unsigned long elements);
+static em_status_t em_i_asa_slabmk(struct em_asa_hdr_s *header,
+                                   struct em_asa_slab_s *slab,
+                                   unsigned char tier);
+static em_status_t em_i_asa_ensurei(void **a, struct em_asa_slab_s *slab,
+                                    unsigned long high_as);
+static void em_i_asa_hugepages(void *ptr, size_t size);
+static void em_i_asa_freeslab(struct em_asa_hdr_s *header,
+                              struct em_asa_slab_s *slab);
+static void em_i_asa_filtermk(struct em_asa_hdr_s *header,
+                              struct em_asa_slab_s *slab, bool had);
+static void em_i_asa_filterck(struct em_asa_hdr_s *header);
+static bool em_i_asa_pfwanted(const struct em_asa_hdr_s *header,
+                              unsigned char tier, bool had);
+static void em_i_asa_pfmk(struct em_asa_hdr_s *header,
+                          struct em_asa_slab_s *slab);
+static void em_i_asa_pfdrop(struct em_asa_hdr_s *header,
+                            struct em_asa_slab_s *slab);
+static inline bool em_i_asa_pfin(const struct em_asa_slab_s *slab,
+                                 unsigned long long probe);
+static inline void em_i_asa_pfprefetch(const struct em_asa_slab_s *slab,
+                                       unsigned long long probe);
+static void em_i_asa_pfadd(struct em_asa_hdr_s *header,
+                           struct em_asa_slab_s *slab,
+                           unsigned long long probe);
+static em_status_t em_i_asa_imgprep(void **a);
+static em_status_t em_i_asa_shmctl(const char *name, bool create,
+                                   struct em_asa_shm_s **out);
+static bool em_i_asa_shmname(char *out, const char *name,
+                             unsigned long long gen);
+static em_status_t em_i_asa_imgput(void **a, FILE *f);
+static em_status_t em_i_asa_mapfd(void **a, size_t el_size, int fd,
+                                  unsigned int flags);
+static void em_i_asa_imgsects(const struct em_asa_image_s *img,
+                              uint64_t offs[EM_ASA_IMG_SECTS],
+                              uint64_t lens[EM_ASA_IMG_SECTS]);
+static uint64_t em_i_asa_imgsum(const struct em_asa_image_s *img,
+                                const void *const sect[EM_ASA_IMG_SECTS]);
+static bool em_i_asa_imgok(const struct em_asa_image_s *img, size_t len,
+                           size_t el_size, bool verify);
+static void em_i_asa_slabstats(const struct em_asa_hdr_s *header,
+                               const struct em_asa_slab_s *slab,
+                               struct em_asa_slab_stats_s *out,
+                               struct em_asa_stats_s *stats);
+static inline bool em_i_asa_mapped(const struct em_asa_hdr_s *header,
+                                   const void *ptr);
+static void *em_i_asa_xalloc(struct em_asa_hdr_s *header, size_t size);
+static void em_i_asa_xfree(struct em_asa_hdr_s *header, void *ptr);
+static void *em_i_asa_xresize(struct em_asa_hdr_s *header, void *ptr,
+                              size_t old_size, size_t new_size);
+static void *em_i_asa_salloc(struct em_asa_hdr_s *header, size_t size);
+static void em_i_asa_sfree(struct em_asa_hdr_s *header, void *ptr);
+static void *em_i_asa_sresize(struct em_asa_hdr_s *header, void *ptr,
+                              size_t old_size, size_t new_size);
+static void *em_i_asa_viewmk(struct em_asa_hdr_s *header,
+                             struct em_asa_sview_s *v, const void *live);
+static void em_i_asa_keep(struct em_asa_hdr_s *header,
+                          const struct em_asa_slab_s *slab, unsigned long lo,
+                          unsigned long hi);
+static bool em_i_asa_keepchunk(struct em_asa_sview_s *v, size_t k);
+static void em_i_asa_snaprelease(struct em_asa_hdr_s *header);
+static em_status_t em_i_asa_setm(void **a, em_asa_id_t id, void *value,
+                                 unsigned int meta);
+static void em_i_asa_delidx(void **a, struct em_asa_slab_s *slab,
+                            unsigned long slot);
+static unsigned long em_i_asa_now(const struct em_asa_hdr_s *header);
+static unsigned int em_i_asa_expiry(const struct em_asa_hdr_s *header,
+                                    unsigned long ttl);
+static inline bool em_i_asa_expired(const struct em_asa_hdr_s *header,
+                                    long idx, unsigned long now);
+static long em_i_asa_touch(void **a, long idx, unsigned long now);
+static void em_i_asa_evict(void **a);
+static em_status_t em_i_asa_presize(void **a, unsigned long n);
+static em_status_t em_i_asa_bulk(void **a, struct em_asa_bulk_s *b,
+                                 unsigned int threads);
+static void em_i_asa_run(void *ctx, unsigned int threads,
+                         void (*fn)(void *ctx, unsigned int t));
+static void *em_i_asa_runw(void *w);
+static void em_i_asa_bulkhash(void *ctx, unsigned int t);
+static void em_i_asa_bulkhist(void *ctx, unsigned int t);
+static void em_i_asa_bulkscat(void *ctx, unsigned int t);
+static void em_i_asa_bulkplace(void *ctx, unsigned int t);
+static void em_i_asa_eachw(void *ctx, unsigned int t);
+static long em_i_asa_inext(const struct em_asa_hdr_s *header, unsigned long x,
+                           unsigned long end);
+static long em_i_asa_snext(const struct em_asa_slab_s *slab, unsigned long x,
+                           unsigned long end);
+static em_status_t em_i_asa_balance(void **a);
+static em_status_t em_i_asa_rehash(void **a, unsigned char tier);
+static em_status_t em_i_asa_migrate(void **a, unsigned long steps);
 static unsigned long em_i_asa_freeslots(void **a);
+static long em_i_asa_probe(void **a, const em_asa_id_t *id);
+static long em_i_asa_sprobe(void **a, const struct em_asa_slab_s *slab,
+                            const em_asa_id_t *id, bool asked);
+static long em_i_asa_fprobe(const struct em_asa_hdr_s *header,
+                            const em_asa_id_t *id);
+static inline unsigned long em_i_asa_fbase(unsigned long long h,
+                                           unsigned long long d0,
+                                           unsigned long n);
+static bool em_i_asa_fplace(struct em_asa_hdr_s *header,
+                            const struct em_asa_slab_s *slab,
+                            struct em_asa_fbuild_s *fb);
+static bool em_i_asa_fbucket(struct em_asa_fbuild_s *fb, const uint32_t *m,
+                             unsigned long size, unsigned long long *disp);
+static em_status_t em_i_asa_splace(void **a, struct em_asa_slab_s *slab,
+                                   const em_asa_id_t *id, const void *value,
+                                   unsigned int meta);
+static em_status_t em_i_asa_rhplace(void **a, struct em_asa_slab_s *slab,
+                                    const em_asa_id_t *id, const void *value,
+                                    unsigned int meta);
+static void em_i_asa_rhshift(void **a, struct em_asa_slab_s *slab,
+                             unsigned long slot);
+static unsigned long em_i_asa_rhdist(const struct em_asa_hdr_s *header,
+                                     const struct em_asa_slab_s *slab,
+                                     unsigned long slot);
+static inline void em_i_asa_memswap(void *a, void *b, size_t n);
+static inline bool em_i_asa_keyeq(const struct em_asa_hdr_s *header,
+                                  const em_asa_id_t *a, const em_asa_id_t *b);
+static const char *em_i_asa_keycopy(struct em_asa_hdr_s *header,
+                                    struct em_asa_slab_s *slab,
+                                    const char *key, size_t len);
+static inline unsigned em_i_asa_gmatch(const signed char *g, signed char c);
+static inline unsigned em_i_asa_gfree(const signed char *g);
+static inline unsigned em_i_asa_gbelow(const unsigned char *g,
+                                       unsigned char d);
 
 /* Public Functions --------------------------------------------------------- */
 
 em_asa_id_t em_i_asa_hrange(void **a, const void *key, size_t amt)
 {
-   /* Hashes for the hash table are performed with 128-bit xxHash3.
-    * A seed (randomized on hash table init) is used to ensure that each
-    * element has a different hash for every hash table, improving security by
-    * preventing (or mitigating) forced collisions.
+   /* Hashes for the hash table are performed with 128-bit xxHash3 unless the
+    * table was made with another hash (see em_i_asa_hash). A seed (randomized
+    * on hash table init) is used to ensure that each element has a different
+    * hash for every hash table, improving security by preventing (or
+    * mitigating) forced collisions.
     *
     * TODO: Use a more secure (and internal, preferably) hashing algorithm.
     */
@@ -60,25 +434,47 @@ em_asa_id_t em_i_asa_hrange(void **a, const void *key, size_t amt)
 
    em_asa_id_t fhash = { .llen = amt };
 
-   XXH128_hash_t xhash =
-      XXH3_128bits_withSeed(key, amt, (XXH64_hash_t)header->seed);
-
-   fhash.probe = xhash.low64 & 0xFFFFFFFF;
-
-   memcpy(fhash.usect.colres, key, __em_min(EM_ASA_KEY_COLRES, amt));
-
-   if (amt > EM_ASA_KEY_COLRES) {
-      fhash.usect.isect.low32 ^= xhash.low64 >> 32;
+   XXH128_hash_t xhash = em_i_asa_hash(header, key, amt);
+
+   /* Home groups use the low bits of the probe hash, at most up to bit
+    * EM_ASA_MAX_TIER, the control tag the seven above those, and a cuckoo
+    * prefilter's fingerprint the top byte. */
+   fhash.probe = xhash.low64;
+
+   if (amt > EM_ASA_KEY_COLRES && header->flags & EM_ASA_EXACT_KEYS) {
+      /* Refers to the key where it is, em_i_asa_splace copies it in */
+      fhash.llen = EM_ASA_LLEN_EXACT;
+      fhash.usect.xsect.high64 = xhash.high64;
+      fhash.usect.xsect.key = key;
+      fhash.usect.xsect.len = amt;
+   } else if (amt > EM_ASA_KEY_COLRES) {
+      memcpy(fhash.usect.colres, key, EM_ASA_KEY_COLRES);
       fhash.usect.isect.high64 ^= xhash.high64;
    } else {
-      fhash.probe ^=
-         xhash.low64 >> 32 ^ (xhash.high64 & 0xFFFFFFFF) ^ xhash.high64 >> 32;
+      memcpy(fhash.usect.colres, key, amt);
    }
 
    return fhash;
 }
 
 em_status_t em_i_asa_init(void **a, size_t el_size)
+{
+   return em_i_asa_inith(a, el_size, EM_ASA_HASH_XXH128);
+}
+
+em_status_t em_i_asa_inith(void **a, size_t el_size, enum em_asa_hash_e hash)
+{
+   return em_i_asa_initx(a, el_size, hash, 0);
+}
+
+em_status_t em_i_asa_initx(void **a, size_t el_size, enum em_asa_hash_e hash,
+                           unsigned int flags)
+{
+   return em_i_asa_inita(a, el_size, hash, flags, NULL);
+}
+
+em_status_t em_i_asa_inita(void **a, size_t el_size, enum em_asa_hash_e hash,
+                           unsigned int flags, const em_alloc_t *allocator)
 {
    /* Seed the global RNG if it hasn't been done already */
    em_mt_init_basic(&em_mt19937_global, true);
@@ -89,18 +485,41 @@ em_status_t em_i_asa_init(void **a, size_t el_size)
     * (Handy way to empty an assoca, although you may want to change the seed
     * back to normal again afterwards)
     */
-   *a = realloc(*a, EM_ASA_HR_SZ + el_size + EM_ASA_EH_SZ);
+   const em_alloc_t *mi = allocator ? allocator : EM_GLOBAL_ALLOC;
+
+   *a = mi->realloc(mi->udata, *a, EM_ASA_HR_SZ);
    if (!*a)
       return EM_OUT_OF_MEMORY;
    memcpy(*a, &em_asa_defhr, EM_ASA_HR_SZ);
-   memset((struct em_asa_hdr_s *)*a + 1, 0, el_size + EM_ASA_EH_SZ);
 
    I_PREPHDR;
 
+   header->mi = mi;
    header->element_size = el_size;
    header->seed = em_mt_genrand64_int64(&em_mt19937_global);
+   header->hash = hash;
+   header->flags = flags;
+
+   /* Expiries are kept relative to this, so they fit in 31 bits */
+   if (I_ISCACHE)
+      header->cache.epoch = em_i_asa_now(header);
+
+#ifdef EM_ASA_HAVE_CRC32C
+   if (hash == EM_ASA_HASH_CRC32C && !__builtin_cpu_supports("sse4.2"))
+      header->hash = EM_ASA_HASH_XXH64;
+#else
+   if (hash == EM_ASA_HASH_CRC32C)
+      header->hash = EM_ASA_HASH_XXH64;
+#endif
+
+   if (flags & EM_ASA_SNAPSHOTS) {
+      if (!(header->snaps = em_i_asa_xalloc(header, sizeof(*header->snaps))))
+         return EM_OUT_OF_MEMORY;
+      *header->snaps = (struct em_asa_snaps_s){ .refs = 1 };
+      pthread_mutex_init(&header->snaps->lock, NULL);
+   }
 
-   return em_bloom_mk(&header->bloom, EM_ASA_BLOOM_SZ);
+   return em_i_asa_slabmk(header, &header->cur, EM_ASA_MIN_TIER);
 }
 
 void em_i_asa_destroy(void **a)
@@ -110,9 +529,25 @@ void em_i_asa_destroy(void **a)
 
    I_PREPHDR;
 
-   em_bloom_free(&header->bloom);
+   /* A snapshot's slab arrays go with its entry in the snapshot list */
+   if (header->snap)
+      em_i_asa_snaprelease(header);
+
+   em_i_asa_freeslab(header, &header->cur);
+   em_i_asa_freeslab(header, &header->old);
+
+   if (header->snaps)
+      em_i_asa_snaprelease(header);
+
+   em_i_asa_xfree(header, header->frozen);
 
-   free(*a);
+   if (header->map)
+      munmap(header->map, header->map_len);
+   if (header->shm)
+      munmap(header->shm, sizeof(*header->shm));
+   em_i_asa_xfree(header, header->shm_name);
+
+   em_i_asa_xfree(header, *a);
 
    /* Is this neccessary? Can the user be trusted to do this themsevles?
     * THey probably can't...
@@ -124,272 +559,3399 @@ em_status_t em_i_asa_empty(void **a)
 {
    I_PREPHDR;
 
-   em_bloom_free(&header->bloom);
-
-   /* Reinitialize the hash table while keeping the seed and element size */
-   size_t tes = header->element_size;
-   unsigned long long seed = header->seed;
-
-   /* Depends on init usage of realloc instead of malloc */
-   em_status_t s = em_i_asa_init(a, tes);
-   if (s != EM_STATUS_OKAY)
+   if (I_RDONLY)
+      return EM_READ_ONLY;
+
+   /* Build a fresh table while keeping the seed and element size, then swap
+    * it in. The old one is left untouched if that fails. */
+   struct em_asa_hdr_s *fresh = NULL;
+   em_status_t s =
+      em_i_asa_inita((void **)&fresh, header->element_size, header->hash,
+                     header->flags, header->mi);
+   if (s != EM_STATUS_OKAY) {
+      em_i_asa_destroy((void **)&fresh);
       return s;
+   }
 
    /* Keep the seed the same, just in case/to prevent excess re-hashing */
-   header = *a;
-   header->seed = seed;
+   fresh->seed = header->seed;
+   fresh->lookups = header->lookups;
+   fresh->misses = header->misses;
+   fresh->counters = header->counters;
+   fresh->cache = header->cache;
+   fresh->cache.hand = 0;
+   fresh->retire = header->retire;
+   fresh->retire_ctx = header->retire_ctx;
+
+   em_i_asa_destroy(a);
+   *a = fresh;
 
    return EM_STATUS_OKAY;
 }
 
-long em_i_asa_lookup(void **a, em_asa_id_t id)
+em_status_t em_i_asa_reserve(void **a, unsigned long n)
 {
+   /* Makes room for n elements up front: the table is moved to a tier that
+    * holds them without growing, and all of that tier's storage is allocated
+    * right away, so filling it up doesn't realloc or rebuild anything. The
+    * table also won't shrink below that size later on.
+    */
+
    I_PREPHDR;
 
-   if (!em_bloom_in(&header->bloom, &id, sizeof(id)))
-      return -1;
+   if (I_RDONLY)
+      return EM_READ_ONLY;
+
+   em_status_t stat = em_i_asa_presize(a, n);
+   if (stat != EM_STATUS_OKAY)
+      return stat;
 
-   for (signed char tier = header->tier; tier >= EM_ASA_MIN_TIER; tier--) {
-      /* The initial probe is always just the full hash but masked with the
-       * tier mask. Only the low 64 bits of the full hash are ever used. The
-       * rest are used for the comparison process.
-       */
+   header->reserved = __em_max(header->reserved, n);
 
-      unsigned long tiprob,
-         probe = tiprob = id.probe & I_TIERCLM((unsigned char)tier);
-      unsigned long searches = 0;
+   return EM_STATUS_OKAY;
+}
 
-      for (;;) {
-         struct em_asa_elhdr_s *cur_el_hdr = em_i_asa_getip(a, probe);
+em_status_t em_i_asa_build(void **a, const void *keys, size_t key_size,
+                           const void *values, size_t n, unsigned int threads)
+{
+   /* Sets n elements at once, keyed by the key_size bytes at keys + x *
+    * key_size and valued from values[x], as though each were set in turn (a
+    * key that comes up twice ends up with its last value). Up to `threads`
+    * threads are put to it, or one per CPU for 0, and fewer for small
+    * builds; see em_i_asa_bulk for how. On failure, some of the elements
+    * may have been set already.
+    */
 
-         /* If not occupied, return -1 */
-         if (!cur_el_hdr || !(cur_el_hdr->flags & FL_OCCUPY))
-            break;
+   I_PREPHDR;
 
-         /* Compare the full hashes at every probe unless unoccupied */
-         bool comparison = I_KEYICMP(&id, &cur_el_hdr->id);
+   if (I_RDONLY)
+      return EM_READ_ONLY;
 
-         /* If comparison matches (and LD), the element we're looking for has
-          * been deleted, so ignore it and return -1. */
-         if (cur_el_hdr->flags & FL_DELETE && comparison)
-            break;
+   struct em_asa_bulk_s b = {
+      .header = header,
+      .n = n,
+      .keys = keys,
+      .key_size = key_size,
+      .vals = values,
+   };
 
-         /* If occupied, not deleted and comparison matches, we found the
-          * element we're looking for! */
-         if (comparison)
-            return probe;
+   return em_i_asa_bulk(a, &b, threads);
+}
 
-         searches++;
+em_status_t em_i_asa_merge(void **a, void **src, unsigned int threads)
+{
+   /* Sets every element of src in this table, src's values winning over ones
+    * already here, in the same way as em_i_asa_build. Ids are taken over as
+    * they are when both tables hash the same way; otherwise every key is
+    * hashed again from what src still has of it (see em_i_asa_getkey), and
+    * if it doesn't have all of them, nothing is set and EM_INVALID_TYPE is
+    * returned. Any migration src is in the middle of is finished first.
+    */
 
-         /* Check if the first element has no collisions, if not, return -1
-          * Note: Also prevents infinite searching on a fully loaded table.
-          */
-         if ((!(cur_el_hdr->flags & FL_COLLIS) && probe == tiprob) ||
-             searches > header->ddepth)
-            break;
+   I_PREPHDR;
 
-         /* Next probes are all handled by a function which can do whatever
-          * it wants to the previous probe. */
-         probe = I_PROBEMC(probe, tier);
-      }
-   }
+   struct em_asa_hdr_s *sh = *src;
 
-   return -1;
+   if (sh == header)
+      return EM_STATUS_OKAY;
+   if (I_RDONLY)
+      return EM_READ_ONLY;
+   if (sh->element_size != header->element_size)
+      return EM_INVALID_TYPE;
+
+   em_status_t stat = em_i_asa_migrate(src, ~0UL);
+   if (stat != EM_STATUS_OKAY)
+      return stat;
+
+   unsigned long *smap = em_i_asa_xalloc(header, __em_max(sh->elements, 1UL) *
+                                                    sizeof(*smap));
+   if (!smap)
+      return EM_OUT_OF_MEMORY;
+
+   struct em_asa_bulk_s b = {
+      .header = header,
+      .src = sh,
+      .smap = smap,
+      .rehash = sh->seed != header->seed || sh->hash != header->hash ||
+                (sh->flags ^ header->flags) & EM_ASA_EXACT_KEYS,
+      .vals = sh->cur.vals,
+   };
+
+   for (unsigned long x = 0; x <= sh->cur.highest_index; x++)
+      if (sh->cur.ctrl[x] >= 0)
+         smap[b.n++] = x;
+
+   stat = em_i_asa_bulk(a, &b, threads);
+
+   em_i_asa_xfree(header, smap);
+
+   return stat;
 }
 
-em_status_t em_i_asa_set(void **a, em_asa_id_t id, void *value)
+const void *em_i_asa_getkey(void **a, long idx, size_t *len)
 {
+   /* Hands back the key an element was set with, where the table still has
+    * it: keys up to EM_ASA_KEY_COLRES bytes are kept in the id itself, and
+    * longer ones only in tables made with EM_ASA_EXACT_KEYS. The pointer
+    * stays valid until the element is deleted or moved by a resize.
+    */
+
    I_PREPHDR;
 
-   /* Execute the grow test to see if another tier is needed. */
-   em_status_t gstat = em_i_asa_grow(a);
-   if (gstat != EM_STATUS_OKAY)
-      return gstat;
+   em_asa_id_t *id = idx < 0 ? NULL : em_i_asa_getidp(a, idx);
 
-   /* If the element already exists, set the value (Python-style) */
-   long ilookup = em_i_asa_lookup(a, id);
-   if (ilookup >= 0) {
-      memcpy((struct em_asa_elhdr_s *)em_i_asa_getip(a, ilookup) + 1, value,
-             header->element_size);
-      return EM_STATUS_OKAY;
+   if (!id)
+      return NULL;
+
+   if (I_ISEXACT(id)) {
+      *len = id->usect.xsect.len;
+      return id->usect.xsect.key;
    }
 
-   em_bloom_add(&header->bloom, &id, sizeof(id));
+   if (id->llen > EM_ASA_KEY_COLRES)
+      return NULL;
 
-   unsigned long tiprobe, probe = tiprobe = id.probe & I_TIERCLM(header->tier);
-   struct em_asa_elhdr_s *cur_el_hdr;
-   unsigned char flagset = 0;
-   unsigned long searches = 0;
+   *len = id->llen;
+   return id->usect.colres;
+}
 
-   /* It miiight be possible for this to loop forever, maybe. No, actually, I
-    * don't think it will. Maybe. */
-   for (;;) {
-      gstat = em_i_asa_ensurei(a, probe);
+em_status_t em_i_asa_save(void **a, const char *path)
+{
+   /* Writes the table out as an image that em_i_asa_map can serve lookups
+    * from without loading it. Any migration in progress is finished first, so
+    * only the current slab needs writing. Tables with EM_ASA_EXACT_KEYS are
+    * refused, as their ids point into key arenas that don't survive the trip,
+    * and so are frozen tables, as the image has nowhere to put the hash, and
+    * EM_ASA_CACHE tables, whose expiries only mean anything on this machine
+    * until it reboots. A cuckoo prefilter is left out, the mapped table
+    * simply goes without.
+    */
+
+   em_status_t stat = em_i_asa_imgprep(a);
+   if (stat != EM_STATUS_OKAY)
+      return stat;
+
+   FILE *f = fopen(path, "wb");
+   if (!f)
+      return EM_IO_FAILURE;
+
+   stat = em_i_asa_imgput(a, f);
+
+   if (fclose(f) != 0 && stat == EM_STATUS_OKAY)
+      stat = EM_IO_FAILURE;
+
+   return stat;
+}
+
+em_status_t em_i_asa_map(void **a, size_t el_size, const char *path,
+                         unsigned int flags)
+{
+   /* Builds a table around an image written by em_i_asa_save, with the slab
+    * arrays pointing straight into a private mapping of the file. Only the
+    * image header is read up front (unless verifying), the rest is paged in
+    * as lookups touch it, so even a large table is ready to use at once.
+    * *a is overwritten, not freed.
+    */
+
+   int fd = open(path, O_RDONLY);
+   if (fd < 0)
+      return EM_IO_FAILURE;
+
+   return em_i_asa_mapfd(a, el_size, fd, flags);
+}
+
+em_status_t em_i_asa_publish(void **a, const char *name)
+{
+   /* Makes the table available to other processes under a POSIX shared
+    * memory name (see shm_open), for em_i_asa_attach. Its image (see
+    * em_i_asa_save) goes into a fresh object of its own, <name>.<generation>,
+    * and only once that's written in full does the generation in the small
+    * control object, <name> itself, move on to it, so readers never come
+    * across half a table. The previous generation is unlinked; readers that
+    * have it mapped keep it until they refresh, and it goes away with the
+    * last of them. Only one process should publish under a name. The objects
+    * are only accessible to the user that created them.
+    */
+
+   em_status_t stat = em_i_asa_imgprep(a);
+   if (stat != EM_STATUS_OKAY)
+      return stat;
+
+   struct em_asa_shm_s *ctl;
+   if ((stat = em_i_asa_shmctl(name, true, &ctl)) != EM_STATUS_OKAY)
+      return stat;
 
-      I_REINHDR; /* Reset the header pointer just in case it changes. */
+   char iname[EM_ASA_SHM_NAME];
+   uint64_t gen = __atomic_load_n(&ctl->generation, __ATOMIC_ACQUIRE) + 1;
 
-      if (gstat != EM_STATUS_OKAY)
-         return gstat;
+   if (!em_i_asa_shmname(iname, name, gen)) {
+      munmap(ctl, sizeof(*ctl));
+      return EM_OUT_OF_BOUNDS;
+   }
 
-      cur_el_hdr = em_i_asa_getip(a, probe);
+   /* In case a publish died halfway through before */
+   shm_unlink(iname);
 
-      if (cur_el_hdr->flags & FL_DELETE) {
-         /* NOTE: Copies ALL other flags if LD! */
-         flagset = cur_el_hdr->flags ^ FL_DELETE;
-         header->ld_elements--;
+   int fd = shm_open(iname, O_RDWR | O_CREAT | O_EXCL, 0600);
+   FILE *f = fd < 0 ? NULL : fdopen(fd, "wb");
 
-         goto i_insert_lda;
+   if (!f) {
+      if (fd >= 0) {
+         close(fd);
+         shm_unlink(iname);
       }
-      if (!(cur_el_hdr->flags & FL_OCCUPY)) {
-      i_insert_lda:
-         flagset |= FL_OCCUPY;
+      munmap(ctl, sizeof(*ctl));
+      return EM_IO_FAILURE;
+   }
+
+   stat = em_i_asa_imgput(a, f);
+   if (fclose(f) != 0 && stat == EM_STATUS_OKAY)
+      stat = EM_IO_FAILURE;
+
+   if (stat == EM_STATUS_OKAY) {
+      __atomic_store_n(&ctl->generation, gen, __ATOMIC_RELEASE);
+
+      if (gen > 1 && em_i_asa_shmname(iname, name, gen - 1))
+         shm_unlink(iname);
+   } else {
+      shm_unlink(iname);
+   }
+
+   munmap(ctl, sizeof(*ctl));
+
+   return stat;
+}
+
+em_status_t em_i_asa_attach(void **a, size_t el_size, const char *name)
+{
+   /* Builds a read-only table around the image last published under name,
+    * as em_i_asa_map would around a file. Its pages are the shared memory
+    * object's, so every process attached to the same generation shares the
+    * one copy of the table. em_i_asa_refresh moves it on to later ones.
+    * *a is overwritten, not freed.
+    */
+
+   struct em_asa_shm_s *ctl;
+   em_status_t stat = em_i_asa_shmctl(name, false, &ctl);
+   if (stat != EM_STATUS_OKAY)
+      return stat;
+
+   char iname[EM_ASA_SHM_NAME];
+   char *copy = malloc(strlen(name) + 1);
+   uint64_t gen = __atomic_load_n(&ctl->generation, __ATOMIC_ACQUIRE);
+
+   stat = copy ? EM_IO_FAILURE : EM_OUT_OF_MEMORY;
+
+   while (copy && gen) {
+      if (!em_i_asa_shmname(iname, name, gen)) {
+         stat = EM_OUT_OF_BOUNDS;
          break;
       }
 
-      if (probe == tiprobe)
-         cur_el_hdr->flags |= FL_COLLIS;
+      int fd = shm_open(iname, O_RDONLY, 0);
+      if (fd >= 0) {
+         stat = em_i_asa_mapfd(a, el_size, fd, 0);
+         break;
+      }
 
-      searches++;
-      probe = I_PROBEMC(probe, header->tier);
-      flagset = 0;
+      /* The generation is only unlinked once a newer one is up */
+      uint64_t next = __atomic_load_n(&ctl->generation, __ATOMIC_ACQUIRE);
+      if (errno != ENOENT || next == gen)
+         break;
+      gen = next;
    }
 
-   cur_el_hdr->flags = flagset;
-   cur_el_hdr->id = id;
-   header->elements++;
+   if (stat != EM_STATUS_OKAY) {
+      free(copy);
+      munmap(ctl, sizeof(*ctl));
+      return stat;
+   }
 
-   memcpy(cur_el_hdr + 1, value, header->element_size);
+   struct em_asa_hdr_s *header = *a;
 
-   if (searches > header->ddepth)
-      header->ddepth = searches;
+   header->shm = ctl;
+   header->shm_name = strcpy(copy, name);
+   header->shm_gen = gen;
 
    return EM_STATUS_OKAY;
 }
 
-em_status_t em_i_asa_reform(void **a, bool forced)
+em_status_t em_i_asa_refresh(void **a)
 {
-   /* This function rebuilds the entire associative array, and has a similar
-    * effect on performance to Windows' defrag tool. The goal of this function
-    * is to attempt to rid the table of lazy-deleted cells and to downscale the
-    * table when many cells are marked as deleted, saving memory.
+   /* Moves a table made by em_i_asa_attach on to the latest generation
+    * published, if there's a newer one than it has. Indices and value
+    * pointers into the table don't survive that. If the newer one can't be
+    * attached, the table stays as it was.
     */
 
    I_PREPHDR;
 
-   if (header->elements < 1)
-      return em_i_asa_empty(a);
-   if ((signed char)header->tier - 1 < EM_ASA_MIN_TIER ||
-       (!forced && header->ld_elements << 1 < em_i_asa_freeslots(a)))
-      return EM_STATUS_OKAY; /* Table doesn't need downscaling, exit safely */
+   if (!header->shm)
+      return EM_INVALID_TYPE;
 
-   struct em_asa_hdr_s *new_table = NULL;
-   em_status_t stat = em_i_asa_init((void **)&new_table, header->element_size);
+   if (__atomic_load_n(&header->shm->generation, __ATOMIC_ACQUIRE) ==
+       header->shm_gen)
+      return EM_STATUS_OKAY;
+
+   void *fresh;
+   em_status_t stat =
+      em_i_asa_attach(&fresh, header->element_size, header->shm_name);
    if (stat != EM_STATUS_OKAY)
       return stat;
-   new_table->seed = header->seed;
-   new_table->tier =
-      __em_clamp(EM_ASA_MIN_TIER,
-                 I_LOG2LNG(em_i_asa_rup2f32(header->elements)) - 1,
-                 EM_ASA_MAX_TIER);
 
-   for (unsigned long x = 0; x <= header->highest_index; x++) {
-      struct em_asa_elhdr_s *cur_el_hdr = em_i_asa_getip(a, x);
+   em_i_asa_destroy(a);
+   *a = fresh;
 
-      if ((cur_el_hdr->flags & FL_OCCUPY) && !(cur_el_hdr->flags & FL_DELETE))
-         if ((stat = em_i_asa_set((void **)&new_table, cur_el_hdr->id,
-                                  cur_el_hdr + 1)) != EM_STATUS_OKAY)
-            return stat;
-   }
+   return EM_STATUS_OKAY;
+}
 
-   em_i_asa_destroy(a);
-   *a = new_table;
+em_status_t em_i_asa_unpublish(const char *name)
+{
+   /* Unlinks name and its latest generation. Attached tables carry on with
+    * what they have, but can't refresh any more. */
 
-   I_REINHDR;
+   struct em_asa_shm_s *ctl;
+   em_status_t stat = em_i_asa_shmctl(name, false, &ctl);
+   if (stat != EM_STATUS_OKAY)
+      return stat;
+
+   char iname[EM_ASA_SHM_NAME];
+   uint64_t gen = __atomic_load_n(&ctl->generation, __ATOMIC_ACQUIRE);
+
+   if (gen && em_i_asa_shmname(iname, name, gen))
+      shm_unlink(iname);
+
+   munmap(ctl, sizeof(*ctl));
+   shm_unlink(name);
 
    return EM_STATUS_OKAY;
 }
 
-em_status_t em_i_asa_delete(void **a, em_asa_id_t id)
+em_status_t em_i_asa_stats(void **a, struct em_asa_stats_s *out)
 {
    I_PREPHDR;
 
-   long ilookup = em_i_asa_lookup(a, id);
-   if (ilookup < 0)
-      return EM_EL_NOT_FOUND;
+   *out = (struct em_asa_stats_s){
+      .elements = header->elements,
+      .bytes = EM_ASA_HR_SZ,
+      .mapped_bytes = header->map_len,
+      .counters = header->counters,
+#ifdef EM_ASA_STATS
+      .counting = I_TALLIES,
+#endif
+   };
+
+   em_i_asa_slabstats(header, &header->cur, &out->cur, out);
+   if (header->frozen)
+      out->bytes += header->frozen_buckets * sizeof(*header->frozen);
+   if (header->old.ctrl)
+      em_i_asa_slabstats(header, &header->old, &out->old, out);
+
+   if (header->elements)
+      out->probe_mean /= header->elements;
+
+   return EM_STATUS_OKAY;
+}
 
-   struct em_asa_elhdr_s *cur_el_hdr = em_i_asa_getip(a, ilookup);
+em_status_t em_i_asa_freeze(void **a)
+{
+   /* Packs the table into exactly as many slots as it has elements, each put
+    * where a minimal perfect hash says, in the manner of CHD (hash, displace
+    * and compress, without the compress): the elements are split into
+    * buckets of about EM_ASA_FROZEN_LAMBDA by one hash, and every bucket,
+    * biggest first, gets the displacement (d0, d1) that lands all of its
+    * elements on free slots at (f1 + f2(d0) + d1) mod n. A lookup is then a
+    * hash, a displacement load and a single id comparison, hit or miss, with
+    * no groups, tombstones, migration or bloom filter in the way.
+    *
+    * All of the hashes come from mixing the probe hash with a salt, so the
+    * keys aren't hashed again. The odd salt that leaves a bucket with nowhere
+    * to go is swapped for another, and a table whose ids can't be told apart
+    * that way is left as it was and EM_INIT_FAILURE returned. Once frozen,
+    * the table is read-only; indices stay below aa_count, and every one of
+    * them holds an element. EM_ASA_CACHE tables can't be frozen, as a lookup
+    * has to write to them, and neither can tables of 2^32 elements or more,
+    * as the perfect hash only ranges over 32 bits.
+    */
 
-   cur_el_hdr->flags |= FL_DELETE;
-   header->elements--;
-   header->ld_elements++;
+   I_PREPHDR;
 
-   em_i_asa_reform(a, false);
+   if (header->frozen)
+      return EM_STATUS_OKAY;
+   if (I_ISCACHE || header->snap)
+      return EM_INVALID_TYPE;
+   if (header->elements > UINT32_MAX)
+      return EM_OUT_OF_BOUNDS;
 
-   I_REINHDR;
+   em_status_t stat = em_i_asa_migrate(a, ~0UL);
+   if (stat != EM_STATUS_OKAY)
+      return stat;
+
+   struct em_asa_slab_s *slab = &header->cur;
+   unsigned long n = header->elements, slots = __em_max(n, 1UL);
+   struct em_asa_fbuild_s fb = {
+      .n = n,
+      .buckets = (slots + EM_ASA_FROZEN_LAMBDA - 1) / EM_ASA_FROZEN_LAMBDA,
+   };
+
+   fb.src = em_i_asa_xalloc(header, slots * sizeof(*fb.src));
+   fb.hash = em_i_asa_xalloc(header, slots * sizeof(*fb.hash));
+   fb.members = em_i_asa_xalloc(header, slots * sizeof(*fb.members));
+   fb.start = em_i_asa_xalloc(header, (fb.buckets + 1) * sizeof(*fb.start));
+   fb.order = em_i_asa_xalloc(header, fb.buckets * sizeof(*fb.order));
+   fb.place = em_i_asa_xalloc(header, slots * sizeof(*fb.place));
+   fb.taken = em_i_asa_xalloc(header, (slots + 63) / 64 * sizeof(*fb.taken));
+   fb.disp = em_i_asa_xalloc(header, fb.buckets * sizeof(*fb.disp));
+
+   signed char *ctrl = em_i_asa_salloc(header, slots);
+   em_asa_id_t *ids = em_i_asa_salloc(header, slots * EM_ASA_ID_SZ);
+   void *vals = em_i_asa_salloc(header, slots * header->element_size);
+
+   stat = EM_OUT_OF_MEMORY;
+
+   if (fb.src && fb.hash && fb.members && fb.start && fb.order && fb.place &&
+       fb.taken && fb.disp && ctrl && ids && vals) {
+      unsigned long e = 0;
+
+      for (unsigned long x = 0; x <= slab->highest_index; x++)
+         if (slab->ctrl[x] >= 0)
+            fb.src[e++] = x;
+
+      stat = EM_INIT_FAILURE;
+
+      for (unsigned int t = 0; t < EM_ASA_FROZEN_TRIES; t++) {
+         header->frozen_salt = em_mt_genrand64_int64(&em_mt19937_global);
+         header->frozen_buckets = fb.buckets;
+
+         if (em_i_asa_fplace(header, slab, &fb)) {
+            stat = EM_STATUS_OKAY;
+            break;
+         }
+      }
+   }
+
+   if (stat == EM_STATUS_OKAY) {
+      /* An empty table still gets a slot, so there's something to point at */
+      ctrl[0] = CT_EMPTY;
+      memset(ids, 0, EM_ASA_ID_SZ);
+      memset(vals, 0, header->element_size);
+
+      for (unsigned long e = 0; e < n; e++) {
+         ctrl[fb.place[e]] = slab->ctrl[fb.src[e]];
+         ids[fb.place[e]] = slab->ids[fb.src[e]];
+         memcpy((char *)vals + (size_t)fb.place[e] * header->element_size,
+                I_VALP(slab, fb.src[e]), header->element_size);
+      }
+
+      /* Exact keys stay where they are, in the slab's key arena */
+      em_i_asa_sfree(header, slab->ctrl);
+      em_i_asa_sfree(header, slab->ids);
+      em_i_asa_sfree(header, slab->vals);
+      em_i_asa_sfree(header, slab->dist);
+      em_i_asa_xfree(header, slab->bloom.filter);
+      em_i_asa_xfree(header, slab->cuckoo.table);
+
+      slab->highest_index = slots - 1;
+      slab->ld_elements = 0;
+      slab->ddepth = 0;
+      slab->ctrl = ctrl;
+      slab->ids = ids;
+      slab->vals = vals;
+      slab->dist = NULL;
+      slab->bloom = (em_bloom_t){ 0 };
+      slab->cuckoo = (em_cuckoo_t){ 0 };
+
+      header->frozen = fb.disp;
+   } else {
+      em_i_asa_sfree(header, ctrl);
+      em_i_asa_sfree(header, ids);
+      em_i_asa_sfree(header, vals);
+      em_i_asa_xfree(header, fb.disp);
+   }
+
+   em_i_asa_xfree(header, fb.src);
+   em_i_asa_xfree(header, fb.hash);
+   em_i_asa_xfree(header, fb.members);
+   em_i_asa_xfree(header, fb.start);
+   em_i_asa_xfree(header, fb.order);
+   em_i_asa_xfree(header, fb.place);
+   em_i_asa_xfree(header, fb.taken);
+
+   return stat;
+}
+
+em_status_t em_i_asa_snapshot(void **a, void **out)
+{
+   /* Makes *out a read-only table of the elements this one holds right now,
+    * see EM_ASA_SNAPSHOTS. Its slab arrays are mapped a second time from
+    * this table's, which costs a few system calls whatever their size; the
+    * chunks of them this table writes to later on are copied out for it by
+    * em_i_asa_keep just before. A migration that's still running is finished
+    * first so the snapshot gets the one slab, and it goes without a
+    * prefilter. This table can't be written to while a snapshot is being
+    * taken, but after that, the snapshot can be read and freed from any
+    * thread, before or after this table is freed. */
+
+   I_PREPHDR;
+
+   *out = NULL;
+
+   if (!header->snaps || header->flags & EM_ASA_EXACT_KEYS || I_ISCACHE ||
+       header->frozen)
+      return EM_INVALID_TYPE;
+
+   em_status_t stat = em_i_asa_migrate(a, ~0UL);
+   if (stat != EM_STATUS_OKAY)
+      return stat;
+
+   struct em_asa_hdr_s *snap = em_i_asa_xalloc(header, EM_ASA_HR_SZ);
+   struct em_asa_snap_s *sn = em_i_asa_xalloc(header, sizeof(*sn));
+   if (!snap || !sn) {
+      em_i_asa_xfree(header, snap);
+      em_i_asa_xfree(header, sn);
+      return EM_OUT_OF_MEMORY;
+   }
+
+   const struct em_asa_slab_s *live = &header->cur;
+   struct em_asa_slab_s *slab = &snap->cur;
+
+   memcpy(snap, header, EM_ASA_HR_SZ);
+   slab->ctrl = NULL;
+   slab->ids = NULL;
+   slab->vals = NULL;
+   slab->dist = NULL;
+   slab->bloom = (em_bloom_t){ 0 };
+   slab->cuckoo = (em_cuckoo_t){ 0 };
+   snap->map_rdonly = true;
+   snap->retire = NULL;
+   snap->snaps = NULL;
+   snap->snap = sn;
+
+   /* Listed before it has any views, so a failure can be cleaned up like
+    * any other snapshot */
+   *sn = (struct em_asa_snap_s){ .reg = header->snaps };
+
+   pthread_mutex_lock(&sn->reg->lock);
+   sn->next = sn->reg->list;
+   sn->reg->refs++;
+   __atomic_store_n(&sn->reg->list, sn, __ATOMIC_RELEASE);
+   pthread_mutex_unlock(&sn->reg->lock);
+
+   slab->ctrl = em_i_asa_viewmk(header, &sn->views[0], live->ctrl);
+   slab->ids = em_i_asa_viewmk(header, &sn->views[1], live->ids);
+   slab->vals = em_i_asa_viewmk(header, &sn->views[2], live->vals);
+   slab->dist = em_i_asa_viewmk(header, &sn->views[3], live->dist);
+
+   if (!slab->ctrl || !slab->ids || !slab->vals || !slab->dist != !live->dist) {
+      em_i_asa_destroy((void **)&snap);
+      return EM_OUT_OF_MEMORY;
+   }
+
+   *out = snap;
 
    return EM_STATUS_OKAY;
 }
 
-/* Static Definitions ------------------------------------------------------- */
+bool em_i_asa_snapok(void **a)
+{
+   /* Whether a snapshot still holds the elements as they were when it was
+    * taken. It doesn't once the table has written to a chunk that couldn't
+    * be copied out for it first, for want of memory or of mappings. Tables
+    * that aren't snapshots always do. */
 
-static unsigned long em_i_asa_rup2f32(unsigned long v)
+   I_PREPHDR;
+
+   return !header->snap ||
+          !__atomic_load_n(&header->snap->stale, __ATOMIC_ACQUIRE);
+}
+
+long em_i_asa_lookup(void **a, em_asa_id_t id)
 {
-   /* https://graphics.stanford.edu/~seander/bithacks.html#RoundUpPowerOf2 */
+   I_PREPHDR;
+
+   long idx = em_i_asa_probe(a, &id);
+
+   if (idx >= 0 && I_ISCACHE)
+      idx = em_i_asa_touch(a, idx, em_i_asa_now(header));
 
-   v--;
-   v |= v >> 1;
-   v |= v >> 2;
-   v |= v >> 4;
-   v |= v >> 8;
-   v |= v >> 16;
-   v++;
+   if (I_TALLIES) {
+      header->lookups++;
+      if (idx < 0)
+         header->misses++;
+      if (header->lookups >= EM_ASA_BLOOM_SAMPLE)
+         em_i_asa_filterck(header);
+   }
 
-   return v;
+   return idx;
 }
 
-static em_status_t em_i_asa_ensurei(void **a, unsigned long high_as)
+size_t em_i_asa_lookup_batch(void **a, const em_asa_id_t *ids, size_t n,
+                             long *out)
 {
-   /* Very lackluster memory saving technique - only allocate up to the highest
-    * occupied index in the table's main array.
+   /* Resolves n keys at once. Rather than walking filter bits -> first slot ->
+    * comparison for each key in turn (a chain of dependent cache misses), the
+    * keys are processed in rounds of EM_ASA_BATCH: first the prefilter bits of
+    * every key in the round are prefetched, then every surviving key has its
+    * first probe group prefetched, and only then are the probes actually run.
+    * By the time a key is touched its memory should already be on the way.
     */
 
    I_PREPHDR;
 
-   unsigned long ohil = header->highest_index + 1;
-   size_t olsize = EM_ASA_HR_SZ + (size_t)ohil * I_TELS_HS;
-   size_t nwsize = EM_ASA_HR_SZ + ((size_t)high_as + 1) * I_TELS_HS;
+   const struct em_asa_slab_s *cur = &header->cur;
+   unsigned long pending, now = I_ISCACHE ? em_i_asa_now(header) : 0;
+   size_t found = 0;
+
+   for (size_t base = 0; base < n; base += EM_ASA_BATCH) {
+      size_t round = __em_min(n - base, (size_t)EM_ASA_BATCH);
+
+      if (I_PFHAS(cur))
+         for (size_t x = 0; x < round; x++)
+            em_i_asa_pfprefetch(cur, ids[base + x].probe);
+
+      pending = 0;
+      for (size_t x = 0; x < round; x++) {
+         out[base + x] = -1;
+
+         /* Mid-migration, the key may yet be sitting in the old slab. The
+          * filter is counted here as em_i_asa_sprobe would, and not asked
+          * again there. */
+         if (!header->old.ctrl && I_PFHAS(cur)) {
+            I_COUNT(bloom_queries);
+
+            if (!em_i_asa_pfin(cur, ids[base + x].probe)) {
+               I_COUNT(bloom_rejects);
+               continue;
+            }
+         }
+
+         pending |= 1UL << x;
+
+         if (header->frozen) {
+            __builtin_prefetch(header->frozen +
+                               I_FBUCKET(I_FHASH(ids[base + x].probe)));
+            continue;
+         }
+
+         unsigned long home = ids[base + x].probe & I_TIERCLM(header->cur.tier);
+         if (home <= header->cur.highest_index) {
+            __builtin_prefetch(header->cur.ctrl + home);
+            __builtin_prefetch(header->cur.ids + home);
+         }
+      }
 
-   if (nwsize <= olsize)
-      return EM_STATUS_OKAY;
+      for (size_t x = 0; x < round; x++) {
+         if (!(pending & (1UL << x)))
+            continue;
 
-   *a = realloc(*a, nwsize);
-   if (!*a)
-      return EM_OUT_OF_MEMORY;
+         const em_asa_id_t *id = &ids[base + x];
 
-   /* We've changed the pointer, so reinitialize the header one. */
-   I_REINHDR;
+         if (header->old.ctrl)
+            out[base + x] = em_i_asa_probe(a, id);
+         else if (!header->frozen)
+            out[base + x] = em_i_asa_sprobe(a, cur, id, true);
+         else if ((out[base + x] = em_i_asa_fprobe(header, id)) < 0 &&
+                  I_PFHAS(cur))
+            I_COUNT(bloom_false_positives);
 
-   header->highest_index = high_as;
-   void *axd = em_i_asa_getip(a, ohil);
-   if (!axd)
-      return EM_OUT_OF_MEMORY;
+         if (out[base + x] >= 0 && I_ISCACHE)
+            out[base + x] = em_i_asa_touch(a, out[base + x], now);
+         if (out[base + x] >= 0)
+            found++;
+      }
+   }
 
-   memset(axd, 0, nwsize - olsize);
+   if (I_TALLIES) {
+      header->lookups += n;
+      header->misses += n - found;
+      if (header->lookups >= EM_ASA_BLOOM_SAMPLE)
+         em_i_asa_filterck(header);
+   }
 
-   return EM_STATUS_OKAY;
+   return found;
+}
+
+size_t em_i_asa_getp_batch(void **a, const em_asa_id_t *ids, size_t n,
+                           void **out)
+{
+   long idx[EM_ASA_BATCH];
+   size_t found = 0;
+
+   for (size_t base = 0; base < n; base += EM_ASA_BATCH) {
+      size_t round = __em_min(n - base, (size_t)EM_ASA_BATCH);
+
+      found += em_i_asa_lookup_batch(a, &ids[base], round, idx);
+
+      for (size_t x = 0; x < round; x++)
+         out[base + x] = em_i_asa_getvpw(a, idx[x]);
+   }
+
+   return found;
 }
 
-static em_status_t em_i_asa_grow(void **a)
+void *em_i_asa_getvpk(void **a, long idx)
 {
+   /* em_i_asa_getvp, for a value that's about to be written through the
+    * pointer, so any snapshot still sharing it gets its own copy first */
+
    I_PREPHDR;
 
-   if ((double)header->elements <=
-       2.0L / 3.0L * (double)(I_TIERCLM(header->tier) + 1))
-      return EM_STATUS_OKAY;
-   if (header->tier >= EM_ASA_MAX_TIER)
-      return EM_INT_OVERFLOW;
+   if (!em_i_asa_inrange(a, idx))
+      return NULL;
+
+   I_KEEP(em_i_asa_slabof(a, idx), em_i_asa_slotof(a, idx),
+          em_i_asa_slotof(a, idx));
+
+   return em_i_asa_getvp(a, idx);
+}
+
+long em_i_asa_next(void **a, long idx)
+{
+   /* Returns the index of the first element after idx, or of the first one
+    * in the table for a negative idx, or -1 past the last. Going by control
+    * bytes, a group at a time, it only touches the slots of the elements it
+    * lands on, so walking the table costs a sixteenth of a load per slot plus
+    * one per element. Expired cache elements are skipped, as lookups would.
+    * Any set or delete may move elements around, and so ends a walk; start
+    * again from -1 after one.
+    */
+
+   I_PREPHDR;
+
+   unsigned long now = I_ISCACHE ? em_i_asa_now(header) : 0;
+   long x = idx < 0 ? -1 : idx;
+
+   while ((x = em_i_asa_inext(header, x + 1, ~0UL)) >= 0 && I_ISCACHE &&
+          em_i_asa_expired(header, x, now))
+      ;
+
+   return x;
+}
+
+em_status_t em_i_asa_foreach(void **a,
+                             void (*fn)(long idx, unsigned int t, void *ctx),
+                             void *ctx, unsigned int threads)
+{
+   /* Calls fn with the index of every element, as em_i_asa_next would walk
+    * them but split over up to `threads` threads, or one per CPU for 0, and
+    * fewer for small tables. Each thread is given an even share of the slots
+    * of both slabs, and passes its number t, below the thread count, along to
+    * fn, for callbacks that keep a tally per thread. Returns once all of them
+    * are done.
+    *
+    * fn may read any element by index and write to the value at its own, but
+    * mustn't do anything else to the table, lookups included: those keep
+    * counters in it.
+    */
+
+   I_PREPHDR;
+
+   struct em_asa_each_s e = {
+      .header = header,
+      .ncur = header->cur.ctrl ? header->cur.highest_index + 1 : 0,
+      .now = I_ISCACHE ? em_i_asa_now(header) : 0,
+      .fn = fn,
+      .ctx = ctx,
+   };
+
+   e.total = e.ncur + (header->old.ctrl ? header->old.highest_index + 1 : 0);
+
+   if (!threads) {
+      long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+      threads = cpus > 0 ? cpus : 1;
+   }
+
+   e.threads = __em_max(1UL, __em_min((unsigned long)threads,
+                                      e.total / EM_ASA_EACH_MIN));
+
+   em_i_asa_run(&e, e.threads, em_i_asa_eachw);
+
+   return EM_STATUS_OKAY;
+}
+
+em_status_t em_i_asa_set(void **a, em_asa_id_t id, void *value)
+{
+   I_PREPHDR;
+
+   return em_i_asa_setm(a, id, value,
+                        I_ISCACHE ? em_i_asa_expiry(header, header->cache.ttl) :
+                                    0);
+}
+
+em_status_t em_i_asa_setttl(void **a, em_asa_id_t id, void *value,
+                            unsigned long ttl)
+{
+   /* As em_i_asa_set, but the element expires ttl seconds from now rather
+    * than after the table's default, or never for a ttl of 0 */
+
+   I_PREPHDR;
+
+   if (!I_ISCACHE)
+      return EM_INVALID_TYPE;
+
+   return em_i_asa_setm(a, id, value, em_i_asa_expiry(header, ttl));
+}
+
+em_status_t em_i_asa_cache(void **a, unsigned long max_elements,
+                           size_t max_bytes, unsigned long ttl)
+{
+   /* Sets the budget of an EM_ASA_CACHE table. The table is held at the
+    * biggest tier whose slots, fully allocated, fit in max_bytes, and to at
+    * most 3/4 of that tier's max load or max_elements, whichever is fewer; a
+    * budget of 0 leaves that side of it out. A set of a new key past the
+    * limit evicts an element first, and a table that runs into the tier with
+    * too many tombstones is compacted rather than grown. While a rebuild is
+    * running both slabs are around, so peak memory is up to twice the
+    * budget. Anything already past the new limit is evicted right away.
+    */
+
+   I_PREPHDR;
+
+   if (!I_ISCACHE)
+      return EM_INVALID_TYPE;
+   if (I_RDONLY)
+      return EM_READ_ONLY;
+
+   /* Control byte, id, value, meta, and a byte for a Robin Hood distance or
+    * a prefilter, which is at most that */
+   size_t per_slot = 1 + EM_ASA_ID_SZ + header->element_size +
+                     sizeof(*header->cur.meta) + (I_ISRH ? 2 : 1);
+   unsigned char tier = EM_ASA_MAX_TIER;
+
+   if (max_elements > I_CACHELIM(EM_ASA_MAX_TIER))
+      return EM_INT_OVERFLOW;
+   if (max_bytes &&
+       max_bytes < ((size_t)I_TIERCLM(EM_ASA_MIN_TIER) + 1) * per_slot)
+      return EM_OUT_OF_BOUNDS;
+
+   while (max_bytes && ((size_t)I_TIERCLM(tier) + 1) * per_slot > max_bytes)
+      tier--;
+
+   if (max_elements) {
+      unsigned char fit = EM_ASA_MIN_TIER;
+
+      while (I_CACHELIM(fit) < max_elements)
+         fit++;
+
+      tier = __em_min(tier, fit);
+   }
+
+   header->cache.ttl = ttl;
+   header->cache.tier = 0;
+   header->cache.limit = 0;
+
+   if (max_elements || max_bytes) {
+      header->cache.tier = tier;
+      header->cache.limit =
+         __em_min(max_elements ?: ~0UL, I_CACHELIM(tier));
+   }
+
+   while (header->cache.limit && header->elements > header->cache.limit)
+      em_i_asa_evict(a);
+
+   if (header->cache.tier && header->cur.tier > header->cache.tier)
+      return em_i_asa_rehash(a, header->cache.tier);
+
+   return EM_STATUS_OKAY;
+}
+
+em_status_t em_i_asa_reform(void **a, bool forced)
+{
+   /* This function rebuilds the entire associative array, and has a similar
+    * effect on performance to Windows' defrag tool. The goal of this function
+    * is to attempt to rid the table of lazy-deleted cells and to downscale the
+    * table when many cells are marked as deleted, saving memory.
+    */
+
+   I_PREPHDR;
+
+   if (I_RDONLY)
+      return EM_READ_ONLY;
+   if (header->elements < 1)
+      return em_i_asa_empty(a);
+   if ((signed char)header->cur.tier - 1 < EM_ASA_MIN_TIER ||
+       (!forced && header->cur.ld_elements << 1 < em_i_asa_freeslots(a)))
+      return EM_STATUS_OKAY; /* Table doesn't need downscaling, exit safely */
+
+   struct em_asa_hdr_s *new_table = NULL;
+   em_status_t stat =
+      em_i_asa_inita((void **)&new_table, header->element_size, header->hash,
+                     header->flags, header->mi);
+   if (stat != EM_STATUS_OKAY) {
+      em_i_asa_destroy((void **)&new_table);
+      return stat;
+   }
+   new_table->seed = header->seed;
+   new_table->lookups = header->lookups;
+   new_table->misses = header->misses;
+   /* Expiries carry over as they are, so they need the same epoch. The
+    * budget comes back after the refill, which mustn't evict anything. */
+   new_table->cache.epoch = header->cache.epoch;
+   /* Reserve the final size while refilling, or the still nearly empty
+    * table would start shrinking right away */
+   new_table->reserved = __em_max(header->elements, header->reserved);
+   new_table->cur.tier = em_i_asa_fittier(header, new_table->reserved);
+   em_i_asa_filtermk(new_table, &new_table->cur, I_PFHAS(&header->cur));
+
+   struct em_asa_slab_s *slabs[] = { &header->cur, &header->old };
+
+   for (unsigned int s = 0; s < 2; s++) {
+      if (!slabs[s]->ctrl)
+         continue;
+
+      for (unsigned long x = 0; x <= slabs[s]->highest_index; x++)
+         if (slabs[s]->ctrl[x] >= 0)
+            if ((stat = em_i_asa_setm(
+                    (void **)&new_table, slabs[s]->ids[x], I_VALP(slabs[s], x),
+                    slabs[s]->meta ? slabs[s]->meta[x] : 0)) !=
+                EM_STATUS_OKAY) {
+               em_i_asa_destroy((void **)&new_table);
+               return stat;
+            }
+   }
+
+   new_table->reserved = header->reserved;
+   new_table->cache = header->cache;
+   new_table->cache.hand = 0;
+
+   /* Refilling the new table may have counted rebuilds of its own */
+   new_table->counters = header->counters;
+   new_table->counters.reforms++;
+
+   /* Nothing could have seen the new table yet, so it only picks up the
+    * retire hook once it's about to replace the old one. */
+   new_table->retire = header->retire;
+   new_table->retire_ctx = header->retire_ctx;
+
+   em_i_asa_destroy(a);
+   *a = new_table;
+
+   I_REINHDR;
+
+   return EM_STATUS_OKAY;
+}
+
+em_status_t em_i_asa_delete(void **a, em_asa_id_t id)
+{
+   I_PREPHDR;
+
+   if (I_RDONLY)
+      return EM_READ_ONLY;
+
+   long ilookup = em_i_asa_probe(a, &id);
+   if (ilookup < 0)
+      return EM_EL_NOT_FOUND;
+
+   /* An expired element is already gone as far as lookups go, so it's
+    * reported missing, but its slot is reclaimed all the same */
+   bool expired =
+      I_ISCACHE && em_i_asa_expired(header, ilookup, em_i_asa_now(header));
+
+   em_i_asa_delidx(a, em_i_asa_slabof(a, ilookup),
+                   em_i_asa_slotof(a, ilookup));
+
+   /* The element is gone either way, and a table that can't shrink right now
+    * is still a perfectly good table, so a failed shrink isn't reported. */
+   em_i_asa_balance(a);
+
+   em_status_t mstat = em_i_asa_migrate(a, I_MIGSTEP(header));
+
+   return expired && mstat == EM_STATUS_OKAY ? EM_EL_NOT_FOUND : mstat;
+}
+
+/* Static Definitions ------------------------------------------------------- */
+
+static em_status_t em_i_asa_setm(void **a, em_asa_id_t id, void *value,
+                                 unsigned int meta)
+{
+   /* em_i_asa_set, with the cache meta entry a new element gets. An element
+    * that was already there is marked referenced instead, with the expiry
+    * from meta. */
+
+   I_PREPHDR;
+
+   if (I_RDONLY)
+      return EM_READ_ONLY;
+
+   /* Make sure there's room, growing or compacting the table if not */
+   em_status_t gstat = em_i_asa_balance(a);
+   if (gstat != EM_STATUS_OKAY)
+      return gstat;
+
+   /* If the element already exists, set the value (Python-style). It might
+    * still be waiting in the old slab, in which case it's updated there and
+    * carries the new value along when it migrates. */
+   long ilookup = em_i_asa_probe(a, &id);
+   if (ilookup >= 0) {
+      struct em_asa_slab_s *slab = em_i_asa_slabof(a, ilookup);
+      unsigned long slot = em_i_asa_slotof(a, ilookup);
+
+      I_KEEP(slab, slot, slot);
+      memcpy(I_VALP(slab, slot), value, header->element_size);
+      if (slab->meta)
+         slab->meta[slot] = meta | EM_ASA_CACHE_REF;
+
+      return em_i_asa_migrate(a, I_MIGSTEP(header));
+   }
+
+   /* A cache that's full makes room before it takes anything new */
+   if (header->cache.limit && header->elements >= header->cache.limit)
+      em_i_asa_evict(a);
+
+   if ((gstat = em_i_asa_splace(a, &header->cur, &id, value, meta)) !=
+       EM_STATUS_OKAY)
+      return gstat;
+
+   header->elements++;
+
+   return em_i_asa_migrate(a, I_MIGSTEP(header));
+}
+
+static void em_i_asa_delidx(void **a, struct em_asa_slab_s *slab,
+                            unsigned long slot)
+{
+   /* Takes the element in the given slot out of the table, leaving any
+    * rebuilding to the caller */
+
+   I_PREPHDR;
+
+   if (I_ISEXACT(&slab->ids[slot])) {
+      slab->keys_live -= slab->ids[slot].usect.xsect.len;
+      slab->keys_dead += slab->ids[slot].usect.xsect.len;
+   }
+
+   if (slab->cuckoo.table)
+      em_cuckoo_delh(&slab->cuckoo, slab->ids[slot].probe);
+
+   I_KEEP(slab, slot, slot);
+
+   /* A group that still has an empty slot never had a probe sequence run
+    * through it, so the slot can go straight back to empty. Otherwise leave a
+    * tombstone to keep later groups reachable, unless it's a Robin Hood slab
+    * taking new elements, which fills the gap from further along instead. */
+   if (slab->dist && slab == &header->cur) {
+      em_i_asa_rhshift(a, slab, slot);
+   } else if (em_i_asa_gmatch(slab->ctrl + (slot & ~(EM_ASA_GROUP - 1)),
+                              CT_EMPTY)) {
+      slab->ctrl[slot] = CT_EMPTY;
+   } else {
+      slab->ctrl[slot] = CT_DELETE;
+      slab->ld_elements++;
+      if (slab->dist)
+         slab->dist[slot] = EM_ASA_RH_DEAD;
+   }
+
+   header->elements--;
+}
+
+static unsigned long em_i_asa_now(const struct em_asa_hdr_s *header)
+{
+   /* Seconds past the table's cache epoch, on a clock that doesn't jump */
+
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+
+   return (unsigned long long)ts.tv_sec - header->cache.epoch;
+}
+
+static unsigned int em_i_asa_expiry(const struct em_asa_hdr_s *header,
+                                    unsigned long ttl)
+{
+   /* The meta entry of an element set now to live for ttl seconds. Expiries
+    * too far out to fit are cut short, ~68 years past the epoch. */
+
+   if (!ttl)
+      return 0;
+
+   return __em_min(em_i_asa_now(header) + __em_min(ttl, (unsigned long)~0U),
+                   (unsigned long)~EM_ASA_CACHE_REF);
+}
+
+static inline bool em_i_asa_expired(const struct em_asa_hdr_s *header,
+                                    long idx, unsigned long now)
+{
+   void *hp = (void *)header;
+   void **a = &hp;
+   unsigned int expiry =
+      em_i_asa_slabof(a, idx)->meta[em_i_asa_slotof(a, idx)] &
+      ~EM_ASA_CACHE_REF;
+
+   return expiry && now >= expiry;
+}
+
+static long em_i_asa_touch(void **a, long idx, unsigned long now)
+{
+   /* Marks a cache hit as referenced, or turns it into a miss if it has
+    * expired */
+
+   if (em_i_asa_expired(*a, idx, now))
+      return -1;
+
+   em_i_asa_slabof(a, idx)->meta[em_i_asa_slotof(a, idx)] |= EM_ASA_CACHE_REF;
+
+   return idx;
+}
+
+static void em_i_asa_evict(void **a)
+{
+   /* Evicts one element, by CLOCK (second chance): the hand sweeps the
+    * current slab's slots and then the old slab's, if there is one, clearing
+    * the reference bits it passes until it gets to an element that's expired
+    * or wasn't referenced since the last time round. That's found within two
+    * laps at most, as the first one clears every bit.
+    */
+
+   I_PREPHDR;
+
+   unsigned long ncur = header->cur.highest_index + 1;
+   unsigned long total = ncur +
+                         (header->old.ctrl ? header->old.highest_index + 1 : 0);
+   unsigned long now = em_i_asa_now(header);
+
+   for (unsigned long n = 0; n <= 2 * total; n++) {
+      if (header->cache.hand >= total)
+         header->cache.hand = 0;
+
+      unsigned long h = header->cache.hand++;
+      struct em_asa_slab_s *slab = h < ncur ? &header->cur : &header->old;
+      unsigned long slot = h < ncur ? h : h - ncur;
+      unsigned int *meta = &slab->meta[slot];
+      unsigned int expiry = *meta & ~EM_ASA_CACHE_REF;
+
+      if (slab->ctrl[slot] < 0)
+         continue;
+
+      if (expiry && now >= expiry) {
+         header->counters.expirations++;
+      } else if (*meta & EM_ASA_CACHE_REF) {
+         *meta &= ~EM_ASA_CACHE_REF;
+         continue;
+      }
+
+      header->counters.evictions++;
+      em_i_asa_delidx(a, slab, slot);
+      return;
+   }
+}
+
+static XXH128_hash_t em_i_asa_hash(const struct em_asa_hdr_s *header,
+                                   const void *key, size_t amt)
+{
+   /* Runs the table's hash over the key. Every variant hands back 128 bits for
+    * em_i_asa_hrange to spread over the id, but only 128-bit xxHash3 has 128
+    * bits of actual entropy; the others fill the high half from the low one.
+    * CRC32C hands keys longer than the id holds to 128-bit xxHash3, as those
+    * are told apart by their hash alone.
+    */
+
+   unsigned long long seed = header->seed;
+   XXH128_hash_t h;
+
+   switch (header->hash) {
+   case EM_ASA_HASH_XXH128:
+      return XXH3_128bits_withSeed(key, amt, (XXH64_hash_t)seed);
+#ifdef EM_ASA_HAVE_CRC32C
+   case EM_ASA_HASH_CRC32C:
+      if (amt > EM_ASA_KEY_COLRES)
+         return XXH3_128bits_withSeed(key, amt, (XXH64_hash_t)seed);
+      return em_i_asa_hcrc(key, amt, seed);
+#endif
+   case EM_ASA_HASH_INT:
+      if (amt <= sizeof(unsigned long long)) {
+         /* Short keys are also stored verbatim in the id, so the hash only
+          * has to place them well, which a seeded mixer does in a few
+          * cycles. The length goes in too, so 0 and "" don't coincide. */
+         unsigned long long k = em_i_asa_loadw(key, amt);
+
+         h.low64 = em_i_asa_fmix(k ^ seed) + amt;
+         h.high64 = em_i_asa_fmix(h.low64 ^ __em_rol(seed, 32));
+         return h;
+      }
+      break;
+   default:
+      break;
+   }
+
+   /* 64-bit xxHash3, which the others fall back to */
+   h.low64 = XXH3_64bits_withSeed(key, amt, (XXH64_hash_t)seed);
+   h.high64 = em_i_asa_fmix(h.low64 ^ __em_rol(seed, 32));
+
+   return h;
+}
+
+static inline unsigned long long em_i_asa_fmix(unsigned long long k)
+{
+   /* MurmurHash3's 64-bit finalizer */
+
+   k ^= k >> 33;
+   k *= 0xFF51AFD7ED558CCDULL;
+   k ^= k >> 33;
+   k *= 0xC4CEB9FE1A85EC53ULL;
+   k ^= k >> 33;
+
+   return k;
+}
+
+static inline unsigned long long em_i_asa_loadw(const unsigned char *p,
+                                                size_t amt)
+{
+   /* Reads up to 8 key bytes as a little-endian, zero-padded word. Uses
+    * fixed-size, possibly overlapping loads, as a variable-length copy into a
+    * word right before reading it back stalls on store forwarding.
+    */
+
+   unsigned int lo, hi;
+
+   if (amt >= sizeof(lo)) {
+      memcpy(&lo, p, sizeof(lo));
+      memcpy(&hi, p + amt - sizeof(hi), sizeof(hi));
+      return lo | (unsigned long long)hi >> (8 * (8 - amt)) << 32;
+   }
+
+   return amt ? p[0] | (amt > 1 ? p[1] << 8 : 0) | (amt > 2 ? p[2] << 16 : 0) :
+                0;
+}
+
+#ifdef EM_ASA_HAVE_CRC32C
+__attribute__((target("sse4.2"))) static XXH128_hash_t
+em_i_asa_hcrc(const void *key, size_t amt, unsigned long long seed)
+{
+   /* Two CRC32C lanes, eight bytes per instruction each, for keys of up to
+    * EM_ASA_KEY_COLRES bytes. CRC is linear in its input whatever it starts
+    * from, so raw words would let keys be solved for that collide under every
+    * seed; each word goes through the seeded mixer first. A second lane over
+    * the same words would only ever differ from the first by a constant, so
+    * it's fed each mixed word multiplied instead. Only picked where the CPU
+    * supports it (see em_i_asa_inith).
+    */
+
+   const unsigned char *p = key;
+   unsigned long long lo = (unsigned int)seed, hi = seed >> 32, w;
+   size_t rest = amt;
+
+   for (; rest >= sizeof(w); rest -= sizeof(w), p += sizeof(w)) {
+      memcpy(&w, p, sizeof(w));
+      w = em_i_asa_fmix(w ^ seed);
+      lo = _mm_crc32_u64(lo, w);
+      hi = _mm_crc32_u64(hi, w * 0x9E3779B97F4A7C15ULL);
+   }
+
+   if (rest) {
+      w = em_i_asa_fmix(em_i_asa_loadw(p, rest) ^ amt ^ seed);
+      lo = _mm_crc32_u64(lo, w);
+      hi = _mm_crc32_u64(hi, w * 0x9E3779B97F4A7C15ULL);
+   }
+
+   XXH128_hash_t h;
+
+   h.low64 = em_i_asa_fmix((lo << 32 | hi) ^ seed ^ amt);
+   h.high64 = em_i_asa_fmix(h.low64 ^ __em_rol(seed, 32));
+
+   return h;
+}
+#endif
+
+static long em_i_asa_probe(void **a, const em_asa_id_t *id)
+{
+   /* Looks the id up in the current slab and, while a migration is running,
+    * in the old one. Old slab hits are returned past the end of the current
+    * slab's index space (see em_i_asa_slabof). */
+
+   I_PREPHDR;
+
+   if (header->frozen)
+      return em_i_asa_fprobe(header, id);
+
+   long probe = em_i_asa_sprobe(a, &header->cur, id, false);
+   if (probe >= 0 || !header->old.ctrl)
+      return probe;
+
+   probe = em_i_asa_sprobe(a, &header->old, id, false);
+
+   return probe < 0 ? probe : (long)em_i_asa_span(header) + probe;
+}
+
+static long em_i_asa_sprobe(void **a, const struct em_asa_slab_s *slab,
+                            const em_asa_id_t *id, bool asked)
+{
+   /* The home group is picked by the probe hash masked with the slab's tier
+    * mask. Each group's control bytes are matched against the tag all at once,
+    * and only tag hits have their full ids compared. asked means the caller
+    * has already had the id through the slab's prefilter, and counted it.
+    */
+
+   I_PREPHDR;
+
+   if (I_PFHAS(slab) && !asked) {
+      I_COUNT(bloom_queries);
+
+      if (!em_i_asa_pfin(slab, id->probe)) {
+         I_COUNT(bloom_rejects);
+         return -1;
+      }
+   }
+
+   signed char tag = I_CTRLTAG(id->probe);
+   unsigned long group = I_HOMEGRP(id->probe, slab->tier);
+
+   for (unsigned long searches = 0; searches <= slab->ddepth; searches++) {
+      unsigned long base = group << EM_ASA_GRP_LOG2;
+
+      /* Groups that were never allocated have never held anything */
+      if (base > slab->highest_index)
+         break;
+
+      const signed char *ctrl = slab->ctrl + base;
+
+      for (unsigned int m = em_i_asa_gmatch(ctrl, tag); m; m &= m - 1) {
+         unsigned long probe = base + __builtin_ctz(m);
+
+         if (em_i_asa_keyeq(header, id, &slab->ids[probe]))
+            return probe;
+      }
+
+      /* Insertion stops at the first group with room, so an empty slot here
+       * means the element can't be any further along. */
+      if (em_i_asa_gmatch(ctrl, CT_EMPTY))
+         break;
+
+      /* In a Robin Hood slab, the element would have displaced anything
+       * closer to home than it is by now, so it can't be any further along
+       * either. */
+      if (slab->dist &&
+          em_i_asa_gbelow(slab->dist + base,
+                          __em_min(searches, (unsigned long)EM_ASA_RH_MAX)))
+         break;
+
+      group = I_PROBEGC(group, slab->tier);
+   }
+
+   if (I_PFHAS(slab))
+      I_COUNT(bloom_false_positives);
+
+   return -1;
+}
+
+static long em_i_asa_fprobe(const struct em_asa_hdr_s *header,
+                            const em_asa_id_t *id)
+{
+   /* Frozen tables (see em_i_asa_freeze) hold every element in the one slot
+    * the perfect hash gives it, so whatever is there either is the id or the
+    * id isn't in the table. */
+
+   unsigned long n = header->elements;
+
+   if (!n)
+      return -1;
+
+   unsigned long long h = I_FHASH(id->probe);
+   unsigned long long d = header->frozen[I_FBUCKET(h)];
+   unsigned long slot =
+      I_FWRAP(em_i_asa_fbase(h, d >> 32, n) + (d & 0xFFFFFFFF), n);
+
+   return em_i_asa_keyeq(header, id, &header->cur.ids[slot]) ? (long)slot : -1;
+}
+
+static inline unsigned long em_i_asa_fbase(unsigned long long h,
+                                           unsigned long long d0,
+                                           unsigned long n)
+{
+   /* Where an element lands for a bucket displacement of (d0, 0): f1 from
+    * the low half of its hash, plus an f2 that is drawn afresh for each d0.
+    * Every term stays below n, so no division is needed, and the bucket's
+    * d1 is then just added on. */
+
+   unsigned long f1 = I_FRANGE(h, n);
+   unsigned long f2 = I_FRANGE(em_i_asa_fmix(h + d0) >> 32, n);
+
+   return I_FWRAP(f1 + f2, n);
+}
+
+static bool em_i_asa_fplace(struct em_asa_hdr_s *header,
+                            const struct em_asa_slab_s *slab,
+                            struct em_asa_fbuild_s *fb)
+{
+   /* One attempt at the perfect hash for the salt in the header. The
+    * elements are counting-sorted into their buckets and the buckets by size,
+    * as the big ones are the hard ones to fit and go first, while the table
+    * is still mostly free. Single elements go last, straight into whatever
+    * slots are left: with d0 at 0, d1 can be worked out instead of searched.
+    */
+
+   unsigned long n = fb->n;
+   unsigned long sizes[EM_ASA_FROZEN_MAXB + 1] = { 0 };
+   unsigned long at[EM_ASA_FROZEN_MAXB + 1];
+
+   memset(fb->start, 0, (fb->buckets + 1) * sizeof(*fb->start));
+   memset(fb->taken, 0, (__em_max(n, 1UL) + 63) / 64 * sizeof(*fb->taken));
+
+   for (unsigned long e = 0; e < n; e++) {
+      fb->hash[e] = I_FHASH(slab->ids[fb->src[e]].probe);
+      fb->start[I_FBUCKET(fb->hash[e])]++;
+   }
+
+   for (unsigned long b = 0, sum = 0; b <= fb->buckets; b++) {
+      unsigned long size = fb->start[b];
+
+      if (b < fb->buckets) {
+         if (size > EM_ASA_FROZEN_MAXB)
+            return false;
+         sizes[size]++;
+      }
+
+      /* Bucket order doubles as a fill cursor until it's needed */
+      fb->start[b] = sum;
+      if (b < fb->buckets)
+         fb->order[b] = sum;
+      sum += size;
+   }
+
+   for (unsigned long e = 0; e < n; e++)
+      fb->members[fb->order[I_FBUCKET(fb->hash[e])]++] = e;
+
+   at[EM_ASA_FROZEN_MAXB] = 0;
+   for (unsigned long s = EM_ASA_FROZEN_MAXB; s > 0; s--)
+      at[s - 1] = at[s] + sizes[s];
+
+   for (unsigned long b = 0; b < fb->buckets; b++)
+      fb->order[at[fb->start[b + 1] - fb->start[b]]++] = b;
+
+   unsigned long next = 0;
+
+   for (unsigned long k = 0; k < fb->buckets; k++) {
+      unsigned long b = fb->order[k];
+      const uint32_t *m = fb->members + fb->start[b];
+      unsigned long size = fb->start[b + 1] - fb->start[b];
+
+      fb->disp[b] = 0;
+
+      if (size > 1) {
+         if (!em_i_asa_fbucket(fb, m, size, &fb->disp[b]))
+            return false;
+      } else if (size == 1) {
+         while (fb->taken[next / 64] >> (next % 64) & 1)
+            next++;
+
+         fb->disp[b] =
+            I_FWRAP(next + n - em_i_asa_fbase(fb->hash[m[0]], 0, n), n);
+         fb->taken[next / 64] |= 1ULL << (next % 64);
+         fb->place[m[0]] = next;
+      }
+   }
+
+   return true;
+}
+
+static bool em_i_asa_fbucket(struct em_asa_fbuild_s *fb, const uint32_t *m,
+                             unsigned long size, unsigned long long *disp)
+{
+   /* Finds a displacement that puts every member of a bucket on a free slot.
+    * For each d0, members that would share a slot whatever d1 is rule it out
+    * up front; otherwise every d1 is tried in turn. */
+
+   unsigned long n = fb->n;
+   unsigned long slots[EM_ASA_FROZEN_MAXB];
+
+   for (unsigned long long d0 = 0; d0 < EM_ASA_FROZEN_D0; d0++) {
+      bool clash = false;
+
+      for (unsigned long j = 0; j < size && !clash; j++) {
+         slots[j] = em_i_asa_fbase(fb->hash[m[j]], d0, n);
+
+         for (unsigned long i = 0; i < j; i++)
+            clash |= slots[i] == slots[j];
+      }
+
+      if (clash)
+         continue;
+
+      for (unsigned long d1 = 0; d1 < n; d1++) {
+         unsigned long j;
+
+         for (j = 0; j < size; j++) {
+            unsigned long s = I_FWRAP(slots[j] + d1, n);
+
+            if (fb->taken[s / 64] >> (s % 64) & 1)
+               break;
+         }
+
+         if (j < size)
+            continue;
+
+         for (j = 0; j < size; j++) {
+            unsigned long s = I_FWRAP(slots[j] + d1, n);
+
+            fb->taken[s / 64] |= 1ULL << (s % 64);
+            fb->place[m[j]] = s;
+         }
+
+         *disp = d0 << 32 | d1;
+         return true;
+      }
+   }
+
+   return false;
+}
+
+static em_status_t em_i_asa_splace(void **a, struct em_asa_slab_s *slab,
+                                   const em_asa_id_t *id, const void *value,
+                                   unsigned int meta)
+{
+   /* Puts an id that is known not to be in the slab into the first empty or
+    * deleted slot along its group sequence (or hands it to em_i_asa_rhplace
+    * on Robin Hood slabs). Grow keeps the table below its max load, so a free
+    * slot is always reachable. */
+
+   I_PREPHDR;
+
+   unsigned long group = I_HOMEGRP(id->probe, slab->tier);
+   unsigned long searches = 0, probe;
+   unsigned int free_slots;
+   em_asa_id_t stored = *id;
+
+   /* Long exact keys get their bytes copied into this slab's arena first, so
+    * nothing has changed yet if that fails */
+   if (I_ISEXACT(id)) {
+      if (!(stored.usect.xsect.key = em_i_asa_keycopy(
+               header, slab, id->usect.xsect.key, id->usect.xsect.len)))
+         return EM_OUT_OF_MEMORY;
+   }
+
+   if (slab->dist)
+      return em_i_asa_rhplace(a, slab, &stored, value, meta);
+
+   for (;;) {
+      unsigned long base = group << EM_ASA_GRP_LOG2;
+
+      em_status_t stat = em_i_asa_ensurei(a, slab, base + EM_ASA_GROUP - 1);
+      if (stat != EM_STATUS_OKAY)
+         return stat;
+
+      if ((free_slots = em_i_asa_gfree(slab->ctrl + base))) {
+         probe = base + __builtin_ctz(free_slots);
+         break;
+      }
+
+      searches++;
+      group = I_PROBEGC(group, slab->tier);
+   }
+
+   I_KEEP(slab, probe, probe);
+
+   if (slab->ctrl[probe] == CT_DELETE)
+      slab->ld_elements--;
+
+   slab->ctrl[probe] = I_CTRLTAG(id->probe);
+   slab->ids[probe] = stored;
+   if (slab->meta)
+      slab->meta[probe] = meta;
+
+   em_i_asa_pfadd(header, slab, id->probe);
+
+   memcpy(I_VALP(slab, probe), value, header->element_size);
+
+   if (searches > slab->ddepth)
+      slab->ddepth = searches;
+
+   return EM_STATUS_OKAY;
+}
+
+static em_status_t em_i_asa_rhplace(void **a, struct em_asa_slab_s *slab,
+                                    const em_asa_id_t *id, const void *value,
+                                    unsigned int meta)
+{
+   /* Robin Hood placement. Walking the id's group sequence, whenever a full
+    * group holds an element that sits closer to its home group than the one
+    * being placed would, the two trade places and the displaced element
+    * carries on from the next group along. Every group a probe passes through
+    * is then full of elements at least as far from home as the probe is,
+    * which is what lets em_i_asa_sprobe give up on a miss early.
+    *
+    * The walk is done twice: once without touching anything, to find out how
+    * far it goes and allocate everything it needs, so that the second one,
+    * which moves elements around, can't fail half way through and lose one.
+    */
+
+   I_PREPHDR;
+
+   unsigned long home = I_HOMEGRP(id->probe, slab->tier);
+   unsigned long group = home, dist = 0, reach = 0;
+   bool displaces = false;
+
+   for (;; dist++, group = I_PROBEGC(group, slab->tier)) {
+      unsigned long base = group << EM_ASA_GRP_LOG2;
+
+      reach = __em_max(reach, base);
+      if (base > slab->highest_index || em_i_asa_gfree(slab->ctrl + base))
+         break;
+
+      unsigned char low = EM_ASA_RH_DEAD;
+      for (unsigned int x = 0; x < EM_ASA_GROUP; x++)
+         low = __em_min(low, slab->dist[base + x]);
+
+      if (low < __em_min(dist, (unsigned long)EM_ASA_RH_MAX)) {
+         displaces = true;
+         dist = low;
+      }
+   }
+
+   em_status_t stat = em_i_asa_ensurei(a, slab, reach + EM_ASA_GROUP - 1);
+   if (stat != EM_STATUS_OKAY)
+      return stat;
+
+   unsigned char sbuf[EM_ASA_RH_CARRY];
+   void *carry = sbuf;
+
+   if (displaces && header->element_size > sizeof(sbuf) &&
+       !(carry = em_i_asa_xalloc(header, header->element_size)))
+      return EM_OUT_OF_MEMORY;
+
+   em_i_asa_pfadd(header, slab, id->probe);
+
+   em_asa_id_t cid = *id;
+   const void *cval = value;
+
+   for (group = home, dist = 0;; dist++, group = I_PROBEGC(group, slab->tier)) {
+      unsigned long base = group << EM_ASA_GRP_LOG2;
+      unsigned int free_slots = em_i_asa_gfree(slab->ctrl + base);
+      unsigned long slot = base + (free_slots ? __builtin_ctz(free_slots) : 0);
+      unsigned char capped = __em_min(dist, (unsigned long)EM_ASA_RH_MAX);
+
+      if (!free_slots) {
+         for (unsigned int x = 1; x < EM_ASA_GROUP; x++)
+            if (slab->dist[base + x] < slab->dist[slot])
+               slot = base + x;
+
+         if (slab->dist[slot] >= capped)
+            continue;
+      }
+
+      slab->ddepth = __em_max(slab->ddepth, dist);
+      I_KEEP(slab, slot, slot);
+
+      if (free_slots) {
+         slab->ctrl[slot] = I_CTRLTAG(cid.probe);
+         slab->ids[slot] = cid;
+         slab->dist[slot] = capped;
+         if (slab->meta)
+            slab->meta[slot] = meta;
+         memcpy(I_VALP(slab, slot), cval, header->element_size);
+         break;
+      }
+
+      em_asa_id_t evicted = slab->ids[slot];
+      unsigned char edist = slab->dist[slot];
+
+      if (slab->meta) {
+         unsigned int emeta = slab->meta[slot];
+         slab->meta[slot] = meta;
+         meta = emeta;
+      }
+
+      if (cval == carry) {
+         em_i_asa_memswap(carry, I_VALP(slab, slot), header->element_size);
+      } else {
+         memcpy(carry, I_VALP(slab, slot), header->element_size);
+         memcpy(I_VALP(slab, slot), cval, header->element_size);
+         cval = carry;
+      }
+
+      slab->ctrl[slot] = I_CTRLTAG(cid.probe);
+      slab->ids[slot] = cid;
+      slab->dist[slot] = capped;
+
+      cid = evicted;
+      dist = edist;
+   }
+
+   if (carry != sbuf)
+      em_i_asa_xfree(header, carry);
+
+   return EM_STATUS_OKAY;
+}
+
+static void em_i_asa_rhshift(void **a, struct em_asa_slab_s *slab,
+                             unsigned long slot)
+{
+   /* Removes an element from a Robin Hood slab without a tombstone. If its
+    * group was full, probes may be running through it to later groups, so
+    * the furthest-from-home element of the next group along is moved back
+    * into the gap - still no closer to home than anything else probing past
+    * it - and the same goes for the gap that leaves, until a group that no
+    * probe runs through is reached.
+    */
+
+   I_PREPHDR;
+
+   unsigned long group = slot >> EM_ASA_GRP_LOG2;
+   bool full = !em_i_asa_gmatch(slab->ctrl + (group << EM_ASA_GRP_LOG2),
+                                CT_EMPTY);
+
+   I_KEEP(slab, slot, slot);
+   slab->ctrl[slot] = CT_EMPTY;
+   slab->dist[slot] = 0;
+
+   while (full) {
+      group = I_PROBEGC(group, slab->tier);
+
+      unsigned long base = group << EM_ASA_GRP_LOG2;
+      if (base > slab->highest_index)
+         break;
+
+      unsigned long far = 0, from = 0;
+
+      for (unsigned long x = base; x < base + EM_ASA_GROUP; x++) {
+         if (slab->ctrl[x] < 0)
+            continue;
+
+         unsigned long d = slab->dist[x] == EM_ASA_RH_MAX ?
+                              em_i_asa_rhdist(header, slab, x) :
+                              slab->dist[x];
+         if (d > far) {
+            far = d;
+            from = x;
+         }
+      }
+
+      /* Nothing here got here by way of the gap */
+      if (!far)
+         break;
+
+      full = !em_i_asa_gmatch(slab->ctrl + base, CT_EMPTY);
+
+      I_KEEP(slab, from, from);
+      slab->ctrl[slot] = slab->ctrl[from];
+      slab->ids[slot] = slab->ids[from];
+      slab->dist[slot] = __em_min(far - 1, (unsigned long)EM_ASA_RH_MAX);
+      if (slab->meta)
+         slab->meta[slot] = slab->meta[from];
+      memcpy(I_VALP(slab, slot), I_VALP(slab, from), header->element_size);
+
+      slab->ctrl[from] = CT_EMPTY;
+      slab->dist[from] = 0;
+      slot = from;
+   }
+}
+
+static unsigned long em_i_asa_rhdist(const struct em_asa_hdr_s *header,
+                                     const struct em_asa_slab_s *slab,
+                                     unsigned long slot)
+{
+   /* Works out a saturated distance the long way, by walking from home */
+
+   unsigned long group = I_HOMEGRP(slab->ids[slot].probe, slab->tier);
+   unsigned long dist = 0;
+
+   while (group != slot >> EM_ASA_GRP_LOG2 && dist <= slab->ddepth) {
+      group = I_PROBEGC(group, slab->tier);
+      dist++;
+   }
+
+   return dist;
+}
+
+static inline void em_i_asa_memswap(void *a, void *b, size_t n)
+{
+   unsigned char tmp[64];
+
+   for (size_t off = 0; off < n; off += sizeof(tmp)) {
+      size_t amt = __em_min(n - off, sizeof(tmp));
+
+      memcpy(tmp, (char *)a + off, amt);
+      memcpy((char *)a + off, (char *)b + off, amt);
+      memcpy((char *)b + off, tmp, amt);
+   }
+}
+
+static inline bool em_i_asa_keyeq(const struct em_asa_hdr_s *header,
+                                  const em_asa_id_t *a, const em_asa_id_t *b)
+{
+   /* Ids of long exact keys point at their key bytes instead of holding them,
+    * so those have to be followed. The hash bits are compared first, and
+    * almost always settle it. */
+
+   if (!I_ISEXACT(a) || !I_ISEXACT(b))
+      return I_KEYICMP(a, b);
+
+   return a->probe == b->probe &&
+          a->usect.xsect.high64 == b->usect.xsect.high64 &&
+          a->usect.xsect.len == b->usect.xsect.len &&
+          (a->usect.xsect.key == b->usect.xsect.key ||
+           memcmp(a->usect.xsect.key, b->usect.xsect.key,
+                  a->usect.xsect.len) == 0);
+}
+
+static const char *em_i_asa_keycopy(struct em_asa_hdr_s *header,
+                                    struct em_asa_slab_s *slab,
+                                    const char *key, size_t len)
+{
+   /* Appends a key to the slab's arena, starting a new chunk if it doesn't
+    * fit in the current one. Keys bigger than a chunk get one to themselves.
+    */
+
+   struct em_asa_kchunk_s *chunk = slab->keys;
+
+   if (!chunk || chunk->size - chunk->used < len) {
+      size_t size = __em_max((size_t)EM_ASA_KCHUNK, len);
+
+      if (!(chunk = em_i_asa_xalloc(header, sizeof(*chunk) + size)))
+         return NULL;
+
+      chunk->next = slab->keys;
+      chunk->used = 0;
+      chunk->size = size;
+      slab->keys = chunk;
+   }
+
+   char *stored = chunk->data + chunk->used;
+   memcpy(stored, key, len);
+
+   chunk->used += len;
+   slab->keys_live += len;
+
+   return stored;
+}
+
+static long em_i_asa_inext(const struct em_asa_hdr_s *header, unsigned long x,
+                           unsigned long end)
+{
+   /* Returns the first element's index from x on and below end, or -1,
+    * carrying on from the current slab into the old one */
+
+   unsigned long span = em_i_asa_span(header);
+   long s;
+
+   if (x < span &&
+       (s = em_i_asa_snext(&header->cur, x, __em_min(end, span))) >= 0)
+      return s;
+
+   if (!header->old.ctrl || end <= span)
+      return -1;
+
+   s = em_i_asa_snext(&header->old, __em_max(x, span) - span, end - span);
+
+   return s < 0 ? -1 : s + (long)span;
+}
+
+static long em_i_asa_snext(const struct em_asa_slab_s *slab, unsigned long x,
+                           unsigned long end)
+{
+   /* Returns the first occupied slot of the slab from x on and below end, or
+    * -1. Whole groups are taken in with a single load of their control
+    * bytes; only a ragged end, which frozen slabs have, is gone over a slot
+    * at a time. */
+
+   if (!slab->ctrl)
+      return -1;
+
+   end = __em_min(end, slab->highest_index + 1);
+
+   while (x < end) {
+      unsigned long base = x & ~(unsigned long)(EM_ASA_GROUP - 1);
+
+      if (base + EM_ASA_GROUP > slab->highest_index + 1) {
+         if (slab->ctrl[x] >= 0)
+            return x;
+         x++;
+         continue;
+      }
+
+      unsigned int m = ~em_i_asa_gfree(slab->ctrl + base) & 0xFFFF &
+                       0xFFFF << (x - base);
+
+      if (m) {
+         unsigned long s = base + __builtin_ctz(m);
+         return s < end ? (long)s : -1;
+      }
+
+      x = base + EM_ASA_GROUP;
+   }
+
+   return -1;
+}
+
+static inline unsigned em_i_asa_gmatch(const signed char *g, signed char c)
+{
+   /* Returns a bitmask of the slots in the group whose control byte is c */
+
+#ifdef __SSE2__
+   return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(
+      _mm_loadu_si128((const __m128i *)g), _mm_set1_epi8(c)));
+#else
+   unsigned int m = 0;
+
+   for (unsigned int x = 0; x < EM_ASA_GROUP; x++)
+      m |= (unsigned int)(g[x] == c) << x;
+
+   return m;
+#endif
+}
+
+static inline unsigned em_i_asa_gfree(const signed char *g)
+{
+   /* Returns a bitmask of the empty or deleted slots in the group */
+
+#ifdef __SSE2__
+   return (unsigned)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)g));
+#else
+   unsigned int m = 0;
+
+   for (unsigned int x = 0; x < EM_ASA_GROUP; x++)
+      m |= (unsigned int)(g[x] < 0) << x;
+
+   return m;
+#endif
+}
+
+static inline unsigned em_i_asa_gbelow(const unsigned char *g,
+                                       unsigned char d)
+{
+   /* Returns a bitmask of the slots in the group whose distance is below d */
+
+#ifdef __SSE2__
+   __m128i v = _mm_loadu_si128((const __m128i *)g);
+
+   return ~(unsigned)_mm_movemask_epi8(
+             _mm_cmpeq_epi8(_mm_max_epu8(v, _mm_set1_epi8((char)d)), v)) &
+          0xFFFF;
+#else
+   unsigned int m = 0;
+
+   for (unsigned int x = 0; x < EM_ASA_GROUP; x++)
+      m |= (unsigned int)(g[x] < d) << x;
+
+   return m;
+#endif
+}
+
+static unsigned char em_i_asa_fittier(const struct em_asa_hdr_s *header,
+                                      unsigned long elements)
+{
+   /* Smallest tier that holds this many elements without needing to grow */
+
+   unsigned char tier = EM_ASA_MIN_TIER;
+
+   while (tier < EM_ASA_MAX_TIER && elements > I_MAXLOAD(tier))
+      tier++;
+
+   return tier;
+}
+
+static em_status_t em_i_asa_slabmk(struct em_asa_hdr_s *header,
+                                   struct em_asa_slab_s *slab,
+                                   unsigned char tier)
+{
+   /* The control bytes live apart from the slots, so that a probe only has to
+    * pull in one small, dense line to rule out a whole group. Storage starts
+    * at a single group and is extended by em_i_asa_ensurei. */
+
+   *slab = (struct em_asa_slab_s){ .tier = tier,
+                                   .highest_index = EM_ASA_GROUP - 1 };
+
+   slab->ctrl = em_i_asa_salloc(header, EM_ASA_GROUP);
+   slab->ids = em_i_asa_salloc(header, EM_ASA_GROUP * EM_ASA_ID_SZ);
+   slab->vals = em_i_asa_salloc(header, EM_ASA_GROUP * header->element_size);
+   if (!slab->ctrl || !slab->ids || !slab->vals)
+      return EM_OUT_OF_MEMORY;
+   memset(slab->ctrl, CT_EMPTY, EM_ASA_GROUP);
+   memset(slab->ids, 0, EM_ASA_GROUP * EM_ASA_ID_SZ);
+   memset(slab->vals, 0, EM_ASA_GROUP * header->element_size);
+
+   if (I_ISRH) {
+      if (!(slab->dist = em_i_asa_salloc(header, EM_ASA_GROUP)))
+         return EM_OUT_OF_MEMORY;
+      memset(slab->dist, 0, EM_ASA_GROUP);
+   }
+
+   if (I_ISCACHE) {
+      if (!(slab->meta = em_i_asa_salloc(header,
+                                         EM_ASA_GROUP * sizeof(*slab->meta))))
+         return EM_OUT_OF_MEMORY;
+      memset(slab->meta, 0, EM_ASA_GROUP * sizeof(*slab->meta));
+   }
+
+   return EM_STATUS_OKAY;
+}
+
+static em_status_t em_i_asa_ensurei(void **a, struct em_asa_slab_s *slab,
+                                    unsigned long high_as)
+{
+   /* Very lackluster memory saving technique - only allocate up to the highest
+    * occupied index in the slab's arrays. The arrays are at least doubled
+    * each time though, since random keys push the highest index up on most
+    * inserts early on, and resizing to fit each of those copies the slab over
+    * and over.
+    */
+
+   I_PREPHDR;
+
+   size_t ohil = (size_t)slab->highest_index + 1;
+   size_t nhil = (size_t)high_as + 1;
+
+   if (nhil <= ohil)
+      return EM_STATUS_OKAY;
+
+   nhil = __em_min((size_t)I_TIERCLM(slab->tier) + 1, __em_max(nhil, ohil * 2));
+   high_as = nhil - 1;
+
+   signed char *nctrl = em_i_asa_sresize(header, slab->ctrl, ohil, nhil);
+   if (!nctrl)
+      return EM_OUT_OF_MEMORY;
+   slab->ctrl = nctrl;
+
+   em_asa_id_t *nids = em_i_asa_sresize(header, slab->ids, ohil * EM_ASA_ID_SZ,
+                                        nhil * EM_ASA_ID_SZ);
+   if (!nids)
+      return EM_OUT_OF_MEMORY;
+   slab->ids = nids;
+
+   void *nvals = em_i_asa_sresize(header, slab->vals,
+                                  ohil * header->element_size,
+                                  nhil * header->element_size);
+   if (!nvals)
+      return EM_OUT_OF_MEMORY;
+   slab->vals = nvals;
+
+   if (slab->dist) {
+      unsigned char *ndist = em_i_asa_sresize(header, slab->dist, ohil, nhil);
+      if (!ndist)
+         return EM_OUT_OF_MEMORY;
+      slab->dist = ndist;
+      memset(ndist + ohil, 0, nhil - ohil);
+   }
+
+   if (slab->meta) {
+      unsigned int *nmeta =
+         em_i_asa_sresize(header, slab->meta, ohil * sizeof(*nmeta),
+                          nhil * sizeof(*nmeta));
+      if (!nmeta)
+         return EM_OUT_OF_MEMORY;
+      slab->meta = nmeta;
+      memset(nmeta + ohil, 0, (nhil - ohil) * sizeof(*nmeta));
+   }
+
+   /* Only commit the new size once every array has been resized */
+   slab->highest_index = high_as;
+
+   em_i_asa_hugepages(slab->ctrl, nhil);
+   em_i_asa_hugepages(slab->ids, nhil * EM_ASA_ID_SZ);
+   em_i_asa_hugepages(slab->vals, nhil * header->element_size);
+
+   memset(nctrl + ohil, CT_EMPTY, nhil - ohil);
+   memset(nids + ohil, 0, (nhil - ohil) * EM_ASA_ID_SZ);
+   memset((char *)nvals + ohil * header->element_size, 0,
+          (nhil - ohil) * header->element_size);
+
+   return EM_STATUS_OKAY;
+}
+
+static void em_i_asa_hugepages(void *ptr, size_t size)
+{
+   /* Asks for a big slab array to be backed by transparent huge pages, as
+    * probes land all over it and would otherwise miss the TLB nearly every
+    * time. Arrays this size come straight from mmap in glibc's malloc, and
+    * growing them is an mremap, so they stay in one block without their
+    * pages being copied. Only the whole huge pages inside the array are
+    * marked; the hint is simply ignored where it isn't supported. */
+
+#ifdef MADV_HUGEPAGE
+   if (size < EM_ASA_HUGE_MIN)
+      return;
+
+   uintptr_t from = ((uintptr_t)ptr + EM_ASA_HUGE_PAGE - 1) &
+                    ~(uintptr_t)(EM_ASA_HUGE_PAGE - 1);
+   uintptr_t to = ((uintptr_t)ptr + size) & ~(uintptr_t)(EM_ASA_HUGE_PAGE - 1);
+
+   if (to > from)
+      madvise((void *)from, to - from, MADV_HUGEPAGE);
+#else
+   (void)ptr;
+   (void)size;
+#endif
+}
+
+static void em_i_asa_freeslab(struct em_asa_hdr_s *header,
+                              struct em_asa_slab_s *slab)
+{
+   em_i_asa_sfree(header, slab->ctrl);
+   em_i_asa_sfree(header, slab->ids);
+   em_i_asa_sfree(header, slab->vals);
+   em_i_asa_sfree(header, slab->dist);
+   em_i_asa_sfree(header, slab->meta);
+   em_i_asa_xfree(header, slab->bloom.filter);
+   em_i_asa_xfree(header, slab->cuckoo.table);
+
+   while (slab->keys) {
+      struct em_asa_kchunk_s *next = slab->keys->next;
+      em_i_asa_xfree(header, slab->keys);
+      slab->keys = next;
+   }
+
+   *slab = (struct em_asa_slab_s){ 0 };
+}
+
+static void em_i_asa_filtermk(struct em_asa_hdr_s *header,
+                              struct em_asa_slab_s *slab, bool had)
+{
+   /* Gives a freshly made, still empty slab a prefilter sized for its tier,
+    * built from bits already in each id rather than a second hash of it:
+    * a blocked bloom filter, which costs a lookup one more cache line
+    * whatever its k, or a cuckoo filter with EM_ASA_CUCKOO_FILTER.
+    *
+    * Whether it gets one is up to em_i_asa_pfwanted, had being whether the
+    * slab it takes over from has one, and em_i_asa_filterck looks at that
+    * again as lookups go on.
+    */
+
+   em_i_asa_pfdrop(header, slab);
+
+   if (em_i_asa_pfwanted(header, slab->tier, had))
+      em_i_asa_pfmk(header, slab);
+}
+
+static void em_i_asa_filterck(struct em_asa_hdr_s *header)
+{
+   /* Weighs the current slab's prefilter up again every EM_ASA_BLOOM_SAMPLE / 2
+    * lookups, once there have been EM_ASA_BLOOM_SAMPLE: it's dropped if it no
+    * longer pays, and a slab without one that would now be better off with
+    * one gets it, filled by a pass over its ids. That covers slabs made before
+    * there were lookups to go by, as in reserved or bulk-loaded tables. The
+    * lookup counts are halved each time, so the choice follows what the table
+    * has been used for lately. Frozen slabs are left as they are.
+    */
+
+   struct em_asa_slab_s *slab = &header->cur;
+   bool wanted = em_i_asa_pfwanted(header, slab->tier, I_PFHAS(slab));
+
+   header->lookups >>= 1;
+   header->misses >>= 1;
+
+   if (header->frozen)
+      return;
+
+   if (I_PFHAS(slab) && !wanted) {
+      em_i_asa_pfdrop(header, slab);
+   } else if (!I_PFHAS(slab) && wanted) {
+      em_i_asa_pfmk(header, slab);
+
+      for (unsigned long x = 0; I_PFHAS(slab) && x <= slab->highest_index; x++)
+         if (slab->ctrl[x] >= 0)
+            em_i_asa_pfadd(header, slab, slab->ids[x].probe);
+   }
+}
+
+static bool em_i_asa_pfwanted(const struct em_asa_hdr_s *header,
+                              unsigned char tier, bool had)
+{
+   /* The control bytes already turn most misses away after a single load, so
+    * a filter only earns its extra loads on big slabs of a table that is
+    * mostly asked for keys it doesn't have: one is made once three lookups in
+    * four miss, and kept until fewer than half do. The gap keeps a table that
+    * sits near either from making and dropping filters over and over. */
+
+   if (tier < EM_ASA_BLOOM_MIN_TIER)
+      return false;
+   if (had)
+      return header->misses * 2 >= header->lookups;
+
+   return header->lookups >= EM_ASA_BLOOM_SAMPLE / 2 &&
+          header->misses * 4 >= header->lookups * 3;
+}
+
+static void em_i_asa_pfmk(struct em_asa_hdr_s *header,
+                          struct em_asa_slab_s *slab)
+{
+   /* An empty prefilter sized for the slab's tier. One that can't be
+    * allocated is simply left out. */
+
+   size_t bytes = ((size_t)I_TIERCLM(slab->tier) + 1) / 2;
+
+   if (header->flags & EM_ASA_CUCKOO_FILTER) {
+      if (em_cuckoo_mka(&slab->cuckoo, I_MAXLOAD(slab->tier), 8, header->mi) !=
+          EM_STATUS_OKAY)
+         slab->cuckoo = (em_cuckoo_t){ 0 };
+   } else if (em_bloom_mkba(&slab->bloom, bytes, EM_ASA_BLOOM_K,
+                           header->mi) != EM_STATUS_OKAY) {
+      slab->bloom = (em_bloom_t){ 0 };
+   }
+}
+
+static void em_i_asa_pfdrop(struct em_asa_hdr_s *header,
+                            struct em_asa_slab_s *slab)
+{
+   em_i_asa_xfree(header, slab->bloom.filter);
+   em_i_asa_xfree(header, slab->cuckoo.table);
+   slab->bloom = (em_bloom_t){ 0 };
+   slab->cuckoo = (em_cuckoo_t){ 0 };
+}
+
+static inline bool em_i_asa_pfin(const struct em_asa_slab_s *slab,
+                                 unsigned long long probe)
+{
+   /* Whether the slab's prefilter lets the probe hash through, true if there
+    * is no prefilter. A cuckoo filter takes the probe hash as it is: the
+    * bucket comes from its low bits and the fingerprint from its top ones,
+    * which are kept clear of the home group and control tag. */
+
+   if (slab->bloom.filter)
+      return em_bloom_inh(&slab->bloom, I_BLOOMH(probe));
+   if (slab->cuckoo.table)
+      return em_cuckoo_inh(&slab->cuckoo, probe);
+
+   return true;
+}
+
+static inline void em_i_asa_pfprefetch(const struct em_asa_slab_s *slab,
+                                       unsigned long long probe)
+{
+   if (slab->bloom.filter)
+      em_bloom_prefetch(&slab->bloom, I_BLOOMH(probe));
+   else if (slab->cuckoo.table)
+      em_cuckoo_prefetch(&slab->cuckoo, probe);
+}
+
+static void em_i_asa_pfadd(struct em_asa_hdr_s *header,
+                           struct em_asa_slab_s *slab,
+                           unsigned long long probe)
+{
+   /* A cuckoo filter is sized for the slab's max load and shouldn't ever
+    * fill up, but if it does, it's dropped rather than left to turn away ids
+    * that are in the slab. */
+
+   if (slab->bloom.filter)
+      em_bloom_addh(&slab->bloom, I_BLOOMH(probe));
+
+   if (slab->cuckoo.table &&
+       em_cuckoo_addh(&slab->cuckoo, probe) != EM_STATUS_OKAY) {
+      em_i_asa_xfree(header, slab->cuckoo.table);
+      slab->cuckoo = (em_cuckoo_t){ 0 };
+   }
+}
+
+static em_status_t em_i_asa_imgprep(void **a)
+{
+   /* Gets a table ready to be written as an image, if it can be, see
+    * em_i_asa_save */
+
+   I_PREPHDR;
+
+   if (header->flags & EM_ASA_EXACT_KEYS || header->frozen || I_ISCACHE)
+      return EM_INVALID_TYPE;
+
+   return em_i_asa_migrate(a, ~0UL);
+}
+
+static em_status_t em_i_asa_imgput(void **a, FILE *f)
+{
+   /* Writes the image of a table em_i_asa_imgprep has readied */
+
+   I_PREPHDR;
+
+   const struct em_asa_slab_s *slab = &header->cur;
+   uint64_t slots = (uint64_t)slab->highest_index + 1;
+
+   struct em_asa_image_s img = {
+      .magic = EM_ASA_IMG_MAGIC,
+      .version = EM_ASA_IMG_VERSION,
+      .byte_order = EM_ASA_IMG_ORDER,
+      .header_size = sizeof(img),
+      .id_size = EM_ASA_ID_SZ,
+      .element_size = header->element_size,
+      .elements = header->elements,
+      .seed = header->seed,
+      .hash = header->hash,
+      .flags = header->flags & ~EM_ASA_SNAPSHOTS,
+      .reserved = header->reserved,
+      .tier = slab->tier,
+      .highest_index = slab->highest_index,
+      .ld_elements = slab->ld_elements,
+      .ddepth = slab->ddepth,
+      .bloom_bytes = slab->bloom.filter ? slab->bloom.bytes : 0,
+      .bloom_hashes = slab->bloom.hashes,
+      .bloom_seed = slab->bloom.seed,
+      .bloom_blocks = slab->bloom.blocks,
+   };
+
+   uint64_t dist_bytes = slab->dist ? slots : 0;
+
+   img.ctrl_off = I_IMGALIGN(sizeof(img));
+   img.ids_off = I_IMGALIGN(img.ctrl_off + slots);
+   img.vals_off = I_IMGALIGN(img.ids_off + slots * EM_ASA_ID_SZ);
+   img.dist_off = I_IMGALIGN(img.vals_off + slots * img.element_size);
+   img.bloom_off = I_IMGALIGN(img.dist_off + dist_bytes);
+   img.size = img.bloom_off + img.bloom_bytes;
+
+   const void *const sect[EM_ASA_IMG_SECTS] = {
+      slab->ctrl, slab->ids, slab->vals, slab->dist,
+      slab->bloom.filter ? slab->bloom.filter + slab->bloom.offset : NULL
+   };
+   uint64_t offs[EM_ASA_IMG_SECTS], lens[EM_ASA_IMG_SECTS];
+   em_i_asa_imgsects(&img, offs, lens);
+
+   img.payload_sum = em_i_asa_imgsum(&img, sect);
+   img.header_sum = XXH3_64bits(&img, sizeof(img));
+
+   static const char zeros[EM_ASA_IMG_ALIGN];
+   bool ok = fwrite(&img, sizeof(img), 1, f) == 1;
+   uint64_t at = sizeof(img);
+
+   for (unsigned int x = 0; ok && x < EM_ASA_IMG_SECTS; x++) {
+      ok = fwrite(zeros, 1, offs[x] - at, f) == offs[x] - at &&
+           (!lens[x] || fwrite(sect[x], lens[x], 1, f) == 1);
+      at = offs[x] + lens[x];
+   }
+
+   return ok ? EM_STATUS_OKAY : EM_IO_FAILURE;
+}
+
+static em_status_t em_i_asa_mapfd(void **a, size_t el_size, int fd,
+                                  unsigned int flags)
+{
+   /* em_i_asa_map, for an image that's already open. fd is closed. */
+
+   struct stat st;
+   if (fstat(fd, &st) != 0) {
+      close(fd);
+      return EM_IO_FAILURE;
+   }
+
+   size_t len = st.st_size;
+   if (len < sizeof(struct em_asa_image_s)) {
+      close(fd);
+      return EM_BAD_IMAGE;
+   }
+
+   void *map = mmap(NULL, len,
+                    PROT_READ | (flags & EM_ASA_MAP_WRITABLE ? PROT_WRITE : 0),
+                    MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED)
+      return EM_IO_FAILURE;
+
+   const struct em_asa_image_s *img = map;
+   if (!em_i_asa_imgok(img, len, el_size, flags & EM_ASA_MAP_VERIFY)) {
+      munmap(map, len);
+      return EM_BAD_IMAGE;
+   }
+
+   /* Probes land all over the slab, readahead would mostly be wasted */
+   madvise(map, len, MADV_RANDOM);
+
+   struct em_asa_hdr_s *header = malloc(EM_ASA_HR_SZ);
+   if (!header) {
+      munmap(map, len);
+      return EM_OUT_OF_MEMORY;
+   }
+   memcpy(header, &em_asa_defhr, EM_ASA_HR_SZ);
+
+   header->mi = EM_GLOBAL_ALLOC;
+   header->element_size = el_size;
+   header->elements = img->elements;
+   header->seed = img->seed;
+   header->hash = img->hash;
+   header->flags = img->flags;
+   header->reserved = img->reserved;
+
+   header->cur.tier = img->tier;
+   header->cur.highest_index = img->highest_index;
+   header->cur.ld_elements = img->ld_elements;
+   header->cur.ddepth = img->ddepth;
+   header->cur.ctrl = (signed char *)map + img->ctrl_off;
+   header->cur.ids = (em_asa_id_t *)((char *)map + img->ids_off);
+   header->cur.vals = (char *)map + img->vals_off;
+   if (img->flags & EM_ASA_ROBIN_HOOD)
+      header->cur.dist = (unsigned char *)map + img->dist_off;
+
+   if (img->bloom_bytes)
+      header->cur.bloom = (em_bloom_t){ .bytes = img->bloom_bytes,
+                                        .capacity = img->bloom_bytes * 8,
+                                        .hashes = img->bloom_hashes,
+                                        .filter = (char *)map + img->bloom_off,
+                                        .seed = img->bloom_seed,
+                                        .blocks = img->bloom_blocks,
+                                        .mi = header->mi };
+
+   header->map = map;
+   header->map_len = len;
+   header->map_rdonly = !(flags & EM_ASA_MAP_WRITABLE);
+
+   *a = header;
+
+   return EM_STATUS_OKAY;
+}
+
+static em_status_t em_i_asa_shmctl(const char *name, bool create,
+                                   struct em_asa_shm_s **out)
+{
+   /* Maps the control object of a published table, read-only unless it's
+    * for em_i_asa_publish, which makes it if there isn't one yet */
+
+   int fd = shm_open(name, create ? O_RDWR | O_CREAT : O_RDONLY, 0600);
+   if (fd < 0)
+      return EM_IO_FAILURE;
+
+   struct stat st;
+   if (fstat(fd, &st) != 0 ||
+       (create && !st.st_size && ftruncate(fd, sizeof(**out)) != 0)) {
+      close(fd);
+      return EM_IO_FAILURE;
+   }
+
+   if (st.st_size && (size_t)st.st_size < sizeof(**out)) {
+      close(fd);
+      return EM_BAD_IMAGE;
+   }
+
+   struct em_asa_shm_s *ctl =
+      mmap(NULL, sizeof(*ctl), PROT_READ | (create ? PROT_WRITE : 0),
+           MAP_SHARED, fd, 0);
+   close(fd);
+   if (ctl == MAP_FAILED)
+      return EM_IO_FAILURE;
+
+   /* Readers can get in between the publisher making the object and writing
+    * the magic in, but then they find no generation either. The same goes
+    * for a publisher that died in between. */
+   if (!__atomic_load_n(&ctl->generation, __ATOMIC_ACQUIRE)) {
+      if (!create) {
+         munmap(ctl, sizeof(*ctl));
+         return EM_IO_FAILURE;
+      }
+
+      memcpy(ctl->magic, EM_ASA_SHM_MAGIC, sizeof(ctl->magic));
+   }
+
+   if (memcmp(ctl->magic, EM_ASA_SHM_MAGIC, sizeof(ctl->magic)) != 0) {
+      munmap(ctl, sizeof(*ctl));
+      return EM_BAD_IMAGE;
+   }
+
+   *out = ctl;
+
+   return EM_STATUS_OKAY;
+}
+
+static bool em_i_asa_shmname(char *out, const char *name,
+                             unsigned long long gen)
+{
+   int len = snprintf(out, EM_ASA_SHM_NAME, "%s.%llu", name, gen);
+
+   return len > 0 && len < EM_ASA_SHM_NAME;
+}
+
+static void em_i_asa_imgsects(const struct em_asa_image_s *img,
+                              uint64_t offs[EM_ASA_IMG_SECTS],
+                              uint64_t lens[EM_ASA_IMG_SECTS])
+{
+   /* Where each section of an image is meant to be, and how long it is */
+
+   uint64_t slots = img->highest_index + 1;
+
+   offs[0] = img->ctrl_off;
+   lens[0] = slots;
+   offs[1] = img->ids_off;
+   lens[1] = slots * img->id_size;
+   offs[2] = img->vals_off;
+   lens[2] = slots * img->element_size;
+   offs[3] = img->dist_off;
+   lens[3] = img->flags & EM_ASA_ROBIN_HOOD ? slots : 0;
+   offs[4] = img->bloom_off;
+   lens[4] = img->bloom_bytes;
+}
+
+static uint64_t em_i_asa_imgsum(const struct em_asa_image_s *img,
+                                const void *const sect[EM_ASA_IMG_SECTS])
+{
+   /* Checksums an image's sections, given where each of them is right now */
+
+   uint64_t offs[EM_ASA_IMG_SECTS], lens[EM_ASA_IMG_SECTS];
+   em_i_asa_imgsects(img, offs, lens);
+
+   XXH3_state_t state;
+   XXH3_64bits_reset(&state);
+
+   for (unsigned int x = 0; x < EM_ASA_IMG_SECTS; x++)
+      if (lens[x])
+         XXH3_64bits_update(&state, sect[x], lens[x]);
+
+   return XXH3_64bits_digest(&state);
+}
+
+static bool em_i_asa_imgok(const struct em_asa_image_s *img, size_t len,
+                           size_t el_size, bool verify)
+{
+   /* Everything em_i_asa_map is about to trust is checked here: that the
+    * header is intact and from a compatible build, and that the slab it
+    * describes is well formed and lies entirely within the image. */
+
+   struct em_asa_image_s hdr = *img;
+   hdr.header_sum = 0;
+
+   if (memcmp(img->magic, EM_ASA_IMG_MAGIC, sizeof(img->magic)) != 0 ||
+       img->version != EM_ASA_IMG_VERSION ||
+       img->byte_order != EM_ASA_IMG_ORDER ||
+       img->header_size != sizeof(*img) || img->id_size != EM_ASA_ID_SZ ||
+       XXH3_64bits(&hdr, sizeof(hdr)) != img->header_sum)
+      return false;
+
+   if (img->element_size != el_size || img->size != len ||
+       img->flags & ~(uint64_t)(EM_ASA_ROBIN_HOOD | EM_ASA_CUCKOO_FILTER) ||
+       img->hash > EM_ASA_HASH_CRC32C)
+      return false;
+
+   /* Would be hashed with an instruction this machine doesn't have */
+#ifdef EM_ASA_HAVE_CRC32C
+   if (img->hash == EM_ASA_HASH_CRC32C && !__builtin_cpu_supports("sse4.2"))
+      return false;
+#else
+   if (img->hash == EM_ASA_HASH_CRC32C)
+      return false;
+#endif
+
+   if (img->tier < EM_ASA_MIN_TIER || img->tier > EM_ASA_MAX_TIER ||
+       img->highest_index > I_TIERCLM(img->tier) ||
+       (img->highest_index + 1) % EM_ASA_GROUP != 0 ||
+       img->elements > img->highest_index + 1)
+      return false;
+
+   if (img->bloom_bytes &&
+       (!img->bloom_hashes ||
+        (img->bloom_blocks &&
+         (img->bloom_blocks & (img->bloom_blocks - 1) ||
+          img->bloom_bytes != img->bloom_blocks * EM_BLOOM_BLOCK))))
+      return false;
+
+   /* Sections have to be aligned, in order, and not overlap */
+   uint64_t offs[EM_ASA_IMG_SECTS], lens[EM_ASA_IMG_SECTS];
+   uint64_t end = sizeof(*img);
+   em_i_asa_imgsects(img, offs, lens);
+
+   for (unsigned int x = 0; x < EM_ASA_IMG_SECTS; x++) {
+      if (offs[x] % EM_ASA_IMG_ALIGN || offs[x] < end || offs[x] > len ||
+          lens[x] > len - offs[x])
+         return false;
+      end = offs[x] + lens[x];
+   }
+
+   if (verify) {
+      const char *base = (const char *)img;
+      const void *sect[EM_ASA_IMG_SECTS];
+
+      for (unsigned int x = 0; x < EM_ASA_IMG_SECTS; x++)
+         sect[x] = base + offs[x];
+
+      if (em_i_asa_imgsum(img, sect) != img->payload_sum)
+         return false;
+   }
+
+   return true;
+}
+
+static void em_i_asa_slabstats(const struct em_asa_hdr_s *header,
+                               const struct em_asa_slab_s *slab,
+                               struct em_asa_slab_stats_s *out,
+                               struct em_asa_stats_s *stats)
+{
+   /* Walks every allocated slot of the slab. Each live element has its probe
+    * sequence replayed from its home group until it reaches the element's
+    * own group, which is exactly how far a lookup for it has to go. */
+
+   *out = (struct em_asa_slab_stats_s){
+      .tier = slab->tier,
+      .capacity = I_TIERCLM(slab->tier) + 1,
+      .allocated = slab->highest_index + 1,
+   };
+
+   /* A frozen slab is exactly as big as it needs to be, and every element in
+    * it is found at the first try */
+   if (header->frozen)
+      out->capacity = out->allocated;
+
+   for (unsigned long x = 0; x <= slab->highest_index; x++) {
+      if (slab->ctrl[x] == CT_DELETE)
+         out->tombstones++;
+      if (slab->ctrl[x] < 0)
+         continue;
+
+      unsigned long group = I_HOMEGRP(slab->ids[x].probe, slab->tier);
+      unsigned long dist = 0;
+
+      while (!header->frozen && group != x >> EM_ASA_GRP_LOG2 &&
+             dist <= slab->ddepth) {
+         group = I_PROBEGC(group, slab->tier);
+         dist++;
+      }
+
+      out->live++;
+      out->max_probe = __em_max(out->max_probe, dist);
+      stats->probe_hist[__em_min(dist, (unsigned long)EM_ASA_STATS_HIST - 1)]++;
+      stats->probe_mean += dist + 1;
+   }
+
+   out->load = (double)(out->live + out->tombstones) / out->capacity;
+
+   if (!em_i_asa_mapped(header, slab->ctrl))
+      stats->bytes +=
+         out->allocated * (1 + EM_ASA_ID_SZ + header->element_size +
+                           (slab->dist ? 1 : 0) +
+                           (slab->meta ? sizeof(*slab->meta) : 0));
+   if (slab->bloom.filter && !em_i_asa_mapped(header, slab->bloom.filter))
+      stats->bytes += slab->bloom.bytes;
+   if (slab->cuckoo.table)
+      stats->bytes += em_cuckoo_bytes(&slab->cuckoo);
+   for (const struct em_asa_kchunk_s *k = slab->keys; k; k = k->next)
+      stats->bytes += sizeof(*k) + k->size;
+}
+
+static inline bool em_i_asa_mapped(const struct em_asa_hdr_s *header,
+                                   const void *ptr)
+{
+   return header->map && (const char *)ptr >= (const char *)header->map &&
+          (const char *)ptr < (const char *)header->map + header->map_len;
+}
+
+static void *em_i_asa_xalloc(struct em_asa_hdr_s *header, size_t size)
+{
+   return header->mi->realloc(header->mi->udata, NULL, size);
+}
+
+static void em_i_asa_xfree(struct em_asa_hdr_s *header, void *ptr)
+{
+   /* Tables shared with lock-free readers (see cassoca.c) hand memory to
+    * their retire hook instead, which frees it once no reader can still be
+    * looking at it. */
+
+   if (!ptr)
+      return;
+
+   /* Storage inside a mapped image goes away with the mapping */
+   if (em_i_asa_mapped(header, ptr))
+      return;
+
+   if (header->retire)
+      header->retire(header->retire_ctx, ptr);
+   else
+      header->mi->free(header->mi->udata, ptr);
+}
+
+static void *em_i_asa_xresize(struct em_asa_hdr_s *header, void *ptr,
+                              size_t old_size, size_t new_size)
+{
+   /* realloc(), unless the old block has to outlive the call or wasn't
+    * allocated by us in the first place (see above) */
+
+   if (!header->retire && !em_i_asa_mapped(header, ptr))
+      return header->mi->realloc(header->mi->udata, ptr, new_size);
+
+   void *fresh = em_i_asa_xalloc(header, new_size);
+   if (!fresh)
+      return NULL;
+
+   memcpy(fresh, ptr, __em_min(old_size, new_size));
+   em_i_asa_xfree(header, ptr);
+
+   return fresh;
+}
+
+static void *em_i_asa_salloc(struct em_asa_hdr_s *header, size_t size)
+{
+   /* Slab arrays of EM_ASA_SNAPSHOTS tables are shared anonymous mappings,
+    * which is what lets em_i_asa_viewmk map them a second time, with their
+    * length kept just ahead of them. Anything else is left to xalloc. */
+
+   if (!header->snaps)
+      return em_i_asa_xalloc(header, size);
+
+   size_t page = (size_t)sysconf(_SC_PAGESIZE);
+   size_t len = (EM_ASA_SNAP_PAD + size + page - 1) & ~(page - 1);
+
+   char *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+   if (p == MAP_FAILED)
+      return NULL;
+
+   memcpy(p, &len, sizeof(len));
+
+   return p + EM_ASA_SNAP_PAD;
+}
+
+static void em_i_asa_sfree(struct em_asa_hdr_s *header, void *ptr)
+{
+   /* Snapshots still mapping the array keep its pages, but stop following
+    * it, as the same address may well be handed out again */
+
+   if (!header->snaps) {
+      em_i_asa_xfree(header, ptr);
+      return;
+   }
+
+   if (!ptr)
+      return;
+
+   char *base = (char *)ptr - EM_ASA_SNAP_PAD;
+   size_t len;
+
+   memcpy(&len, base, sizeof(len));
+
+   pthread_mutex_lock(&header->snaps->lock);
+   for (struct em_asa_snap_s *sn = header->snaps->list; sn; sn = sn->next)
+      for (unsigned int r = 0; r < EM_ASA_SNAP_ARRAYS; r++)
+         if (sn->views[r].src == base)
+            sn->views[r].src = NULL;
+   pthread_mutex_unlock(&header->snaps->lock);
+
+   munmap(base, len);
+}
+
+static void *em_i_asa_sresize(struct em_asa_hdr_s *header, void *ptr,
+                              size_t old_size, size_t new_size)
+{
+   /* A shared array is never resized in place, so a snapshot of it never
+    * sees it change size under it */
+
+   if (!header->snaps)
+      return em_i_asa_xresize(header, ptr, old_size, new_size);
+
+   void *fresh = em_i_asa_salloc(header, new_size);
+   if (!fresh)
+      return NULL;
+
+   memcpy(fresh, ptr, __em_min(old_size, new_size));
+   em_i_asa_sfree(header, ptr);
+
+   return fresh;
+}
+
+static void *em_i_asa_viewmk(struct em_asa_hdr_s *header,
+                             struct em_asa_sview_s *v, const void *live)
+{
+   /* Maps the shared array at live a second time, read-only, for a snapshot.
+    * Returns where the array is in there, or NULL. */
+
+   if (!live)
+      return NULL;
+
+   char *src = (char *)live - EM_ASA_SNAP_PAD;
+   size_t len, chunk = EM_ASA_SNAP_CHUNK;
+
+   memcpy(&len, src, sizeof(len));
+
+   /* Every chunk copied out is a mapping of its own, and there's only so many
+    * of those to go round, so big arrays get bigger chunks instead */
+   while (len / chunk >= EM_ASA_SNAP_CHUNKS)
+      chunk <<= 1;
+
+   size_t words = (len / chunk + 64) / 64;
+   uint64_t *kept = em_i_asa_xalloc(header, words * sizeof(*kept));
+   if (!kept)
+      return NULL;
+   memset(kept, 0, words * sizeof(*kept));
+
+   char *view = mremap(src, 0, len, MREMAP_MAYMOVE);
+   if (view == MAP_FAILED) {
+      em_i_asa_xfree(header, kept);
+      return NULL;
+   }
+
+   if (mprotect(view, len, PROT_READ) != 0) {
+      munmap(view, len);
+      em_i_asa_xfree(header, kept);
+      return NULL;
+   }
+
+   *v = (struct em_asa_sview_s){
+      .src = src, .view = view, .len = len, .chunk = chunk, .kept = kept
+   };
+
+   return view + EM_ASA_SNAP_PAD;
+}
+
+static void em_i_asa_keep(struct em_asa_hdr_s *header,
+                          const struct em_asa_slab_s *slab, unsigned long lo,
+                          unsigned long hi)
+{
+   /* Comes before slots lo to hi of one of the table's slabs are written to.
+    * Any snapshot whose view of them still shares the table's pages is given
+    * its own copy of the chunks they're in first, see I_KEEP. */
+
+   struct em_asa_snaps_s *ss = header->snaps;
+   const void *arrays[EM_ASA_SNAP_ARRAYS] = { slab->ctrl, slab->ids,
+                                              slab->vals, slab->dist };
+   const size_t widths[EM_ASA_SNAP_ARRAYS] = { 1, EM_ASA_ID_SZ,
+                                               header->element_size, 1 };
+
+   pthread_mutex_lock(&ss->lock);
+
+   for (struct em_asa_snap_s *sn = ss->list; sn; sn = sn->next) {
+      for (unsigned int r = 0; r < EM_ASA_SNAP_ARRAYS && !sn->stale; r++) {
+         struct em_asa_sview_s *v = &sn->views[r];
+
+         if (!arrays[r] ||
+             v->src != (const char *)arrays[r] - EM_ASA_SNAP_PAD)
+            continue;
+
+         size_t from = (EM_ASA_SNAP_PAD + lo * widths[r]) / v->chunk;
+         size_t to = (EM_ASA_SNAP_PAD + (hi + 1) * widths[r] - 1) / v->chunk;
+
+         for (size_t k = from; k <= to; k++)
+            if (!(v->kept[k / 64] >> (k % 64) & 1) &&
+                !em_i_asa_keepchunk(v, k))
+               __atomic_store_n(&sn->stale, true, __ATOMIC_RELEASE);
+      }
+   }
+
+   pthread_mutex_unlock(&ss->lock);
+}
+
+static bool em_i_asa_keepchunk(struct em_asa_sview_s *v, size_t k)
+{
+   /* Swaps chunk k of a view for a private copy. The copy is made off to the
+    * side and then moved over the chunk in one go, so a reader of the
+    * snapshot sees one or the other, and the view is left as it was if
+    * anything fails. */
+
+   size_t off = k * v->chunk, len = __em_min(v->chunk, v->len - off);
+
+   char *copy = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   if (copy == MAP_FAILED)
+      return false;
+
+   memcpy(copy, v->src + off, len);
+
+   if (mprotect(copy, len, PROT_READ) != 0 ||
+       mremap(copy, len, len, MREMAP_MAYMOVE | MREMAP_FIXED, v->view + off) ==
+          MAP_FAILED) {
+      munmap(copy, len);
+      return false;
+   }
+
+   v->kept[k / 64] |= 1ULL << (k % 64);
+
+   return true;
+}
+
+static void em_i_asa_snaprelease(struct em_asa_hdr_s *header)
+{
+   /* Lets go of a table's hold on its snapshot list, or of a snapshot's
+    * along with its entry and the views that are its slab arrays. Whichever
+    * of them goes last frees the list. */
+
+   struct em_asa_snap_s *sn = header->snap;
+   struct em_asa_snaps_s *ss = sn ? sn->reg : header->snaps;
+
+   pthread_mutex_lock(&ss->lock);
+
+   if (sn) {
+      struct em_asa_snap_s **at = &ss->list;
+
+      while (*at != sn)
+         at = &(*at)->next;
+      __atomic_store_n(at, sn->next, __ATOMIC_RELEASE);
+   }
+
+   bool last = !--ss->refs;
+
+   pthread_mutex_unlock(&ss->lock);
+
+   if (last) {
+      pthread_mutex_destroy(&ss->lock);
+      em_i_asa_xfree(header, ss);
+   }
+
+   if (!sn) {
+      header->snaps = NULL;
+      return;
+   }
+
+   for (unsigned int r = 0; r < EM_ASA_SNAP_ARRAYS; r++) {
+      if (sn->views[r].view)
+         munmap(sn->views[r].view, sn->views[r].len);
+      em_i_asa_xfree(header, sn->views[r].kept);
+   }
+
+   em_i_asa_xfree(header, sn);
+
+   header->snap = NULL;
+   header->cur.ctrl = NULL;
+   header->cur.ids = NULL;
+   header->cur.vals = NULL;
+   header->cur.dist = NULL;
+}
+
+static em_status_t em_i_asa_presize(void **a, unsigned long n)
+{
+   /* Moves the table to a tier that holds n elements and allocates all of
+    * it, finishing off any migration on the way */
+
+   I_PREPHDR;
+
+   if (n > I_MAXLOAD(EM_ASA_MAX_TIER))
+      return EM_INT_OVERFLOW;
+
+   unsigned char tier = em_i_asa_fittier(header, n);
+   em_status_t stat;
+
+   if (tier > header->cur.tier) {
+      if ((stat = em_i_asa_rehash(a, tier)) != EM_STATUS_OKAY)
+         return stat;
+   }
+
+   /* Get any migration out of the way now rather than during the fill */
+   if ((stat = em_i_asa_migrate(a, ~0UL)) != EM_STATUS_OKAY)
+      return stat;
+
+   return em_i_asa_ensurei(a, &header->cur, I_TIERCLM(header->cur.tier));
+}
+
+static em_status_t em_i_asa_bulk(void **a, struct em_asa_bulk_s *b,
+                                 unsigned int threads)
+{
+   /* Inserting many elements one at a time is bound to a single core, and
+    * mostly by waiting on cache misses. Instead:
+    *
+    * 1. The ids are worked out in parallel, each thread hashing its own run
+    *    of the elements.
+    * 2. The table is made big enough for all of them and fully allocated,
+    *    so nothing has to move while the threads are at it.
+    * 3. The elements are sorted by partition, a partition being a run of
+    *    home groups picked by the top bits of the home group, with a
+    *    parallel counting sort that keeps them in input order within each.
+    * 4. Each thread takes its own partitions and places every element whose
+    *    home group still has an empty slot right there. Such a group has
+    *    never had a probe sequence run through it, so if the id is in the
+    *    table at all, it's in that group, and the partitions' groups, and
+    *    with them their slots, don't overlap.
+    * 5. What's left - elements whose home group is full, and long exact keys,
+    *    which need the key arena - is set one at a time, partition by
+    *    partition. Every copy of a key lands in the same partition, so the
+    *    last of them still wins.
+    *
+    * With the table at most at its max load, step 4 places all but a few
+    * percent of the elements. Cache tables are only hashed in parallel and
+    * then set one at a time, as their limit and meta need em_i_asa_set.
+    */
+
+   I_PREPHDR;
+
+   em_status_t stat = EM_OUT_OF_MEMORY;
+
+   if (!threads) {
+      long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+      threads = cpus > 0 ? cpus : 1;
+   }
+
+   b->threads = __em_max((size_t)1,
+                         __em_min((size_t)threads, b->n / EM_ASA_BULK_MIN));
+
+   b->ids = em_i_asa_xalloc(header, __em_max(b->n, (size_t)1) * EM_ASA_ID_SZ);
+   b->added = em_i_asa_xalloc(header, b->threads * sizeof(*b->added));
+   b->reused = em_i_asa_xalloc(header, b->threads * sizeof(*b->reused));
+   b->lost = em_i_asa_xalloc(header, b->threads * sizeof(*b->lost));
+   if (!b->ids || !b->added || !b->reused || !b->lost)
+      goto out;
+
+   memset(b->lost, 0, b->threads * sizeof(*b->lost));
+   em_i_asa_run(b, b->threads, em_i_asa_bulkhash);
+
+   for (unsigned int t = 0; t < b->threads; t++)
+      if (b->lost[t]) {
+         stat = EM_INVALID_TYPE;
+         goto out;
+      }
+
+   if (I_ISCACHE) {
+      for (size_t x = 0; x < b->n; x++)
+         if ((stat = em_i_asa_set(a, b->ids[x], (void *)I_BULKVAL(b, x))) !=
+             EM_STATUS_OKAY)
+            goto out;
+
+      stat = EM_STATUS_OKAY;
+      goto out;
+   }
+
+   if ((stat = em_i_asa_presize(
+           a, __em_min(header->elements + b->n,
+                       (size_t)I_MAXLOAD(EM_ASA_MAX_TIER)))) != EM_STATUS_OKAY)
+      goto out;
+
+   /* Placing threads can't stop to copy chunks out for snapshots, and would
+    * touch most of them anyway, so that's all done up front */
+   I_KEEP(&header->cur, 0, header->cur.highest_index);
+
+   b->gbits = header->cur.tier + 1 - EM_ASA_GRP_LOG2;
+   b->pbits = 0;
+   while (b->pbits < b->gbits &&
+          1UL << b->pbits < (unsigned long)b->threads * EM_ASA_BULK_PARTS)
+      b->pbits++;
+
+   size_t parts = (size_t)1 << b->pbits;
+
+   stat = EM_OUT_OF_MEMORY;
+
+   b->hist = em_i_asa_xalloc(header, b->threads * parts * sizeof(*b->hist));
+   b->order = em_i_asa_xalloc(header, __em_max(b->n, (size_t)1) *
+                                         sizeof(*b->order));
+   b->pstart = em_i_asa_xalloc(header, (parts + 1) * sizeof(*b->pstart));
+   b->over = em_i_asa_xalloc(header, parts * sizeof(*b->over));
+   if (!b->hist || !b->order || !b->pstart || !b->over)
+      goto out;
+
+   if (I_PFHAS(&header->cur)) {
+      if (!(b->fresh = em_i_asa_xalloc(header, __em_max(b->n, (size_t)1))))
+         goto out;
+      memset(b->fresh, 0, b->n);
+   }
+
+   memset(b->hist, 0, b->threads * parts * sizeof(*b->hist));
+   em_i_asa_run(b, b->threads, em_i_asa_bulkhist);
+
+   /* Turn the counts into where each thread's elements of each partition
+    * start, in thread order so the input order holds */
+   size_t at = 0;
+   for (size_t p = 0; p < parts; p++) {
+      b->pstart[p] = at;
+
+      for (unsigned int t = 0; t < b->threads; t++) {
+         size_t count = b->hist[t * parts + p];
+         b->hist[t * parts + p] = at;
+         at += count;
+      }
+   }
+   b->pstart[parts] = at;
+
+   em_i_asa_run(b, b->threads, em_i_asa_bulkscat);
+   em_i_asa_run(b, b->threads, em_i_asa_bulkplace);
+
+   for (unsigned int t = 0; t < b->threads; t++) {
+      header->elements += b->added[t];
+      header->cur.ld_elements -= b->reused[t];
+   }
+
+   /* Only now, as the filter can't take adds from several threads, and has
+    * to have everything in it before the serial pass can start a rebuild */
+   for (size_t x = 0; b->fresh && x < b->n; x++)
+      if (b->fresh[x])
+         em_i_asa_pfadd(header, &header->cur, b->ids[x].probe);
+
+   for (size_t p = 0; p < parts; p++)
+      for (size_t k = 0; k < b->over[p]; k++) {
+         size_t x = b->order[b->pstart[p] + k];
+
+         if ((stat = em_i_asa_set(a, b->ids[x], (void *)I_BULKVAL(b, x))) !=
+             EM_STATUS_OKAY)
+            goto out;
+      }
+
+   stat = EM_STATUS_OKAY;
+
+out:
+   em_i_asa_xfree(header, b->ids);
+   em_i_asa_xfree(header, b->added);
+   em_i_asa_xfree(header, b->reused);
+   em_i_asa_xfree(header, b->lost);
+   em_i_asa_xfree(header, b->hist);
+   em_i_asa_xfree(header, b->order);
+   em_i_asa_xfree(header, b->pstart);
+   em_i_asa_xfree(header, b->over);
+   em_i_asa_xfree(header, b->fresh);
+
+   return stat;
+}
+
+static void em_i_asa_run(void *ctx, unsigned int threads,
+                         void (*fn)(void *ctx, unsigned int t))
+{
+   /* Runs fn for every thread's share, the first on the calling thread. A
+    * thread that can't be started has its share run here too, which is only
+    * slower. */
+
+   struct em_asa_runw_s w[threads];
+   pthread_t tids[threads];
+   bool started[threads];
+
+   for (unsigned int t = 1; t < threads; t++) {
+      w[t] = (struct em_asa_runw_s){ .ctx = ctx, .t = t, .fn = fn };
+      started[t] = pthread_create(&tids[t], NULL, em_i_asa_runw, &w[t]) == 0;
+   }
+
+   fn(ctx, 0);
+
+   for (unsigned int t = 1; t < threads; t++) {
+      if (started[t])
+         pthread_join(tids[t], NULL);
+      else
+         fn(ctx, t);
+   }
+}
+
+static void *em_i_asa_runw(void *w)
+{
+   struct em_asa_runw_s *work = w;
+
+   work->fn(work->ctx, work->t);
+
+   return NULL;
+}
+
+static void em_i_asa_eachw(void *ctx, unsigned int t)
+{
+   struct em_asa_each_s *e = ctx;
+   const struct em_asa_hdr_s *header = e->header;
+   unsigned long span = em_i_asa_span(header);
+   unsigned long from = I_BULKCUT(e, t, e->total);
+   unsigned long to = I_BULKCUT(e, t + 1, e->total);
+
+   /* From the shared numbering to indices */
+   from = from < e->ncur ? from : from - e->ncur + span;
+   to = to <= e->ncur ? to : to - e->ncur + span;
+
+   for (long x = em_i_asa_inext(header, from, to); x >= 0;
+        x = em_i_asa_inext(header, x + 1, to))
+      if (!I_ISCACHE || !em_i_asa_expired(header, x, e->now))
+         e->fn(x, t, e->ctx);
+}
+
+static void em_i_asa_bulkhash(void *ctx, unsigned int t)
+{
+   struct em_asa_bulk_s *b = ctx;
+   struct em_asa_hdr_s *header = b->header;
+   void *hp = header;
+
+   for (size_t x = I_BULKCUT(b, t, b->n); x < I_BULKCUT(b, t + 1, b->n); x++) {
+      if (b->keys) {
+         b->ids[x] = em_i_asa_hrange(&hp, b->keys + x * b->key_size,
+                                     b->key_size);
+         continue;
+      }
+
+      const em_asa_id_t *sid = &b->src->cur.ids[b->smap[x]];
+
+      if (!b->rehash) {
+         b->ids[x] = *sid;
+      } else if (b->src->flags & EM_ASA_EXACT_KEYS &&
+                 sid->llen == EM_ASA_LLEN_EXACT) {
+         b->ids[x] = em_i_asa_hrange(&hp, sid->usect.xsect.key,
+                                     sid->usect.xsect.len);
+      } else if (sid->llen <= EM_ASA_KEY_COLRES) {
+         b->ids[x] = em_i_asa_hrange(&hp, sid->usect.colres, sid->llen);
+      } else {
+         b->lost[t] = true;
+         return;
+      }
+   }
+}
+
+static void em_i_asa_bulkhist(void *ctx, unsigned int t)
+{
+   struct em_asa_bulk_s *b = ctx;
+   struct em_asa_hdr_s *header = b->header;
+   size_t *hist = b->hist + ((size_t)t << b->pbits);
+
+   for (size_t x = I_BULKCUT(b, t, b->n); x < I_BULKCUT(b, t + 1, b->n); x++)
+      hist[I_BULKPART(b, b->ids[x].probe)]++;
+}
+
+static void em_i_asa_bulkscat(void *ctx, unsigned int t)
+{
+   struct em_asa_bulk_s *b = ctx;
+   struct em_asa_hdr_s *header = b->header;
+   size_t *hist = b->hist + ((size_t)t << b->pbits);
+
+   for (size_t x = I_BULKCUT(b, t, b->n); x < I_BULKCUT(b, t + 1, b->n); x++)
+      b->order[hist[I_BULKPART(b, b->ids[x].probe)]++] = x;
+}
+
+static void em_i_asa_bulkplace(void *ctx, unsigned int t)
+{
+   /* Places what it can of each of its partitions' elements at home (see
+    * em_i_asa_bulk), moving the rest up to the front of the partition for
+    * the serial pass. */
+
+   struct em_asa_bulk_s *b = ctx;
+   struct em_asa_hdr_s *header = b->header;
+   struct em_asa_slab_s *slab = &header->cur;
+   size_t parts = (size_t)1 << b->pbits;
+   unsigned long added = 0, reused = 0;
+
+   for (size_t p = I_BULKCUT(b, t, parts); p < I_BULKCUT(b, t + 1, parts);
+        p++) {
+      size_t over = 0;
+
+      for (size_t k = b->pstart[p]; k < b->pstart[p + 1]; k++) {
+         size_t x = b->order[k];
+         const em_asa_id_t *id = &b->ids[x];
+         unsigned long base = I_HOMEGRP(id->probe, slab->tier)
+                              << EM_ASA_GRP_LOG2;
+         const signed char *ctrl = slab->ctrl + base;
+
+         if (I_ISEXACT(id) || !em_i_asa_gmatch(ctrl, CT_EMPTY)) {
+            b->order[b->pstart[p] + over++] = x;
+            continue;
+         }
+
+         unsigned int m = em_i_asa_gmatch(ctrl, I_CTRLTAG(id->probe));
+         for (; m; m &= m - 1)
+            if (em_i_asa_keyeq(header, id, &slab->ids[base + __builtin_ctz(m)]))
+               break;
+
+         unsigned long slot =
+            base + __builtin_ctz(m ? m : em_i_asa_gfree(ctrl));
+
+         if (!m) {
+            if (slab->ctrl[slot] == CT_DELETE)
+               reused++;
+
+            slab->ctrl[slot] = I_CTRLTAG(id->probe);
+            slab->ids[slot] = *id;
+            if (slab->dist)
+               slab->dist[slot] = 0;
+            if (b->fresh)
+               b->fresh[x] = 1;
+            added++;
+         }
+
+         memcpy(I_VALP(slab, slot), I_BULKVAL(b, x), header->element_size);
+      }
+
+      b->over[p] = over;
+   }
+
+   b->added[t] = added;
+   b->reused[t] = reused;
+}
+
+static em_status_t em_i_asa_balance(void **a)
+{
+   /* Deletes never rebuild the table on the spot. Instead, whenever the
+    * current slab gets too full or too empty, a rebuild is started with
+    * em_i_asa_rehash and carried out a few slots at a time like any other
+    * migration:
+    *
+    * - Live elements plus tombstones past the max load: grow a tier if the
+    *   live elements alone fill more than half of it, otherwise rebuild at the
+    *   same tier, which leaves every tombstone behind.
+    * - More dead than live bytes in the key arena: rebuild at the same tier,
+    *   which copies only the live keys over.
+    * - Live elements below 1/EM_ASA_SHRINK_DIV of the max load: shrink to the
+    *   smallest tier that leaves the table at most half its max load, but never
+    *   below what was reserved with em_i_asa_reserve.
+    *
+    * Each rebuild lands the table well clear of both thresholds, so one that
+    * hovers around either of them doesn't rebuild over and over, and the cost
+    * of each is paid for by the operations it takes to get there again. A
+    * cache never grows past its tier (see em_i_asa_cache), its limit keeps
+    * the live elements well below that tier's max load, so it compacts.
+    */
+
+   I_PREPHDR;
+
+   unsigned char tier = header->cur.tier;
+   unsigned long max = I_MAXLOAD(tier);
+
+   if (header->elements + header->cur.ld_elements > max) {
+      if (header->elements > max / 2 &&
+          (!header->cache.tier || tier < header->cache.tier)) {
+         if (tier >= EM_ASA_MAX_TIER)
+            return EM_INT_OVERFLOW;
+         tier++;
+      }
+   } else if (header->cur.keys_dead > EM_ASA_KSLACK &&
+              header->cur.keys_dead > header->cur.keys_live &&
+              !header->old.ctrl) {
+      /* Same tier, just to leave the dead key bytes behind */
+   } else if (header->elements < max / EM_ASA_SHRINK_DIV && !header->old.ctrl) {
+      tier = __em_max(em_i_asa_fittier(header, header->elements * 2),
+                      em_i_asa_fittier(header, header->reserved));
+      if (tier >= header->cur.tier)
+         return EM_STATUS_OKAY;
+   } else {
+      return EM_STATUS_OKAY;
+   }
+
+   return em_i_asa_rehash(a, tier);
+}
+
+static em_status_t em_i_asa_rehash(void **a, unsigned char tier)
+{
+   /* Rebuilds never leave elements scattered across every tier they were
+    * ever inserted at. The current slab becomes the old slab, a fresh one is
+    * started at the new tier, and set/delete drain the old slab a few slots
+    * at a time (em_i_asa_migrate), so lookups only ever run one probe
+    * sequence per slab and just one once the migration is over. When
+    * shrinking, the old slab is drained proportionally faster, so it is gone
+    * before the smaller slab can fill up.
+    */
+
+   I_PREPHDR;
+
+   /* The old slab is always drained well before the next rebuild is due, but
+    * finish it off just in case, since there is only room for one. */
+   em_status_t stat = em_i_asa_migrate(a, ~0UL);
+   if (stat != EM_STATUS_OKAY)
+      return stat;
+
+   struct em_asa_slab_s fresh;
+   if ((stat = em_i_asa_slabmk(header, &fresh, tier)) !=
+       EM_STATUS_OKAY) {
+      em_i_asa_freeslab(header, &fresh);
+      return stat;
+   }
+
+   em_i_asa_filtermk(header, &fresh, I_PFHAS(&header->cur));
+
+   if (tier > header->cur.tier)
+      header->counters.grows++;
+   else if (tier < header->cur.tier)
+      header->counters.shrinks++;
+   else
+      header->counters.compactions++;
+
+   header->old = header->cur;
+   header->cur = fresh;
+   header->mig_pos = 0;
+
+   return EM_STATUS_OKAY;
+}
+
+static em_status_t em_i_asa_migrate(void **a, unsigned long steps)
+{
+   /* Moves the live elements in the next `steps` slots of the old slab over to
+    * the current one. Moved slots are left as tombstones so any old probe
+    * sequences running through them stay intact until the slab is freed. The
+    * budget is counted in slots rather than elements so it stays bounded no
+    * matter how the old slab is populated.
+    */
+
+   I_PREPHDR;
+
+   struct em_asa_slab_s *old = &header->old;
+
+   if (!old->ctrl)
+      return EM_STATUS_OKAY;
+
+   for (; steps && header->mig_pos <= old->highest_index; steps--) {
+      unsigned long x = header->mig_pos;
+
+      if (old->ctrl[x] >= 0) {
+         em_status_t stat =
+            em_i_asa_splace(a, &header->cur, &old->ids[x], I_VALP(old, x),
+                            old->meta ? old->meta[x] : 0);
+         if (stat != EM_STATUS_OKAY)
+            return stat;
+
+         I_KEEP(old, x, x);
+         old->ctrl[x] = CT_DELETE;
+         if (old->dist)
+            old->dist[x] = EM_ASA_RH_DEAD;
+      }
+
+      header->mig_pos++;
+   }
 
-   header->tier++;
+   if (header->mig_pos > old->highest_index)
+      em_i_asa_freeslab(header, old);
 
    return EM_STATUS_OKAY;
 }
@@ -404,5 +3966,6 @@ static unsigned long em_i_asa_freeslots(void **a)
     * variant of the hash table...
     */
 
-   return I_TIERCLM(header->tier) + 1 - header->elements - header->ld_elements;
+   return I_TIERCLM(header->cur.tier) + 1 - header->elements -
+          header->cur.ld_elements;
 }
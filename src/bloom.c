@@ -1,15 +1,345 @@
 #include "../include/bloom.h"
 
 #include <limits.h>
+#include <math.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <xxhash.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "../include/mt19937-64.h"
 
+#define EM_BLOOM_WORDS (EM_BLOOM_BLOCK / 8)
+#define EM_BLOOM_MAGIC "EMBLOOMF"
+#define EM_BLOOM_VERSION 1
+
+/* The k bit positions for a hash are h, h + d, h + 2d, ... (Kirsch and
+ * Mitzenmacher's double hashing), with d taken from the hash's other half. */
+#define I_BLMSTEP(h) (((h) >> 32 | (h) << 32) | 1)
+/* A blocked filter's block comes from the low bits of the hash */
+#define I_BLMBLOCK(t, h)                                                       \
+   ((uint64_t *)((t)->filter + (t)->offset +                                   \
+                 ((h) & ((t)->blocks - 1)) * EM_BLOOM_BLOCK))
+
+/* Header of a filter written by em_bloom_save, which its bits follow. Fields
+ * are fixed-width, ordered so the struct has no padding, and held little-endian
+ * whatever the host; so are the words of a blocked filter's bits. */
+struct em_bloom_wire_s {
+   char magic[8];
+   uint64_t version;
+   uint64_t bytes;
+   uint64_t hashes;
+   uint64_t seed;
+   uint64_t blocks;
+   uint64_t sum; /* XXH3 over the bits, seeded with that of this header */
+};
+
+static em_status_t em_i_bloom_init(em_bloom_t *target, size_t bytes,
+                                   unsigned int hashes, size_t blocks,
+                                   const em_alloc_t *allocator);
+static inline void em_i_bloom_mask(const em_bloom_t *target,
+                                   unsigned long long hash,
+                                   uint64_t mask[EM_BLOOM_WORDS]);
+static em_status_t em_i_bloom_combine(em_bloom_t *target,
+                                      const em_bloom_t *other, bool both);
+static inline uint64_t em_i_bloom_le(uint64_t value);
+static void em_i_bloom_lewords(void *bits, size_t bytes);
+static uint64_t em_i_bloom_sum(const struct em_bloom_wire_s *wire,
+                               const void *bits, size_t bytes);
+
 em_status_t em_bloom_mk(em_bloom_t *target, size_t bytes)
 {
-   target->filter = (char *)calloc(bytes, 1);
+   return em_bloom_mkk(target, bytes, 1);
+}
+
+em_status_t em_bloom_mkk(em_bloom_t *target, size_t bytes,
+                         unsigned int hashes)
+{
+   return em_bloom_mka(target, bytes, hashes, NULL);
+}
+
+em_status_t em_bloom_mka(em_bloom_t *target, size_t bytes, unsigned int hashes,
+                         const em_alloc_t *allocator)
+{
+   return em_i_bloom_init(target, bytes, hashes, 0, allocator);
+}
+
+em_status_t em_bloom_mkb(em_bloom_t *target, size_t bytes,
+                         unsigned int hashes)
+{
+   return em_bloom_mkba(target, bytes, hashes, NULL);
+}
+
+em_status_t em_bloom_mkba(em_bloom_t *target, size_t bytes,
+                          unsigned int hashes, const em_alloc_t *allocator)
+{
+   size_t blocks = 1;
+
+   while (blocks * EM_BLOOM_BLOCK < bytes) {
+      if (blocks > SIZE_MAX / 2 / EM_BLOOM_BLOCK)
+         return EM_INT_OVERFLOW;
+      blocks <<= 1;
+   }
+
+   return em_i_bloom_init(target, blocks * EM_BLOOM_BLOCK, hashes, blocks,
+                          allocator);
+}
+
+em_status_t em_bloom_mkp(em_bloom_t *target, size_t items, double fpr)
+{
+   return em_bloom_mkpa(target, items, fpr, NULL);
+}
+
+em_status_t em_bloom_mkpa(em_bloom_t *target, size_t items, double fpr,
+                          const em_alloc_t *allocator)
+{
+   /* The usual optimum: m = -n ln p / (ln 2)^2 bits and k = m/n ln 2 */
+
+   if (!(fpr > 0 && fpr < 1))
+      return EM_OUT_OF_BOUNDS;
+
+   double n = items ? (double)items : 1;
+   double bits = ceil(-n * log(fpr) / (M_LN2 * M_LN2));
+
+   if (bits / CHAR_BIT >= (double)(SIZE_MAX / 2))
+      return EM_INT_OVERFLOW;
+
+   size_t bytes = (size_t)ceil(bits / CHAR_BIT);
+   long hashes = lround(bits / n * M_LN2);
+
+   return em_i_bloom_init(target, bytes, hashes < 1 ? 1 : (unsigned int)hashes,
+                          0, allocator);
+}
+
+unsigned long long em_bloom_hash(em_bloom_t *target, const void *data,
+                                 size_t size)
+{
+   return XXH3_64bits_withSeed(data, size, (XXH64_hash_t)target->seed);
+}
+
+void em_bloom_addh(em_bloom_t *target, unsigned long long hash)
+{
+   if (target->blocks) {
+      uint64_t mask[EM_BLOOM_WORDS], *block = I_BLMBLOCK(target, hash);
+
+      em_i_bloom_mask(target, hash, mask);
+      for (unsigned int w = 0; w < EM_BLOOM_WORDS; w++)
+         block[w] |= mask[w];
+
+      return;
+   }
+
+   unsigned long long step = I_BLMSTEP(hash);
+
+   for (unsigned int x = 0; x < target->hashes; x++, hash += step) {
+      size_t bit = hash % target->capacity;
+      target->filter[bit / CHAR_BIT] |= 1 << (bit % CHAR_BIT);
+   }
+}
+
+bool em_bloom_inh(const em_bloom_t *target, unsigned long long hash)
+{
+   /* Every bit is tested without branching in between, so the loads can all
+    * be in flight at once. A blocked filter's bits are all tested together,
+    * by checking that the block has every bit of the id's mask. */
+
+   if (target->blocks) {
+      uint64_t mask[EM_BLOOM_WORDS];
+      const uint64_t *block = I_BLMBLOCK(target, hash);
+
+      em_i_bloom_mask(target, hash, mask);
+
+#ifdef __SSE2__
+      __m128i missing = _mm_setzero_si128();
+
+      for (unsigned int w = 0; w < EM_BLOOM_WORDS; w += 2)
+         missing = _mm_or_si128(
+            missing,
+            _mm_andnot_si128(_mm_load_si128((const __m128i *)(block + w)),
+                             _mm_loadu_si128((const __m128i *)(mask + w))));
+
+      return _mm_movemask_epi8(
+                _mm_cmpeq_epi8(missing, _mm_setzero_si128())) == 0xFFFF;
+#else
+      uint64_t missing = 0;
+
+      for (unsigned int w = 0; w < EM_BLOOM_WORDS; w++)
+         missing |= mask[w] & ~block[w];
+
+      return !missing;
+#endif
+   }
+
+   unsigned long long step = I_BLMSTEP(hash);
+   bool present = true;
+
+   for (unsigned int x = 0; x < target->hashes; x++, hash += step) {
+      size_t bit = hash % target->capacity;
+      present &= (target->filter[bit / CHAR_BIT] >> (bit % CHAR_BIT)) & 1;
+   }
+
+   return present;
+}
+
+void em_bloom_prefetch(const em_bloom_t *target, unsigned long long hash)
+{
+   if (target->blocks) {
+      __builtin_prefetch(I_BLMBLOCK(target, hash));
+      return;
+   }
+
+   unsigned long long step = I_BLMSTEP(hash);
+
+   for (unsigned int x = 0; x < target->hashes; x++, hash += step)
+      __builtin_prefetch(&target->filter[hash % target->capacity / CHAR_BIT]);
+}
+
+void em_bloom_add(em_bloom_t *target, const void *data, size_t size)
+{
+   em_bloom_addh(target, em_bloom_hash(target, data, size));
+}
+
+bool em_bloom_in(em_bloom_t *target, const void *data, size_t size)
+{
+   return em_bloom_inh(target, em_bloom_hash(target, data, size));
+}
+
+em_status_t em_bloom_union(em_bloom_t *target, const em_bloom_t *other)
+{
+   return em_i_bloom_combine(target, other, false);
+}
+
+em_status_t em_bloom_intersect(em_bloom_t *target, const em_bloom_t *other)
+{
+   return em_i_bloom_combine(target, other, true);
+}
+
+double em_bloom_card(const em_bloom_t *target)
+{
+   /* Swamidass and Baldi's estimate, n = -(m / k) ln(1 - X / m) for X of the
+    * m bits set. Blocked filters fill their blocks unevenly, so it only
+    * holds for them on average over many blocks. */
+
+   const char *bits = target->filter + target->offset;
+   size_t set = 0, x = 0;
+
+   for (; x + sizeof(uint64_t) <= target->bytes; x += sizeof(uint64_t)) {
+      uint64_t w;
+
+      memcpy(&w, bits + x, sizeof(w));
+      set += __builtin_popcountll(w);
+   }
+   for (; x < target->bytes; x++)
+      set += __builtin_popcount((unsigned char)bits[x]);
+
+   if (set >= target->capacity)
+      return INFINITY;
+
+   double m = (double)target->capacity;
+
+   return -m / target->hashes * log1p(-(double)set / m);
+}
+
+em_status_t em_bloom_save(const em_bloom_t *target, em_buf_t *out)
+{
+   struct em_bloom_wire_s wire = {
+      .magic = EM_BLOOM_MAGIC,
+      .version = em_i_bloom_le(EM_BLOOM_VERSION),
+      .bytes = em_i_bloom_le(target->bytes),
+      .hashes = em_i_bloom_le(target->hashes),
+      .seed = em_i_bloom_le(target->seed),
+      .blocks = em_i_bloom_le(target->blocks),
+   };
+   char *bits;
+
+   if (target->bytes > SIZE_MAX - sizeof(wire))
+      return EM_INT_OVERFLOW;
+
+   em_status_t stat = em_buf_resz(out, sizeof(wire) + target->bytes, false);
+   if (stat != EM_STATUS_OKAY)
+      return stat;
+
+   bits = (char *)out->data + sizeof(wire);
+   memcpy(bits, target->filter + target->offset, target->bytes);
+
+   if (target->blocks)
+      em_i_bloom_lewords(bits, target->bytes);
+
+   wire.sum = em_i_bloom_le(em_i_bloom_sum(&wire, bits, target->bytes));
+   memcpy(out->data, &wire, sizeof(wire));
+
+   return EM_STATUS_OKAY;
+}
+
+em_status_t em_bloom_load(em_bloom_t *target, const em_buf_t *in,
+                          const em_alloc_t *allocator)
+{
+   struct em_bloom_wire_s wire;
+   const char *bits;
+
+   if (!in->data || in->bytes < sizeof(wire))
+      return EM_BAD_IMAGE;
+
+   bits = (const char *)in->data + sizeof(wire);
+   memcpy(&wire, in->data, sizeof(wire));
+
+   uint64_t bytes = em_i_bloom_le(wire.bytes);
+   uint64_t hashes = em_i_bloom_le(wire.hashes);
+   uint64_t blocks = em_i_bloom_le(wire.blocks);
+
+   if (memcmp(wire.magic, EM_BLOOM_MAGIC, sizeof(wire.magic)) != 0 ||
+       em_i_bloom_le(wire.version) != EM_BLOOM_VERSION ||
+       bytes != in->bytes - sizeof(wire) || !bytes || !hashes ||
+       hashes > UINT_MAX)
+      return EM_BAD_IMAGE;
+
+   if (blocks && (blocks & (blocks - 1) || bytes != blocks * EM_BLOOM_BLOCK))
+      return EM_BAD_IMAGE;
+
+   if (em_i_bloom_sum(&wire, bits, bytes) != em_i_bloom_le(wire.sum))
+      return EM_BAD_IMAGE;
+
+   em_status_t stat = em_i_bloom_init(target, bytes, hashes, blocks,
+                                      allocator);
+   if (stat != EM_STATUS_OKAY)
+      return stat;
+
+   target->seed = em_i_bloom_le(wire.seed);
+   memcpy(target->filter + target->offset, bits, bytes);
+
+   if (blocks)
+      em_i_bloom_lewords(target->filter + target->offset, bytes);
+
+   return EM_STATUS_OKAY;
+}
+
+void em_bloom_empty(em_bloom_t *target)
+{
+   memset(target->filter + target->offset, 0, target->bytes);
+}
+
+void em_bloom_free(em_bloom_t *target)
+{
+   if (target->filter)
+      target->mi->free(target->mi->udata, target->filter);
+}
+
+static em_status_t em_i_bloom_init(em_bloom_t *target, size_t bytes,
+                                   unsigned int hashes, size_t blocks,
+                                   const em_alloc_t *allocator)
+{
+   /* Blocked filters are allocated a block's worth over, as the allocator
+    * may not hand out memory on a cache line */
+
+   size_t spare = blocks ? EM_BLOOM_BLOCK - 1 : 0;
+
+   target->mi = allocator ? allocator : EM_GLOBAL_ALLOC;
+
+   target->filter =
+      (char *)target->mi->realloc(target->mi->udata, NULL, bytes + spare);
    if (!target->filter)
       return EM_OUT_OF_MEMORY;
 
@@ -17,36 +347,97 @@ em_status_t em_bloom_mk(em_bloom_t *target, size_t bytes)
 
    target->bytes = bytes;
    target->capacity = bytes * CHAR_BIT;
+   target->hashes = hashes ? hashes : 1;
    target->seed = em_mt_genrand64_int64(&em_mt19937_global);
+   target->blocks = blocks;
+   target->offset =
+      blocks ? -(uintptr_t)target->filter & (EM_BLOOM_BLOCK - 1) : 0;
+
+   em_bloom_empty(target);
 
    return EM_STATUS_OKAY;
 }
 
-#define XHC                                                                    \
-   unsigned long long xh =                                                     \
-      XXH3_64bits_withSeed(data, size, (XXH64_hash_t)target->seed)
-
-void em_bloom_add(em_bloom_t *target, const void *data, size_t size)
+static inline void em_i_bloom_mask(const em_bloom_t *target,
+                                   unsigned long long hash,
+                                   uint64_t mask[EM_BLOOM_WORDS])
 {
-   XHC;
+   /* The bits an id sets in its block. The block came from the low bits of
+    * the hash, so the positions are double hashed from the top half, with a
+    * step mixed out of the whole of it. Each is the top 9 bits of a 32-bit
+    * sum, which ranges over the block's 512. */
+
+   uint32_t at = hash >> 32;
+   uint32_t step = (uint32_t)((hash * 0x9E3779B97F4A7C15ULL) >> 32) | 1;
 
-   target->filter[xh % target->bytes] |= 1 << (xh % CHAR_BIT);
+   memset(mask, 0, EM_BLOOM_WORDS * sizeof(*mask));
+
+   for (unsigned int x = 0; x < target->hashes; x++, at += step) {
+      unsigned int bit = at >> (32 - 9);
+      mask[bit / 64] |= 1ULL << (bit % 64);
+   }
 }
 
-bool em_bloom_in(em_bloom_t *target, const void *data, size_t size)
+static em_status_t em_i_bloom_combine(em_bloom_t *target,
+                                      const em_bloom_t *other, bool both)
 {
-   XHC;
+   /* ORs other's bits into target's, or ANDs them with both, 16 bytes at a
+    * time where SSE2 is around */
+
+   if (target->bytes != other->bytes || target->hashes != other->hashes ||
+       target->seed != other->seed || target->blocks != other->blocks)
+      return EM_INVALID_TYPE;
+
+   char *to = target->filter + target->offset;
+   const char *from = other->filter + other->offset;
+   size_t x = 0;
+
+#ifdef __SSE2__
+   for (; x + sizeof(__m128i) <= target->bytes; x += sizeof(__m128i)) {
+      __m128i a = _mm_loadu_si128((const __m128i *)(to + x));
+      __m128i b = _mm_loadu_si128((const __m128i *)(from + x));
 
-   return target->filter[xh % target->bytes] & (1 << (xh % CHAR_BIT));
+      _mm_storeu_si128((__m128i *)(to + x),
+                       both ? _mm_and_si128(a, b) : _mm_or_si128(a, b));
+   }
+#endif
+
+   for (; x < target->bytes; x++)
+      to[x] = both ? to[x] & from[x] : to[x] | from[x];
+
+   return EM_STATUS_OKAY;
 }
 
-void em_bloom_empty(em_bloom_t *target)
+/* Little-endian to host or back; either way it's the same swap */
+static inline uint64_t em_i_bloom_le(uint64_t value)
 {
-   memset(target->filter, 0, target->bytes);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+   return __builtin_bswap64(value);
+#else
+   return value;
+#endif
 }
 
-void em_bloom_free(em_bloom_t *target)
+static void em_i_bloom_lewords(void *bits, size_t bytes)
 {
-   if (target->filter)
-      free(target->filter);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+   uint64_t *words = bits;
+
+   for (size_t x = 0; x < bytes / 8; x++)
+      words[x] = em_i_bloom_le(words[x]);
+#else
+   (void)bits;
+   (void)bytes;
+#endif
+}
+
+/* Taken over the header and bits as written, so it's the same on any host */
+static uint64_t em_i_bloom_sum(const struct em_bloom_wire_s *wire,
+                               const void *bits, size_t bytes)
+{
+   struct em_bloom_wire_s hdr = *wire;
+
+   hdr.sum = 0;
+
+   return XXH3_64bits_withSeed(bits, bytes, XXH3_64bits(&hdr, sizeof(hdr)));
 }
@@ -40,10 +40,13 @@ em_status_t em_buf_resz(em_buf_t *buffer, size_t bytes, bool zero)
 {
    size_t old_size = buffer->bytes;
 
-   buffer->mi->realloc(buffer->mi->udata, buffer->data, bytes);
-   if (!buffer->data)
+   /* The old data stays where it was if this fails */
+   void *data = buffer->mi->realloc(buffer->mi->udata, buffer->data, bytes);
+   if (!data && bytes)
       return EM_OUT_OF_MEMORY;
 
+   buffer->data = data;
+
    if (zero && bytes > old_size)
       memset((char *)buffer->data + old_size, 0, bytes - old_size);
 
@@ -55,5 +58,8 @@ em_status_t em_buf_resz(em_buf_t *buffer, size_t bytes, bool zero)
 void em_buf_free(em_buf_t *buffer)
 {
    if (buffer->data)
-      buffer->mi->free(buffer->mi->udata, buffer);
+      buffer->mi->free(buffer->mi->udata, buffer->data);
+
+   buffer->data = NULL;
+   buffer->bytes = 0;
 }
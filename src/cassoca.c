@@ -0,0 +1,356 @@
+/* Concurrent assoca - see cassoca.h for the overview.
+ *
+ * Writers take their shard's mutex and bump its sequence counter to an odd
+ * value for the duration of the change. Readers snapshot the shard's table
+ * header, run an ordinary lookup against the snapshot, copy the value out and
+ * then check the sequence counter didn't move; if it did, they go again.
+ *
+ * That only works if nothing a reader might be looking at is freed under its
+ * feet, so every shard table has a retire hook: memory the table drops (old
+ * slot arrays after a resize, whole tables after a reform) is queued on the
+ * shard and only freed after an epoch flip has waited out every reader that
+ * pinned the previous epoch. Reader pins are counted on striped, cache-line
+ * sized counters so readers on different cores don't share a line.
+ */
+
+#include "../include/cassoca.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/svec.h"
+
+#define EM_CASA_MAX_BITS 12
+#define EM_CASA_RSLOTS 64 /* Reader pin counter stripes */
+#define EM_CASA_LINE 64
+
+struct em_casa_rslot_s {
+   _Atomic unsigned long active[2];
+} __attribute__((aligned(EM_CASA_LINE)));
+
+struct em_casa_shard_s {
+   pthread_mutex_t lock;
+   _Atomic unsigned long seq;
+   void *_Atomic table;
+   void **retired;
+   struct em_casa_s *owner;
+} __attribute__((aligned(EM_CASA_LINE)));
+
+struct em_casa_s {
+   size_t element_size;
+   unsigned long long seed;
+   unsigned int bits;
+
+   _Atomic unsigned long epoch;
+   pthread_mutex_t sync_lock;
+   struct em_casa_rslot_s rslots[EM_CASA_RSLOTS];
+
+   struct em_casa_shard_s shards[];
+};
+
+/* Static Declarations & Constant Variables --------------------------------- */
+
+static _Atomic unsigned int em_casa_nstripe;
+static _Thread_local unsigned int em_casa_stripe; /* Stripe + 1, 0 if unset */
+
+static struct em_casa_shard_s *em_i_casa_shard(struct em_casa_s *c,
+                                               const em_asa_id_t *id);
+static struct em_casa_rslot_s *em_i_casa_rslot(struct em_casa_s *c);
+static unsigned long em_i_casa_pin(struct em_casa_s *c,
+                                   struct em_casa_rslot_s *rs);
+static void em_i_casa_unpin(struct em_casa_rslot_s *rs, unsigned long e);
+static void em_i_casa_sync(struct em_casa_s *c);
+static void em_i_casa_retire(void *ctx, void *ptr);
+static em_status_t em_i_casa_write(struct em_casa_s *c, em_asa_id_t id,
+                                   void *value);
+
+/* Public Functions --------------------------------------------------------- */
+
+void *em_i_casa_init(size_t el_size, unsigned int bits)
+{
+   if (bits > EM_CASA_MAX_BITS)
+      return NULL;
+
+   size_t shards = (size_t)1 << bits;
+   size_t bytes = sizeof(struct em_casa_s) +
+                  shards * sizeof(struct em_casa_shard_s);
+
+   struct em_casa_s *c = aligned_alloc(
+      EM_CASA_LINE, (bytes + EM_CASA_LINE - 1) & ~(size_t)(EM_CASA_LINE - 1));
+   if (!c)
+      return NULL;
+
+   memset(c, 0, bytes);
+   c->element_size = el_size;
+   c->bits = bits;
+   pthread_mutex_init(&c->sync_lock, NULL);
+
+   for (size_t x = 0; x < shards; x++) {
+      struct em_casa_shard_s *sh = &c->shards[x];
+      struct em_asa_hdr_s *table = NULL;
+
+      sh->owner = c;
+      pthread_mutex_init(&sh->lock, NULL);
+
+      if (em_i_asa_init((void **)&table, el_size) != EM_STATUS_OKAY) {
+         em_i_asa_destroy((void **)&table);
+         em_i_casa_destroy(c);
+         return NULL;
+      }
+
+      /* Every shard has to agree on the seed, or an id hashed once could
+       * never be found again. */
+      if (x == 0)
+         c->seed = table->seed;
+      else
+         table->seed = c->seed;
+
+      table->retire = em_i_casa_retire;
+      table->retire_ctx = sh;
+      atomic_init(&sh->table, table);
+   }
+
+   return c;
+}
+
+void em_i_casa_destroy(void *cp)
+{
+   /* Must not race with anything else touching the table */
+
+   struct em_casa_s *c = cp;
+
+   if (!c)
+      return;
+
+   for (size_t x = 0; x < ((size_t)1 << c->bits); x++) {
+      struct em_casa_shard_s *sh = &c->shards[x];
+      struct em_asa_hdr_s *table = atomic_load(&sh->table);
+
+      if (table) {
+         table->retire = NULL;
+         em_i_asa_destroy((void **)&table);
+      }
+
+      for (size_t r = 0; r < da_count(sh->retired); r++)
+         free(sh->retired[r]);
+      da_free(sh->retired);
+
+      pthread_mutex_destroy(&sh->lock);
+   }
+
+   pthread_mutex_destroy(&c->sync_lock);
+   free(c);
+}
+
+em_asa_id_t em_i_casa_hrange(void *cp, const void *key, size_t amt)
+{
+   struct em_asa_hdr_s hashing = { .seed = ((struct em_casa_s *)cp)->seed };
+   void *hp = &hashing;
+
+   return em_i_asa_hrange(&hp, key, amt);
+}
+
+unsigned long em_i_casa_count(void *cp)
+{
+   /* A sum of per-shard counts, each read consistently, but not all at the
+    * same instant. */
+
+   struct em_casa_s *c = cp;
+   struct em_casa_rslot_s *rs = em_i_casa_rslot(c);
+   unsigned long total = 0;
+
+   unsigned long e = em_i_casa_pin(c, rs);
+
+   for (size_t x = 0; x < ((size_t)1 << c->bits); x++) {
+      struct em_casa_shard_s *sh = &c->shards[x];
+      unsigned long s1, elements;
+
+      do {
+         s1 = atomic_load_explicit(&sh->seq, memory_order_acquire);
+         elements = ((struct em_asa_hdr_s *)atomic_load_explicit(
+                        &sh->table, memory_order_relaxed))
+                       ->elements;
+         atomic_thread_fence(memory_order_acquire);
+      } while ((s1 & 1) ||
+               atomic_load_explicit(&sh->seq, memory_order_relaxed) != s1);
+
+      total += elements;
+   }
+
+   em_i_casa_unpin(rs, e);
+
+   return total;
+}
+
+bool em_i_casa_get(void *cp, em_asa_id_t id, void *out)
+{
+   struct em_casa_s *c = cp;
+   struct em_casa_shard_s *sh = em_i_casa_shard(c, &id);
+   struct em_casa_rslot_s *rs = em_i_casa_rslot(c);
+   struct em_asa_hdr_s snap;
+   void *sp = &snap;
+   bool found;
+
+   unsigned long e = em_i_casa_pin(c, rs);
+
+   for (;;) {
+      unsigned long s1 = atomic_load_explicit(&sh->seq, memory_order_acquire);
+
+      /* Don't hold a pin while waiting on a writer, it may be waiting on us */
+      if (s1 & 1) {
+         em_i_casa_unpin(rs, e);
+         sched_yield();
+         e = em_i_casa_pin(c, rs);
+         continue;
+      }
+
+      memcpy(&snap, atomic_load_explicit(&sh->table, memory_order_relaxed),
+             EM_ASA_HR_SZ);
+
+      atomic_thread_fence(memory_order_acquire);
+      if (atomic_load_explicit(&sh->seq, memory_order_relaxed) != s1)
+         continue;
+
+      /* The snapshot is consistent, and everything it points to stays
+       * allocated while we're pinned. Slot contents may still be torn by a
+       * writer that starts now, which the final check catches. */
+      long idx = em_i_asa_lookup(&sp, id);
+      void *value;
+
+      if ((found = idx >= 0) && out && (value = em_i_asa_getvp(&sp, idx)))
+         memcpy(out, value, c->element_size);
+
+      atomic_thread_fence(memory_order_acquire);
+      if (atomic_load_explicit(&sh->seq, memory_order_relaxed) == s1)
+         break;
+   }
+
+   em_i_casa_unpin(rs, e);
+
+   return found;
+}
+
+em_status_t em_i_casa_set(void *c, em_asa_id_t id, void *value)
+{
+   return em_i_casa_write(c, id, value);
+}
+
+em_status_t em_i_casa_delete(void *c, em_asa_id_t id)
+{
+   return em_i_casa_write(c, id, NULL);
+}
+
+/* Static Definitions ------------------------------------------------------- */
+
+static struct em_casa_shard_s *em_i_casa_shard(struct em_casa_s *c,
+                                               const em_asa_id_t *id)
+{
+   /* The probe hash is run through a Fibonacci multiply before its top bits
+    * pick the shard, so the shard number doesn't pin down any of the bits the
+    * shard's own table uses for its home group or control tag. */
+
+   if (!c->bits)
+      return &c->shards[0];
+
+   return &c->shards[(id->probe * 0x9E3779B97F4A7C15ULL) >> (64 - c->bits)];
+}
+
+static struct em_casa_rslot_s *em_i_casa_rslot(struct em_casa_s *c)
+{
+   if (!em_casa_stripe)
+      em_casa_stripe =
+         atomic_fetch_add(&em_casa_nstripe, 1) % EM_CASA_RSLOTS + 1;
+
+   return &c->rslots[em_casa_stripe - 1];
+}
+
+static unsigned long em_i_casa_pin(struct em_casa_s *c,
+                                   struct em_casa_rslot_s *rs)
+{
+   for (;;) {
+      unsigned long e = atomic_load(&c->epoch);
+
+      atomic_fetch_add(&rs->active[e & 1], 1);
+
+      /* If the epoch flipped in between, a sync may already have looked at
+       * this counter and moved on, so back out and try again. */
+      if (atomic_load(&c->epoch) == e)
+         return e;
+
+      atomic_fetch_sub(&rs->active[e & 1], 1);
+   }
+}
+
+static void em_i_casa_unpin(struct em_casa_rslot_s *rs, unsigned long e)
+{
+   atomic_fetch_sub_explicit(&rs->active[e & 1], 1, memory_order_release);
+}
+
+static void em_i_casa_sync(struct em_casa_s *c)
+{
+   /* Flips the epoch and waits until every reader pinned before the flip is
+    * done. Anything retired before calling this is then safe to free. */
+
+   pthread_mutex_lock(&c->sync_lock);
+
+   unsigned long e = atomic_load(&c->epoch);
+   atomic_store(&c->epoch, e + 1);
+
+   for (unsigned int x = 0; x < EM_CASA_RSLOTS; x++)
+      while (atomic_load(&c->rslots[x].active[e & 1]))
+         sched_yield();
+
+   pthread_mutex_unlock(&c->sync_lock);
+}
+
+static void em_i_casa_retire(void *ctx, void *ptr)
+{
+   struct em_casa_shard_s *sh = ctx;
+
+   /* Can't queue it? Then wait the readers out right here instead. */
+   if (da_push(sh->retired, ptr) != EM_STATUS_OKAY) {
+      em_i_casa_sync(sh->owner);
+      free(ptr);
+   }
+}
+
+static em_status_t em_i_casa_write(struct em_casa_s *c, em_asa_id_t id,
+                                   void *value)
+{
+   struct em_casa_shard_s *sh = em_i_casa_shard(c, &id);
+
+   pthread_mutex_lock(&sh->lock);
+
+   unsigned long s = atomic_load_explicit(&sh->seq, memory_order_relaxed);
+   atomic_store_explicit(&sh->seq, s + 1, memory_order_relaxed);
+   atomic_thread_fence(memory_order_release);
+
+   void *table = atomic_load_explicit(&sh->table, memory_order_relaxed);
+   em_status_t stat = value ? em_i_asa_set(&table, id, value) :
+                              em_i_asa_delete(&table, id);
+
+   atomic_store_explicit(&sh->table, table, memory_order_release);
+   atomic_store_explicit(&sh->seq, s + 2, memory_order_release);
+
+   /* What the write retired is taken off the shard, and the readers are
+    * waited out only once its lock is let go: a sync waits on every reader
+    * and every other syncing writer, and this shard's writers shouldn't have
+    * to wait on those too. */
+   void **retired = sh->retired;
+   sh->retired = NULL;
+
+   pthread_mutex_unlock(&sh->lock);
+
+   if (da_count(retired)) {
+      em_i_casa_sync(c);
+
+      for (size_t r = 0; r < da_count(retired); r++)
+         free(retired[r]);
+   }
+   da_free(retired);
+
+   return stat;
+}
@@ -0,0 +1,268 @@
+#include "../include/cuckoo.h"
+
+#include <string.h>
+#include <xxhash.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "../include/mt19937-64.h"
+
+#define EM_CUCKOO_KICKS 500 /* Displacements tried before an insert gives up */
+#define EM_CUCKOO_FILL 95 /* Percent of slots filled at the sized capacity */
+
+#define I_CKMASK(t) ((t)->buckets - 1)
+#define I_CKFP(t, h) ((unsigned int)((h) >> (64 - (t)->fp_bits)) ?: 1)
+#define I_CKALT(t, b, fp) (((b) ^ (size_t)(fp)*0x5BD1E995UL) & I_CKMASK(t))
+#define I_CKBUCKET(t) (EM_CUCKOO_SLOTS * (t)->fp_bits / 8)
+
+static inline unsigned int em_i_cuckoo_get(const em_cuckoo_t *target,
+                                           size_t bucket, unsigned int slot);
+static inline void em_i_cuckoo_put(em_cuckoo_t *target, size_t bucket,
+                                   unsigned int slot, unsigned int fp);
+static inline int em_i_cuckoo_find(const em_cuckoo_t *target, size_t b1,
+                                   size_t b2, unsigned int fp);
+
+em_status_t em_cuckoo_mk(em_cuckoo_t *target, size_t capacity)
+{
+   return em_cuckoo_mkf(target, capacity, 16);
+}
+
+em_status_t em_cuckoo_mkf(em_cuckoo_t *target, size_t capacity,
+                          unsigned int fp_bits)
+{
+   return em_cuckoo_mka(target, capacity, fp_bits, NULL);
+}
+
+em_status_t em_cuckoo_mka(em_cuckoo_t *target, size_t capacity,
+                          unsigned int fp_bits, const em_alloc_t *allocator)
+{
+   /* Sized so that capacity entries leave the filter at most EM_CUCKOO_FILL
+    * percent full, past which inserts start needing long chains of kicks. */
+
+   if (fp_bits != 8 && fp_bits != 16)
+      return EM_INVALID_TYPE;
+
+   size_t need = capacity * 100 / (EM_CUCKOO_SLOTS * EM_CUCKOO_FILL) + 1;
+   size_t buckets = 2;
+
+   while (buckets < need)
+      buckets <<= 1;
+
+   *target = (em_cuckoo_t){ .buckets = buckets, .fp_bits = fp_bits };
+   target->mi = allocator ? allocator : EM_GLOBAL_ALLOC;
+
+   target->table = target->mi->realloc(target->mi->udata, NULL,
+                                       em_cuckoo_bytes(target));
+   if (!target->table)
+      return EM_OUT_OF_MEMORY;
+   memset(target->table, 0, em_cuckoo_bytes(target));
+
+   em_mt_init_basic(&em_mt19937_global, true);
+   target->seed = em_mt_genrand64_int64(&em_mt19937_global);
+
+   return EM_STATUS_OKAY;
+}
+
+unsigned long long em_cuckoo_hash(const em_cuckoo_t *target, const void *data,
+                                  size_t size)
+{
+   return XXH3_64bits_withSeed(data, size, (XXH64_hash_t)target->seed);
+}
+
+em_status_t em_cuckoo_addh(em_cuckoo_t *target, unsigned long long hash)
+{
+   /* If neither bucket has room, a fingerprint is evicted from one of them
+    * and moved to its own other bucket, which may evict another, and so on.
+    * Nothing is ever dropped: once the kicks run out, the fingerprint still
+    * being carried becomes the victim. A full filter turns inserts away
+    * before changing anything. */
+
+   if (target->victim_fp)
+      return EM_CF_FAILURE;
+
+   unsigned int fp = I_CKFP(target, hash);
+   size_t b1 = hash & I_CKMASK(target), b2 = I_CKALT(target, b1, fp);
+   int lane = em_i_cuckoo_find(target, b1, b2, 0);
+
+   target->count++;
+
+   if (lane >= 0) {
+      em_i_cuckoo_put(target, lane < EM_CUCKOO_SLOTS ? b1 : b2,
+                      lane % EM_CUCKOO_SLOTS, fp);
+      return EM_STATUS_OKAY;
+   }
+
+   /* Victims are picked at random, as a fixed choice tends to run round in
+    * circles between the same few buckets */
+   unsigned long long r = hash;
+   size_t b = fp & 1 ? b1 : b2;
+
+   for (unsigned int kick = 0; kick < EM_CUCKOO_KICKS; kick++) {
+      r = r * 6364136223846793005ULL + 1442695040888963407ULL;
+
+      unsigned int slot = r >> 62;
+      unsigned int evicted = em_i_cuckoo_get(target, b, slot);
+
+      em_i_cuckoo_put(target, b, slot, fp);
+      fp = evicted;
+      b = I_CKALT(target, b, fp);
+
+      if ((lane = em_i_cuckoo_find(target, b, b, 0)) >= 0) {
+         em_i_cuckoo_put(target, b, lane % EM_CUCKOO_SLOTS, fp);
+         return EM_STATUS_OKAY;
+      }
+   }
+
+   target->victim_bucket = b;
+   target->victim_fp = fp;
+
+   return EM_STATUS_OKAY;
+}
+
+bool em_cuckoo_inh(const em_cuckoo_t *target, unsigned long long hash)
+{
+   unsigned int fp = I_CKFP(target, hash);
+   size_t b1 = hash & I_CKMASK(target), b2 = I_CKALT(target, b1, fp);
+
+   return em_i_cuckoo_find(target, b1, b2, fp) >= 0 ||
+          (target->victim_fp == fp &&
+           (target->victim_bucket == b1 || target->victim_bucket == b2));
+}
+
+em_status_t em_cuckoo_delh(em_cuckoo_t *target, unsigned long long hash)
+{
+   unsigned int fp = I_CKFP(target, hash);
+   size_t b1 = hash & I_CKMASK(target), b2 = I_CKALT(target, b1, fp);
+   int lane = em_i_cuckoo_find(target, b1, b2, fp);
+
+   if (lane >= 0) {
+      em_i_cuckoo_put(target, lane < EM_CUCKOO_SLOTS ? b1 : b2,
+                      lane % EM_CUCKOO_SLOTS, 0);
+   } else if (target->victim_fp == fp && (target->victim_bucket == b1 ||
+                                          target->victim_bucket == b2)) {
+      target->victim_fp = 0;
+   } else {
+      return EM_EL_NOT_FOUND;
+   }
+
+   target->count--;
+
+   /* The freed slot may be just what the victim was waiting for */
+   if (target->victim_fp) {
+      size_t vb = target->victim_bucket;
+      size_t va = I_CKALT(target, vb, target->victim_fp);
+
+      if ((lane = em_i_cuckoo_find(target, vb, va, 0)) >= 0) {
+         em_i_cuckoo_put(target, lane < EM_CUCKOO_SLOTS ? vb : va,
+                         lane % EM_CUCKOO_SLOTS, target->victim_fp);
+         target->victim_fp = 0;
+      }
+   }
+
+   return EM_STATUS_OKAY;
+}
+
+void em_cuckoo_prefetch(const em_cuckoo_t *target, unsigned long long hash)
+{
+   unsigned int fp = I_CKFP(target, hash);
+   size_t b1 = hash & I_CKMASK(target), b2 = I_CKALT(target, b1, fp);
+
+   __builtin_prefetch((char *)target->table + b1 * I_CKBUCKET(target));
+   __builtin_prefetch((char *)target->table + b2 * I_CKBUCKET(target));
+}
+
+em_status_t em_cuckoo_add(em_cuckoo_t *target, const void *data, size_t size)
+{
+   return em_cuckoo_addh(target, em_cuckoo_hash(target, data, size));
+}
+
+bool em_cuckoo_in(const em_cuckoo_t *target, const void *data, size_t size)
+{
+   return em_cuckoo_inh(target, em_cuckoo_hash(target, data, size));
+}
+
+em_status_t em_cuckoo_del(em_cuckoo_t *target, const void *data, size_t size)
+{
+   return em_cuckoo_delh(target, em_cuckoo_hash(target, data, size));
+}
+
+size_t em_cuckoo_bytes(const em_cuckoo_t *target)
+{
+   return target->buckets * I_CKBUCKET(target);
+}
+
+void em_cuckoo_empty(em_cuckoo_t *target)
+{
+   memset(target->table, 0, em_cuckoo_bytes(target));
+   target->count = 0;
+   target->victim_fp = 0;
+}
+
+void em_cuckoo_free(em_cuckoo_t *target)
+{
+   if (target->table)
+      target->mi->free(target->mi->udata, target->table);
+}
+
+static inline unsigned int em_i_cuckoo_get(const em_cuckoo_t *target,
+                                           size_t bucket, unsigned int slot)
+{
+   size_t x = bucket * EM_CUCKOO_SLOTS + slot;
+
+   return target->fp_bits == 8 ? ((const uint8_t *)target->table)[x] :
+                                 ((const uint16_t *)target->table)[x];
+}
+
+static inline void em_i_cuckoo_put(em_cuckoo_t *target, size_t bucket,
+                                   unsigned int slot, unsigned int fp)
+{
+   size_t x = bucket * EM_CUCKOO_SLOTS + slot;
+
+   if (target->fp_bits == 8)
+      ((uint8_t *)target->table)[x] = fp;
+   else
+      ((uint16_t *)target->table)[x] = fp;
+}
+
+static inline int em_i_cuckoo_find(const em_cuckoo_t *target, size_t b1,
+                                   size_t b2, unsigned int fp)
+{
+   /* Returns the first slot across both buckets holding fp, numbered on from
+    * b1's into b2's, or -1. An fp of 0 finds a free slot. */
+
+#ifdef __SSE2__
+   const char *t = target->table;
+   unsigned int m;
+
+   if (target->fp_bits == 8) {
+      uint32_t w1, w2;
+
+      memcpy(&w1, t + b1 * sizeof(w1), sizeof(w1));
+      memcpy(&w2, t + b2 * sizeof(w2), sizeof(w2));
+
+      m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set_epi32(0, 0, w2, w1),
+                                           _mm_set1_epi8((char)fp))) &
+          0xFF;
+
+      return m ? __builtin_ctz(m) : -1;
+   }
+
+   uint64_t w1, w2;
+
+   memcpy(&w1, t + b1 * sizeof(w1), sizeof(w1));
+   memcpy(&w2, t + b2 * sizeof(w2), sizeof(w2));
+
+   m = _mm_movemask_epi8(_mm_cmpeq_epi16(_mm_set_epi64x(w2, w1),
+                                         _mm_set1_epi16((short)fp)));
+
+   return m ? __builtin_ctz(m) / 2 : -1;
+#else
+   for (unsigned int x = 0; x < EM_CUCKOO_SLOTS * 2; x++)
+      if (em_i_cuckoo_get(target, x < EM_CUCKOO_SLOTS ? b1 : b2,
+                          x % EM_CUCKOO_SLOTS) == fp)
+         return x;
+
+   return -1;
+#endif
+}
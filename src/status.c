@@ -31,6 +31,12 @@ const char *em_status_str(em_status_t status_code)
       return "Critical Cuckoo Filter failure! (May be memory-related?)";
    case EM_INIT_FAILURE:
       return "Failed to initialize an object. Likely a memory issue.";
+   case EM_IO_FAILURE:
+      return "Failed to read or write a file.";
+   case EM_BAD_IMAGE:
+      return "Image is corrupt, truncated or from an incompatible build!";
+   case EM_READ_ONLY:
+      return "Tried to modify a read-only object!";
    default:
       return "Unknown error - no defined string form!";
    }
@@ -0,0 +1,13 @@
+#include "../include/tassoca.h"
+
+#include "../include/mt19937-64.h"
+
+unsigned long long em_i_tasa_seed(void)
+{
+   /* Everything else is generated inline into the user's code; only the seed
+    * needs the shared generator. */
+
+   em_mt_init_basic(&em_mt19937_global, true);
+
+   return em_mt_genrand64_int64(&em_mt19937_global);
+}
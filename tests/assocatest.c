@@ -1,8 +1,216 @@
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "../include/assoca.h"
 
+static long live_blocks;
+
+static void *track_realloc(void *udata, void *ptr, size_t size)
+{
+   void *fresh = realloc(ptr, size);
+
+   if (!ptr && fresh)
+      (*(long *)udata)++;
+
+   return fresh;
+}
+
+static void track_free(void *udata, void *ptr)
+{
+   if (ptr)
+      (*(long *)udata)--;
+
+   free(ptr);
+}
+
+static const em_alloc_t tracker = { .udata = &live_blocks,
+                                    .realloc = track_realloc,
+                                    .free = track_free };
+
+struct walk_s {
+   int *table;
+   long count[4];
+   long long sum[4];
+};
+
+static void walk_one(long idx, unsigned int t, void *ctx)
+{
+   struct walk_s *w = ctx;
+
+   w->count[t]++;
+   w->sum[t] += *aa_idxtoptr(w->table, idx);
+}
+
+#define MKCRCW 40 /* Words per colliding key, 32 of them pinned down */
+#define MKCRCEL (1 << (MKCRCW - 32))
+
+static uint32_t crc32c_top(unsigned int words)
+{
+   /* The contribution to a raw CRC32C lane of a word's top bit with words - 1
+    * words still to come after it, bit by bit */
+
+   uint32_t crc = 0;
+
+   for (unsigned int b = 0; b < words * 64; b++)
+      crc = (crc ^ (b == 63)) & 1 ? crc >> 1 ^ 0x82F63B78 : crc >> 1;
+
+   return crc;
+}
+
+static void crc_colliders(unsigned char keys[MKCRCEL][MKCRCW * 8])
+{
+   /* Keys that two CRC32C lanes fed raw words, one of them multiplied by an
+    * odd constant, take to the same state under any seed: flipping a word's
+    * top bit flips the product's too, and CRC is linear, so the sets of top
+    * bits whose contributions cancel out come from eliminating over them */
+
+   uint32_t basis[32] = { 0 };
+   uint64_t bmask[32] = { 0 }, kernel[MKCRCW - 32];
+   unsigned int found = 0;
+
+   for (unsigned int w = 0; w < MKCRCW; w++) {
+      uint32_t v = crc32c_top(MKCRCW - w);
+      uint64_t m = 1ULL << w;
+
+      for (int b = 31; b >= 0 && v; b--) {
+         if (!(v >> b & 1))
+            continue;
+         if (!basis[b]) {
+            basis[b] = v;
+            bmask[b] = m;
+            v = 0;
+            m = 0;
+            break;
+         }
+         v ^= basis[b];
+         m ^= bmask[b];
+      }
+
+      if (m && found < MKCRCW - 32)
+         kernel[found++] = m;
+   }
+
+   for (unsigned int k = 0; k < MKCRCEL; k++) {
+      uint64_t flips = 0;
+
+      for (unsigned int b = 0; b < found; b++)
+         if (k >> b & 1)
+            flips ^= kernel[b];
+
+      memset(keys[k], 'k', MKCRCW * 8);
+      for (unsigned int w = 0; w < MKCRCW; w++)
+         if (flips >> w & 1)
+            keys[k][w * 8 + 7] ^= 0x80;
+   }
+}
+
+#define MKSNAPEL 20000
+
+static void *snap_reader(void *snap)
+{
+   /* Reads every element of a snapshot taken after the table was first
+    * rewritten, as in snap_round */
+
+   int *later = snap;
+
+   for (unsigned int x = 0; x < MKSNAPEL * 4; x++) {
+      int *now = aa_getptr(later, aa_vh(later, x));
+
+      if (!now != (x < MKSNAPEL && x % 3 == 0) ||
+          (now && *now != (x >= MKSNAPEL   ? (int)x :
+                           x % 3 == 1      ? -(int)x :
+                                             (int)x + MKSNAPEL)))
+         return NULL;
+   }
+
+   return snap;
+}
+
+static bool snap_round(unsigned int flags)
+{
+   /* Snapshots have to go on showing the table as it was through updates,
+    * deletes, writes through value pointers and growth, and outlive it */
+
+   int *live = aa_make_opts(int, EM_ASA_HASH_XXH128, EM_ASA_SNAPSHOTS | flags);
+   int *snap = NULL, *later = NULL;
+   unsigned int x;
+
+   if (!live)
+      return false;
+
+   for (x = 0; x < MKSNAPEL; x++)
+      if (aa_set(live, aa_vh(live, x), (int)x) != EM_STATUS_OKAY)
+         return false;
+
+   if (aa_snapshot(live, snap) != EM_STATUS_OKAY)
+      return false;
+
+   for (x = 0; x < MKSNAPEL; x++) {
+      if (x % 3 == 0)
+         aa_del(live, aa_vh(live, x));
+      else if (x % 3 == 1)
+         aa_set(live, aa_vh(live, x), -(int)x);
+      else
+         *aa_getptr(live, aa_vh(live, x)) += MKSNAPEL;
+   }
+
+   for (x = MKSNAPEL; x < MKSNAPEL * 4; x++)
+      aa_set(live, aa_vh(live, x), (int)x);
+
+   if (aa_snapshot(live, later) != EM_STATUS_OKAY)
+      return false;
+
+   aa_set(live, aa_vh(live, 1), 1);
+   aa_free(live);
+
+   long walked = 0;
+   aa_foreach(snap, idx)
+      walked++;
+
+   if (aa_count(snap) != MKSNAPEL || walked != MKSNAPEL ||
+       !aa_snapshot_ok(snap) || !aa_snapshot_ok(later) ||
+       aa_set(snap, aa_vh(snap, 0), 1) != EM_READ_ONLY)
+      return false;
+
+   /* Two threads reading one snapshot at once leave it as it was, lookup
+    * counts included */
+   pthread_t readers[2];
+   void *read[2];
+   unsigned long lookups = __em_i_asa_hcast(later)->lookups;
+
+   for (x = 0; x < 2; x++)
+      if (pthread_create(&readers[x], NULL, snap_reader, later) != 0)
+         return false;
+   for (x = 0; x < 2; x++)
+      pthread_join(readers[x], &read[x]);
+
+   if (read[0] != later || read[1] != later ||
+       __em_i_asa_hcast(later)->lookups != lookups)
+      return false;
+
+   for (x = 0; x < MKSNAPEL * 4; x++) {
+      int *was = aa_getptr(snap, aa_vh(snap, x));
+      int *now = aa_getptr(later, aa_vh(later, x));
+      int want = x >= MKSNAPEL   ? (int)x :
+                 x % 3 == 1      ? -(int)x :
+                                   (int)x + MKSNAPEL;
+
+      if (!was != (x >= MKSNAPEL) || (was && *was != (int)x) ||
+          !now != (x < MKSNAPEL && x % 3 == 0) || (now && *now != want))
+         return false;
+   }
+
+   aa_free(snap);
+   aa_free(later);
+
+   return true;
+}
+
 int main(void)
 {
    em_status_t ts;
@@ -56,6 +264,119 @@ int main(void)
       }
    }
 
+   /* Mostly ask for absent keys, so the rebuilt table gets a bloom filter.
+    * The slab it has now was made before any lookups, and gets one too. */
+   struct em_asa_hdr_s *stuffh = __em_i_asa_hcast(stuff);
+
+   for (x = MKSPAMEL; x < MKSPAMEL * 9; x++) {
+      if (aa_in(stuff, aa_vh(stuff, x))) {
+         printf("%u found but never set!\n", x);
+         return EXIT_FAILURE;
+      }
+   }
+
+   if (!stuffh->cur.bloom.filter) {
+      printf("Table asked for absent keys got no bloom filter!\n");
+      return EXIT_FAILURE;
+   }
+
+   if ((ts = aa_egc(stuff)) != EM_STATUS_OKAY) {
+      printf("Table could not be reformed! (%s)\n", em_status_str(ts));
+      return EXIT_FAILURE;
+   }
+
+   for (x = 0; x < MKSPAMEL; x++) {
+      if (aa_get(stuff, aa_vh(stuff, x)) != (signed int)(x + 1)) {
+         printf("Spam elements were not valid after reform!\n");
+         return EXIT_FAILURE;
+      }
+   }
+
+   struct em_asa_stats_s st;
+   unsigned long hsum = 0;
+
+   aa_stats(stuff, &st);
+   for (x = 0; x < EM_ASA_STATS_HIST; x++)
+      hsum += st.probe_hist[x];
+
+   if (st.elements != aa_count(stuff) ||
+       st.cur.live + st.old.live != st.elements || hsum != st.elements ||
+       st.cur.load <= 0 || st.cur.load > 1 || st.probe_mean < 1 ||
+       st.bytes < st.elements * sizeof(int) || !st.counters.grows ||
+       !st.counters.reforms ||
+       st.counters.bloom_rejects + st.counters.bloom_false_positives >
+          st.counters.bloom_queries) {
+      printf("Table stats were not valid!\n");
+      return EXIT_FAILURE;
+   }
+
+   /* The run of hits above has made the filter go, and misses bring it
+    * back, built from the ids already in the slab */
+   stuffh = __em_i_asa_hcast(stuff);
+   bool dropped = !stuffh->cur.bloom.filter;
+
+   for (x = MKSPAMEL * 9; x < MKSPAMEL * 10; x++) {
+      if (aa_in(stuff, aa_vh(stuff, x))) {
+         printf("%u found but never set!\n", x);
+         return EXIT_FAILURE;
+      }
+   }
+
+   if (!dropped || !stuffh->cur.bloom.filter) {
+      printf("Bloom filter did not follow the miss rate!\n");
+      return EXIT_FAILURE;
+   }
+
+   /* A sample, few enough that the filter stays */
+   for (x = 0; x < MKSPAMEL; x += 331) {
+      if (!aa_in(stuff, aa_vh(stuff, x))) {
+         printf("Rebuilt bloom filter lost %u!\n", x);
+         return EXIT_FAILURE;
+      }
+   }
+
+#define MKBATCHEL 100
+
+   em_asa_id_t bids[MKBATCHEL];
+   int *bptrs[MKBATCHEL];
+
+   for (x = 0; x < MKBATCHEL; x++)
+      bids[x] = aa_vh(stuff, x * 601 + (x & 1 ? MKSPAMEL : 0));
+
+   if (aa_get_many(stuff, bids, MKBATCHEL, bptrs) != MKBATCHEL / 2) {
+      printf("Batched lookup found the wrong amount of elements!\n");
+      return EXIT_FAILURE;
+   }
+
+   for (x = 0; x < MKBATCHEL; x++) {
+      if ((x & 1) != !bptrs[x] ||
+          (bptrs[x] && *bptrs[x] != (signed int)(x * 601 + 1))) {
+         printf("Batched lookup mismatch at %u!\n", x);
+         return EXIT_FAILURE;
+      }
+   }
+
+   /* Batched lookups ask the prefilter once per key, and each absent key
+    * is either turned away by it or a false positive */
+   struct em_asa_stats_s bst;
+   long bidx[MKBATCHEL];
+
+   aa_stats(stuff, &st);
+   aa_idtoidx_many(stuff, bids, MKBATCHEL, bidx);
+   aa_stats(stuff, &bst);
+
+   unsigned long bmissed =
+      bst.counters.bloom_rejects - st.counters.bloom_rejects +
+      bst.counters.bloom_false_positives - st.counters.bloom_false_positives;
+
+   if (bst.counting &&
+       (bst.counters.bloom_queries - st.counters.bloom_queries != MKBATCHEL ||
+        bmissed != MKBATCHEL / 2 ||
+        bst.counters.bloom_rejects == st.counters.bloom_rejects)) {
+      printf("Batched lookup miscounted the prefilter!\n");
+      return EXIT_FAILURE;
+   }
+
    for (x = 0; x < MKSPAMEL; x++) {
       if ((ts = aa_del(stuff, aa_vh(stuff, x))) != EM_STATUS_OKAY) {
          printf("Spam elements could not be deleted! (%u, %s)\n", x,
@@ -73,7 +394,664 @@ int main(void)
 
    aa_del(stuff, aa_sh(stuff, "EL01"));
 
+   if ((ts = aa_reserve(stuff, MKSPAMEL)) != EM_STATUS_OKAY) {
+      printf("Could not reserve spam elements! (%s)\n", em_status_str(ts));
+      return EXIT_FAILURE;
+   }
+
+   for (x = 0; x < MKSPAMEL; x++) {
+      if ((ts = aa_set(stuff, aa_vh(stuff, x), x + 2)) != EM_STATUS_OKAY) {
+         printf("Reserved elements could not be set! (%s)\n",
+                em_status_str(ts));
+         return EXIT_FAILURE;
+      }
+   }
+
+   for (x = 0; x < MKSPAMEL; x++) {
+      if (aa_get(stuff, aa_vh(stuff, x)) != (signed int)(x + 2)) {
+         printf("Reserved elements were not valid!\n");
+         return EXIT_FAILURE;
+      }
+   }
+
+   aa_del(stuff, aa_vh(stuff, 7));
+
+   char ipath[] = "/tmp/assocatest-XXXXXX";
+   int ifd = mkstemp(ipath);
+   if (ifd < 0) {
+      printf("Could not create an image file!\n");
+      return EXIT_FAILURE;
+   }
+   close(ifd);
+
+   if ((ts = aa_save(stuff, ipath)) != EM_STATUS_OKAY) {
+      printf("Table could not be saved! (%s)\n", em_status_str(ts));
+      return EXIT_FAILURE;
+   }
+
+   for (unsigned int mode = 0; mode < 2; mode++) {
+      int *mapped = NULL;
+
+      if ((ts = aa_map(mapped, ipath,
+                       EM_ASA_MAP_VERIFY | (mode ? EM_ASA_MAP_WRITABLE : 0))) !=
+          EM_STATUS_OKAY) {
+         printf("Image could not be mapped! (%s)\n", em_status_str(ts));
+         return EXIT_FAILURE;
+      }
+
+      for (x = 0; x < MKSPAMEL; x++) {
+         if (aa_in(mapped, aa_vh(mapped, x)) != (x != 7) ||
+             (x != 7 &&
+              aa_get(mapped, aa_vh(mapped, x)) != (signed int)(x + 2))) {
+            printf("Mapped elements were not valid!\n");
+            return EXIT_FAILURE;
+         }
+      }
+
+      if (!mode && aa_set(mapped, aa_vh(mapped, 7), 9) != EM_READ_ONLY) {
+         printf("Read-only mapped table could be modified!\n");
+         return EXIT_FAILURE;
+      }
+
+      /* Writable maps are private, enough sets to grow out of the image */
+      for (x = 0; mode && x < MKSPAMEL * 2; x++) {
+         if ((ts = aa_set(mapped, aa_vh(mapped, x), x)) != EM_STATUS_OKAY ||
+             aa_get(mapped, aa_vh(mapped, x)) != (signed int)x) {
+            printf("Writable mapped table could not be modified! (%s)\n",
+                   em_status_str(ts));
+            return EXIT_FAILURE;
+         }
+      }
+
+      aa_free(mapped);
+   }
+
+   /* The writable map must not have touched the image */
+   int *remapped = NULL;
+   if (aa_map(remapped, ipath, EM_ASA_MAP_VERIFY) != EM_STATUS_OKAY ||
+       aa_in(remapped, aa_vh(remapped, 7))) {
+      printf("Image changed after a writable map!\n");
+      return EXIT_FAILURE;
+   }
+   aa_free(remapped);
+
+   FILE *ifile = fopen(ipath, "r+b");
+   if (!ifile || fseek(ifile, -1, SEEK_END) != 0) {
+      printf("Could not reopen the image file!\n");
+      return EXIT_FAILURE;
+   }
+   int lastc = fgetc(ifile);
+   fseek(ifile, -1, SEEK_END);
+   fputc(lastc ^ 0x5A, ifile);
+   fclose(ifile);
+
+   if (aa_map(remapped, ipath, EM_ASA_MAP_VERIFY) != EM_BAD_IMAGE) {
+      printf("Corrupt image was mapped!\n");
+      return EXIT_FAILURE;
+   }
+
+   unlink(ipath);
+
+   /* Publishing to shared memory, read back from another process */
+   char sname[64];
+   int *shared = NULL;
+   snprintf(sname, sizeof(sname), "/assocatest-%d", (int)getpid());
+
+   if (aa_attach(shared, sname) != EM_IO_FAILURE) {
+      printf("Attached to a table that was never published!\n");
+      return EXIT_FAILURE;
+   }
+
+   if ((ts = aa_publish(stuff, sname)) != EM_STATUS_OKAY) {
+      printf("Table could not be published! (%s)\n", em_status_str(ts));
+      return EXIT_FAILURE;
+   }
+
+   pid_t child = fork();
+   if (child == 0) {
+      if (aa_attach(shared, sname) != EM_STATUS_OKAY)
+         _exit(1);
+      for (x = 0; x < MKSPAMEL; x++)
+         if (aa_in(shared, aa_vh(shared, x)) != (x != 7))
+            _exit(2);
+      aa_free(shared);
+      _exit(0);
+   }
+
+   int wstat;
+   if (child < 0 || waitpid(child, &wstat, 0) != child ||
+       !WIFEXITED(wstat) || WEXITSTATUS(wstat) != 0) {
+      printf("Published table was not valid in another process!\n");
+      return EXIT_FAILURE;
+   }
+
+   if ((ts = aa_attach(shared, sname)) != EM_STATUS_OKAY ||
+       aa_set(shared, aa_vh(shared, 7), 9) != EM_READ_ONLY) {
+      printf("Published table could not be attached! (%s)\n",
+             em_status_str(ts));
+      return EXIT_FAILURE;
+   }
+
+   /* Readers only see a new generation once they refresh */
+   aa_set(stuff, aa_vh(stuff, 7), 9);
+   if ((ts = aa_publish(stuff, sname)) != EM_STATUS_OKAY ||
+       aa_in(shared, aa_vh(shared, 7)) ||
+       (ts = aa_refresh(shared)) != EM_STATUS_OKAY ||
+       aa_get(shared, aa_vh(shared, 7)) != 9 ||
+       aa_count(shared) != aa_count(stuff)) {
+      printf("Published table did not refresh! (%s)\n", em_status_str(ts));
+      return EXIT_FAILURE;
+   }
+
+   aa_unpublish(sname);
+   if (aa_get(shared, aa_vh(shared, 7)) != 9 ||
+       aa_refresh(shared) != EM_STATUS_OKAY ||
+       aa_refresh(stuff) != EM_INVALID_TYPE) {
+      printf("Attached table did not survive unpublishing!\n");
+      return EXIT_FAILURE;
+   }
+   aa_free(shared);
+
    aa_free(stuff);
 
+#define MKLONGKEY "a key well past the length stored verbatim in an id"
+
+   enum em_asa_hash_e hashes[] = { EM_ASA_HASH_XXH64, EM_ASA_HASH_INT,
+                                   EM_ASA_HASH_CRC32C };
+
+   for (unsigned int h = 0; h < sizeof(hashes) / sizeof(*hashes); h++) {
+      int *hashed = aa_make_hashed(int, hashes[h]);
+      if (!hashed) {
+         printf("Allocation failure!\n");
+         return EXIT_FAILURE;
+      }
+
+      for (x = 0; x < MKSPAMEL; x++) {
+         if ((ts = aa_set(hashed, aa_vh(hashed, x), x)) != EM_STATUS_OKAY) {
+            printf("Hash %u elements could not be set! (%s)\n", h,
+                   em_status_str(ts));
+            return EXIT_FAILURE;
+         }
+      }
+
+      aa_set(hashed, aa_sh(hashed, MKLONGKEY), -1);
+
+      for (x = 0; x < MKSPAMEL; x++) {
+         if (aa_get(hashed, aa_vh(hashed, x)) != (signed int)x ||
+             aa_in(hashed, aa_vh(hashed, x + MKSPAMEL))) {
+            printf("Hash %u elements were not valid!\n", h);
+            return EXIT_FAILURE;
+         }
+      }
+
+      if (aa_get(hashed, aa_sh(hashed, MKLONGKEY)) != -1) {
+         printf("Hash %u long key was not valid!\n", h);
+         return EXIT_FAILURE;
+      }
+
+      aa_free(hashed);
+   }
+
+   /* Keys a seeded but linear CRC can't tell apart mustn't overwrite each
+    * other */
+   static unsigned char crckeys[MKCRCEL][MKCRCW * 8];
+   int *crc = aa_make_hashed(int, EM_ASA_HASH_CRC32C);
+   if (!crc) {
+      printf("Allocation failure!\n");
+      return EXIT_FAILURE;
+   }
+
+   crc_colliders(crckeys);
+   for (x = 0; x < MKCRCEL; x++)
+      aa_set(crc, aa_bh(crc, crckeys[x], sizeof(crckeys[x])), x);
+
+   if (aa_count(crc) != MKCRCEL) {
+      printf("CRC-colliding keys overwrote each other! (%zu left)\n",
+             (size_t)aa_count(crc));
+      return EXIT_FAILURE;
+   }
+
+   for (x = 0; x < MKCRCEL; x++) {
+      if (aa_get(crc, aa_bh(crc, crckeys[x], sizeof(crckeys[x]))) !=
+          (signed int)x) {
+         printf("CRC-colliding key %u was not valid!\n", x);
+         return EXIT_FAILURE;
+      }
+   }
+
+   aa_free(crc);
+
+   int *tracked = aa_make_alloc(int, EM_ASA_HASH_XXH128, 0, &tracker);
+   if (!tracked || !live_blocks) {
+      printf("Allocation failure!\n");
+      return EXIT_FAILURE;
+   }
+
+   for (x = 0; x < MKSPAMEL; x++)
+      aa_set(tracked, aa_vh(tracked, x), x);
+   for (x = 0; x < MKSPAMEL; x += 2)
+      aa_del(tracked, aa_vh(tracked, x));
+   aa_egc(tracked);
+
+   for (x = 0; x < MKSPAMEL; x++) {
+      if (aa_in(tracked, aa_vh(tracked, x)) != (x & 1)) {
+         printf("Elements with a custom allocator were not valid!\n");
+         return EXIT_FAILURE;
+      }
+   }
+
+   aa_free(tracked);
+
+   if (live_blocks) {
+      printf("Custom allocator was left with %ld blocks!\n", live_blocks);
+      return EXIT_FAILURE;
+   }
+
+   /* Big enough that displaced values don't fit in the on-stack carry */
+   struct bigel {
+      unsigned int v;
+      char pad[300];
+   } *robin = aa_make_opts(struct bigel, EM_ASA_HASH_XXH128, EM_ASA_ROBIN_HOOD);
+   if (!robin) {
+      printf("Allocation failure!\n");
+      return EXIT_FAILURE;
+   }
+
+   for (x = 0; x < MKSPAMEL; x++) {
+      struct bigel el = { .v = x, .pad = { (char)x } };
+
+      if ((ts = aa_set(robin, aa_vh(robin, x), el)) != EM_STATUS_OKAY) {
+         printf("Robin Hood elements could not be set! (%s)\n",
+                em_status_str(ts));
+         return EXIT_FAILURE;
+      }
+   }
+
+   for (x = 0; x < MKSPAMEL; x += 2)
+      aa_del(robin, aa_vh(robin, x));
+
+   for (unsigned int pass = 0; pass < 2; pass++) {
+      for (x = 0; x < MKSPAMEL * 2; x++) {
+         struct bigel *el = aa_getptr(robin, aa_vh(robin, x));
+
+         if (!el != !(x & 1 && x < MKSPAMEL) ||
+             (el && (el->v != x || el->pad[0] != (char)x))) {
+            printf("Robin Hood element %u was not valid!\n", x);
+            return EXIT_FAILURE;
+         }
+      }
+
+      aa_stats(robin, &st);
+      if (st.cur.tombstones || st.cur.load > 7.0 / 8.0) {
+         printf("Robin Hood table left tombstones or overfilled!\n");
+         return EXIT_FAILURE;
+      }
+
+      aa_egc(robin);
+   }
+
+   aa_free(robin);
+
+   int *churn = aa_make_opts(int, EM_ASA_HASH_XXH128, EM_ASA_CUCKOO_FILTER);
+   if (!churn) {
+      printf("Allocation failure!\n");
+      return EXIT_FAILURE;
+   }
+
+   for (x = 0; x < MKSPAMEL; x++)
+      aa_set(churn, aa_vh(churn, x), x);
+
+   /* Enough misses for the rebuilt slab to get its prefilter */
+   for (x = MKSPAMEL; x < MKSPAMEL * 9; x++)
+      aa_idtoidx(churn, aa_vh(churn, x));
+   aa_egc(churn);
+
+   /* Turn the whole key range over, twice */
+   for (x = 0; x < MKSPAMEL * 2; x++) {
+      aa_del(churn, aa_vh(churn, x));
+      aa_set(churn, aa_vh(churn, x + MKSPAMEL), x);
+   }
+
+   /* Deletes have to have taken their ids back out of the filter */
+   struct em_asa_hdr_s *churnh = __em_i_asa_hcast(churn);
+   if (!churnh->cur.cuckoo.table || churnh->old.ctrl ||
+       churnh->cur.cuckoo.count != aa_count(churn)) {
+      printf("Cuckoo prefilter was missing or out of step!\n");
+      return EXIT_FAILURE;
+   }
+
+   for (x = 0; x < MKSPAMEL * 3; x++) {
+      if (aa_in(churn, aa_vh(churn, x)) != (x >= MKSPAMEL * 2) ||
+          (x >= MKSPAMEL * 2 &&
+           aa_get(churn, aa_vh(churn, x)) != (signed int)(x - MKSPAMEL))) {
+         printf("Cuckoo-filtered element %u was not valid!\n", x);
+         return EXIT_FAILURE;
+      }
+   }
+
+   if (aa_set_ttl(churn, aa_vh(churn, 0), 0, 1) != EM_INVALID_TYPE) {
+      printf("Non-cache table took a TTL!\n");
+      return EXIT_FAILURE;
+   }
+
+   aa_free(churn);
+
+   int *cache = aa_make_opts(int, EM_ASA_HASH_XXH128, EM_ASA_CACHE);
+   if (!cache) {
+      printf("Allocation failure!\n");
+      return EXIT_FAILURE;
+   }
+
+   if (aa_cache(cache, 1000, 0, 0) != EM_STATUS_OKAY ||
+       aa_save(cache, ipath) != EM_INVALID_TYPE ||
+       aa_freeze(cache) != EM_INVALID_TYPE) {
+      printf("Cache table took an invalid operation!\n");
+      return EXIT_FAILURE;
+   }
+
+   for (x = 0; x < 1000; x++)
+      aa_set(cache, aa_vh(cache, x), x);
+
+   /* Keep the first half referenced, so only the rest can go */
+   for (x = 0; x < 500; x++)
+      aa_idtoidx(cache, aa_vh(cache, x));
+
+   for (x = 1000; x < 1100; x++)
+      aa_set(cache, aa_vh(cache, x), x);
+
+   unsigned int kept = 0;
+   for (x = 0; x < 1100; x++) {
+      if (aa_in(cache, aa_vh(cache, x)) &&
+          aa_get(cache, aa_vh(cache, x)) == (signed int)x)
+         kept++;
+      else if (x < 500)
+         break;
+   }
+
+   aa_stats(cache, &st);
+   if (x < 1100 || kept != 1000 || aa_count(cache) != 1000 ||
+       st.counters.evictions != 100 || st.counters.expirations) {
+      printf("Cache evicted the wrong elements! (%u kept)\n", kept);
+      return EXIT_FAILURE;
+   }
+
+   /* A byte budget holds the table to a tier however much goes in */
+   if (aa_cache(cache, 0, 1 << 16, 0) != EM_STATUS_OKAY) {
+      printf("Cache budget could not be set!\n");
+      return EXIT_FAILURE;
+   }
+
+   for (x = 0; x < MKSPAMEL; x++)
+      aa_set(cache, aa_vh(cache, x), x);
+
+   aa_stats(cache, &st);
+   if (aa_count(cache) != __em_i_asa_hcast(cache)->cache.limit ||
+       st.bytes > 2 << 16 || st.counters.expirations) {
+      printf("Cache outgrew its budget! (%zu bytes)\n", st.bytes);
+      return EXIT_FAILURE;
+   }
+
+   /* Expiries, carried through a reform. Moving the epoch back stands in for
+    * waiting. */
+   aa_empty(cache);
+   aa_cache(cache, 0, 0, 5);
+
+   for (x = 0; x < 200; x++)
+      if ((ts = x < 100 ? aa_set(cache, aa_vh(cache, x), x) :
+                          aa_set_ttl(cache, aa_vh(cache, x), x, 0)) !=
+          EM_STATUS_OKAY) {
+         printf("Cache elements could not be set! (%s)\n", em_status_str(ts));
+         return EXIT_FAILURE;
+      }
+
+   aa_egc(cache);
+   __em_i_asa_hcast(cache)->cache.epoch -= 10;
+
+   for (x = 0; x < 200; x++) {
+      if (aa_in(cache, aa_vh(cache, x)) != (x >= 100)) {
+         printf("Cache element %u expired wrongly!\n", x);
+         return EXIT_FAILURE;
+      }
+   }
+
+   /* The expired ones have to go first */
+   unsigned long evicted = st.counters.evictions;
+
+   aa_cache(cache, 100, 0, 5);
+   aa_stats(cache, &st);
+   if (aa_count(cache) != 100 || st.counters.evictions - evicted != 100 ||
+       st.counters.expirations != 100) {
+      printf("Cache did not evict the expired elements!\n");
+      return EXIT_FAILURE;
+   }
+
+   /* Deleting an expired element frees its slot but finds nothing, as a
+    * lookup would */
+   aa_cache(cache, 0, 0, 5);
+   aa_set(cache, aa_vh(cache, 300), 300);
+   __em_i_asa_hcast(cache)->cache.epoch -= 10;
+
+   if (aa_del(cache, aa_vh(cache, 300)) != EM_EL_NOT_FOUND ||
+       aa_count(cache) != 100 ||
+       aa_del(cache, aa_vh(cache, 300)) != EM_EL_NOT_FOUND ||
+       aa_del(cache, aa_vh(cache, 150)) != EM_STATUS_OKAY ||
+       aa_count(cache) != 99) {
+      printf("Cache deleted an expired element wrongly!\n");
+      return EXIT_FAILURE;
+   }
+
+   aa_free(cache);
+
+   /* Bulk builds, with every key twice, into a table that already has some
+    * of them, and enough of them to be split over a few threads */
+   unsigned int *bkeys = malloc(MKSPAMEL * 2 * sizeof(*bkeys));
+   int *bvals = malloc(MKSPAMEL * 2 * sizeof(*bvals));
+   int *built = aa_make_opts(int, EM_ASA_HASH_XXH128, EM_ASA_ROBIN_HOOD);
+   int *merged = aa_make(int);
+   if (!bkeys || !bvals || !built || !merged) {
+      printf("Allocation failure!\n");
+      return EXIT_FAILURE;
+   }
+
+   for (x = 0; x < MKSPAMEL * 2; x++) {
+      bkeys[x] = x % MKSPAMEL;
+      bvals[x] = x;
+   }
+
+   for (x = 0; x < MKSPAMEL; x += 3)
+      aa_set(built, aa_vh(built, x + MKSPAMEL / 2), -1);
+
+   if ((ts = aa_build(built, bkeys, sizeof(*bkeys), bvals, MKSPAMEL * 2, 4)) !=
+       EM_STATUS_OKAY) {
+      printf("Table could not be built! (%s)\n", em_status_str(ts));
+      return EXIT_FAILURE;
+   }
+
+   if (aa_count(built) != MKSPAMEL + (MKSPAMEL + 1) / 6) {
+      printf("Built table has the wrong amount of elements!\n");
+      return EXIT_FAILURE;
+   }
+
+   for (x = 0; x < MKSPAMEL * 2; x++) {
+      unsigned int pre = x - MKSPAMEL / 2;
+      int want = x < MKSPAMEL                    ? (signed int)(x + MKSPAMEL) :
+                 pre < MKSPAMEL && pre % 3 == 0 ? -1 :
+                                                  0;
+
+      if (aa_in(built, aa_vh(built, x)) != (want != 0) ||
+          (want && aa_get(built, aa_vh(built, x)) != want)) {
+         printf("Built element %u was not valid!\n", x);
+         return EXIT_FAILURE;
+      }
+   }
+
+   /* The tables have different seeds, so merging has to hash again */
+   for (x = 0; x < MKSPAMEL; x += 2)
+      aa_set(merged, aa_vh(merged, x), 1);
+
+   if ((ts = aa_merge(merged, built, 0)) != EM_STATUS_OKAY ||
+       aa_count(merged) != aa_count(built)) {
+      printf("Tables could not be merged! (%s)\n", em_status_str(ts));
+      return EXIT_FAILURE;
+   }
+
+   for (x = 0; x < MKSPAMEL * 2; x++) {
+      int *mv = aa_getptr(merged, aa_vh(merged, x));
+      int *bv = aa_getptr(built, aa_vh(built, x));
+
+      if (!mv != !bv || (mv && *mv != *bv)) {
+         printf("Merged element %u was not valid!\n", x);
+         return EXIT_FAILURE;
+      }
+   }
+
+   /* Long keys that were only kept hashed can't be hashed again */
+   aa_set(built, aa_sh(built, "A key much too long to be kept in its id"), 1);
+   if (aa_merge(merged, built, 0) != EM_INVALID_TYPE ||
+       aa_count(merged) != aa_count(built) - 1) {
+      printf("Merged a key that was lost!\n");
+      return EXIT_FAILURE;
+   }
+
+   /* Walks, on one thread and on a few, have to see each element once */
+   struct walk_s walk = { .table = built };
+   long long want = 1, wsum = 0; /* The long key's value */
+   long walked = 0;
+
+   for (x = 0; x < MKSPAMEL * 2; x++)
+      if (aa_in(built, aa_vh(built, x)))
+         want += aa_get(built, aa_vh(built, x));
+
+   aa_foreach(built, idx) {
+      walked++;
+      wsum += *aa_idxtoptr(built, idx);
+   }
+
+   if (walked != (long)aa_count(built) || wsum != want) {
+      printf("Walking the table did not visit every element once!\n");
+      return EXIT_FAILURE;
+   }
+
+   if ((ts = aa_foreach_par(built, walk_one, &walk, 4)) != EM_STATUS_OKAY) {
+      printf("Table could not be walked! (%s)\n", em_status_str(ts));
+      return EXIT_FAILURE;
+   }
+
+   for (x = 0; x < 4; x++) {
+      walked -= walk.count[x];
+      wsum -= walk.sum[x];
+   }
+
+   if (walked != 0 || wsum != 0) {
+      printf("Walking the table in parallel missed elements!\n");
+      return EXIT_FAILURE;
+   }
+
+   aa_free(built);
+   aa_free(merged);
+   free(bkeys);
+   free(bvals);
+
+   int *exact = aa_make_opts(int, EM_ASA_HASH_XXH128, EM_ASA_EXACT_KEYS);
+   if (!exact) {
+      printf("Allocation failure!\n");
+      return EXIT_FAILURE;
+   }
+
+   char ekey[64];
+
+   for (x = 0; x < MKSPAMEL; x++) {
+      snprintf(ekey, sizeof(ekey), "https://example.com/sessions/%u", x);
+
+      if ((ts = aa_set(exact, aa_sh(exact, ekey), x)) != EM_STATUS_OKAY) {
+         printf("Exact elements could not be set! (%s)\n", em_status_str(ts));
+         return EXIT_FAILURE;
+      }
+   }
+
+   for (x = 0; x < MKSPAMEL; x += 2) {
+      snprintf(ekey, sizeof(ekey), "https://example.com/sessions/%u", x);
+
+      if ((ts = aa_del(exact, aa_sh(exact, ekey))) != EM_STATUS_OKAY) {
+         printf("Exact elements could not be deleted! (%s)\n",
+                em_status_str(ts));
+         return EXIT_FAILURE;
+      }
+   }
+
+   if (aa_egc(exact) != EM_STATUS_OKAY) {
+      printf("Exact table could not be reformed!\n");
+      return EXIT_FAILURE;
+   }
+
+   for (x = 0; x < MKSPAMEL; x++) {
+      snprintf(ekey, sizeof(ekey), "https://example.com/sessions/%u", x);
+
+      long idx = aa_idtoidx(exact, aa_sh(exact, ekey));
+      size_t klen = 0;
+      const char *key = aa_idxtokey(exact, idx, &klen);
+
+      if ((x & 1) != (idx >= 0) ||
+          (idx >= 0 && (aa_get(exact, aa_sh(exact, ekey)) != (signed int)x ||
+                        !key || klen != strlen(ekey) ||
+                        memcmp(key, ekey, klen) != 0))) {
+         printf("Exact element %u was not valid!\n", x);
+         return EXIT_FAILURE;
+      }
+   }
+
+   if ((ts = aa_freeze(exact)) != EM_STATUS_OKAY) {
+      printf("Exact table could not be frozen! (%s)\n", em_status_str(ts));
+      return EXIT_FAILURE;
+   }
+
+   for (x = 0; x < MKSPAMEL; x++) {
+      snprintf(ekey, sizeof(ekey), "https://example.com/sessions/%u", x);
+
+      long idx = aa_idtoidx(exact, aa_sh(exact, ekey));
+      size_t klen = 0;
+      const char *key = aa_idxtokey(exact, idx, &klen);
+
+      if ((x & 1) != (idx >= 0) || idx >= (long)aa_count(exact) ||
+          (idx >= 0 && (aa_get(exact, aa_sh(exact, ekey)) != (signed int)x ||
+                        !key || klen != strlen(ekey) ||
+                        memcmp(key, ekey, klen) != 0))) {
+         printf("Frozen element %u was not valid!\n", x);
+         return EXIT_FAILURE;
+      }
+   }
+
+   for (x = 0; x < MKBATCHEL; x++)
+      bids[x] = aa_vh(exact, x);
+
+   walked = 0;
+   aa_foreach(exact, idx) {
+      if (idx >= (long)aa_count(exact))
+         break;
+      walked++;
+   }
+
+   aa_stats(exact, &st);
+   if (walked != (long)aa_count(exact) ||
+       aa_get_many(exact, bids, MKBATCHEL, bptrs) != 0 ||
+       aa_set(exact, aa_vh(exact, x), 1) != EM_READ_ONLY ||
+       st.cur.capacity != aa_count(exact) || st.cur.max_probe) {
+      printf("Frozen table was not valid!\n");
+      return EXIT_FAILURE;
+   }
+
+   int *esnap = NULL;
+   if (aa_snapshot(exact, esnap) != EM_INVALID_TYPE || esnap) {
+      printf("Snapshot taken of a table without EM_ASA_SNAPSHOTS!\n");
+      return EXIT_FAILURE;
+   }
+
+   aa_free(exact);
+
+   if (!snap_round(0) || !snap_round(EM_ASA_ROBIN_HOOD)) {
+      printf("Snapshot did not keep the table as it was!\n");
+      return EXIT_FAILURE;
+   }
+
    return EXIT_SUCCESS;
 }
@@ -0,0 +1,208 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/bloom.h"
+
+#define MKBLEL 50000
+
+int main(void)
+{
+   em_status_t ts;
+   unsigned int x;
+
+   /* A classic filter, then blocked ones of a few k, each with about 10 bits
+    * per element. The expected false positive rates are about 1% but for k=2
+    * at 3%, and the size is a power of two of blocks already. */
+   unsigned int ks[] = { 4, 2, 4, 6 };
+   unsigned int most[] = { 300, 800, 300, 300 }; /* Per 10000 misses */
+
+   for (unsigned int f = 0; f < sizeof(ks) / sizeof(*ks); f++) {
+      em_bloom_t filter;
+      size_t bytes = 65536;
+
+      ts = f ? em_bloom_mkb(&filter, bytes, ks[f]) :
+               em_bloom_mkk(&filter, bytes, ks[f]);
+      if (ts != EM_STATUS_OKAY) {
+         printf("Filter could not be made! (%s)\n", em_status_str(ts));
+         return EXIT_FAILURE;
+      }
+
+      if (f && (filter.bytes != bytes ||
+                filter.blocks * EM_BLOOM_BLOCK != bytes ||
+                (uintptr_t)(filter.filter + filter.offset) % EM_BLOOM_BLOCK)) {
+         printf("Blocked filter was not laid out in blocks!\n");
+         return EXIT_FAILURE;
+      }
+
+      for (x = 0; x < MKBLEL; x++)
+         em_bloom_add(&filter, &x, sizeof(x));
+
+      for (x = 0; x < MKBLEL; x++) {
+         unsigned long long h = em_bloom_hash(&filter, &x, sizeof(x));
+
+         em_bloom_prefetch(&filter, h);
+         if (!em_bloom_in(&filter, &x, sizeof(x)) ||
+             !em_bloom_inh(&filter, h)) {
+            printf("Filter %u lost %u!\n", f, x);
+            return EXIT_FAILURE;
+         }
+      }
+
+      unsigned int hits = 0;
+
+      for (x = MKBLEL; x < MKBLEL + 10000; x++)
+         hits += em_bloom_in(&filter, &x, sizeof(x));
+
+      if (hits > most[f]) {
+         printf("Filter %u let %u of 10000 misses through!\n", f, hits);
+         return EXIT_FAILURE;
+      }
+
+      em_bloom_empty(&filter);
+      for (x = 0; x < MKBLEL; x++) {
+         if (em_bloom_in(&filter, &x, sizeof(x))) {
+            printf("Filter %u still had %u after emptying!\n", f, x);
+            return EXIT_FAILURE;
+         }
+      }
+
+      em_bloom_free(&filter);
+   }
+
+   /* Blocked filters round up to a power of two of blocks */
+   em_bloom_t odd;
+
+   if (em_bloom_mkb(&odd, 100000, 3) != EM_STATUS_OKAY ||
+       odd.blocks != 2048 || odd.bytes != 2048 * EM_BLOOM_BLOCK) {
+      printf("Blocked filter was not sized up to a power of two!\n");
+      return EXIT_FAILURE;
+   }
+
+   /* Sized for 1%, which takes about 9.6 bits per item and k=7. The second
+    * filter takes the first one's seed so the two can be combined. */
+   em_bloom_t left, right, copy;
+
+   if (em_bloom_mkp(&left, MKBLEL, 1.5) != EM_OUT_OF_BOUNDS ||
+       em_bloom_mkp(&left, MKBLEL, 0.01) != EM_STATUS_OKAY ||
+       em_bloom_mkp(&right, MKBLEL, 0.01) != EM_STATUS_OKAY ||
+       left.hashes != 7 || left.bytes * 8 < MKBLEL * 9.58 ||
+       left.bytes * 8 > MKBLEL * 9.6) {
+      printf("Filter was not sized by false positive rate!\n");
+      return EXIT_FAILURE;
+   }
+
+   right.seed = left.seed;
+
+   for (x = 0; x < MKBLEL / 2; x++)
+      em_bloom_add(&left, &x, sizeof(x));
+   for (x = MKBLEL / 4; x < MKBLEL * 3 / 4; x++)
+      em_bloom_add(&right, &x, sizeof(x));
+
+   double card = em_bloom_card(&left);
+
+   if (card < MKBLEL / 2 * 0.97 || card > MKBLEL / 2 * 1.03) {
+      printf("Filter estimated %.0f items, not %u!\n", card, MKBLEL / 2);
+      return EXIT_FAILURE;
+   }
+
+   /* A saved filter loads back bit for bit, and a damaged one not at all */
+   em_buf_t wire = em_buf_mk(NULL);
+
+   if ((ts = em_bloom_save(&left, &wire)) != EM_STATUS_OKAY ||
+       (ts = em_bloom_load(&copy, &wire, NULL)) != EM_STATUS_OKAY ||
+       copy.bytes != left.bytes || copy.hashes != left.hashes ||
+       memcmp(copy.filter, left.filter, left.bytes) != 0) {
+      printf("Filter did not survive being saved! (%s)\n", em_status_str(ts));
+      return EXIT_FAILURE;
+   }
+
+   /* The header is little-endian whatever the host: its size field reads
+    * back byte by byte, and one written in the other order doesn't load */
+   unsigned char *head = wire.data;
+   size_t headsz = wire.bytes - left.bytes;
+   uint64_t field = 0;
+
+   for (x = 0; x < 8; x++)
+      field |= (uint64_t)head[16 + x] << 8 * x;
+
+   if (field != left.bytes) {
+      printf("Filter size was not written little-endian!\n");
+      return EXIT_FAILURE;
+   }
+
+   em_bloom_free(&copy);
+   for (int pass = 0; pass < 2; pass++) {
+      for (size_t at = 8; at < headsz; at += 8) {
+         for (x = 0; x < 4; x++) {
+            unsigned char byte = head[at + x];
+
+            head[at + x] = head[at + 7 - x];
+            head[at + 7 - x] = byte;
+         }
+      }
+
+      if (em_bloom_load(&copy, &wire, NULL) !=
+          (pass ? EM_STATUS_OKAY : EM_BAD_IMAGE)) {
+         printf("Byte-swapped filter header was %s!\n",
+                pass ? "not restored" : "loaded");
+         return EXIT_FAILURE;
+      }
+   }
+
+   ((char *)wire.data)[wire.bytes - 1] ^= 1;
+   if (em_bloom_load(&odd, &wire, NULL) != EM_BAD_IMAGE) {
+      printf("Damaged filter was loaded!\n");
+      return EXIT_FAILURE;
+   }
+
+   if (em_bloom_union(&copy, &odd) != EM_INVALID_TYPE ||
+       em_bloom_union(&copy, &right) != EM_STATUS_OKAY ||
+       em_bloom_intersect(&left, &right) != EM_STATUS_OKAY) {
+      printf("Filters could not be combined!\n");
+      return EXIT_FAILURE;
+   }
+
+   for (x = 0; x < MKBLEL * 3 / 4; x++) {
+      if (!em_bloom_in(&copy, &x, sizeof(x)) ||
+          (x >= MKBLEL / 4 && x < MKBLEL / 2 &&
+           !em_bloom_in(&left, &x, sizeof(x)))) {
+         printf("Combined filters lost %u!\n", x);
+         return EXIT_FAILURE;
+      }
+   }
+
+   card = em_bloom_card(&copy);
+   if (card < MKBLEL * 3 / 4 * 0.97 || card > MKBLEL * 3 / 4 * 1.03) {
+      printf("Union estimated %.0f items, not %u!\n", card, MKBLEL * 3 / 4);
+      return EXIT_FAILURE;
+   }
+
+   /* Blocked filters are saved as they are too */
+   for (x = 0; x < MKBLEL; x++)
+      em_bloom_add(&odd, &x, sizeof(x));
+
+   em_bloom_free(&copy);
+   if (em_bloom_save(&odd, &wire) != EM_STATUS_OKAY ||
+       em_bloom_load(&copy, &wire, NULL) != EM_STATUS_OKAY ||
+       copy.blocks != odd.blocks) {
+      printf("Blocked filter did not survive being saved!\n");
+      return EXIT_FAILURE;
+   }
+
+   for (x = 0; x < MKBLEL; x++) {
+      if (!em_bloom_in(&copy, &x, sizeof(x))) {
+         printf("Saved blocked filter lost %u!\n", x);
+         return EXIT_FAILURE;
+      }
+   }
+
+   em_buf_free(&wire);
+   em_bloom_free(&left);
+   em_bloom_free(&right);
+   em_bloom_free(&copy);
+   em_bloom_free(&odd);
+
+   return EXIT_SUCCESS;
+}
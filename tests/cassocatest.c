@@ -0,0 +1,99 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../include/cassoca.h"
+
+#define MKWRITERS 4
+#define MKREADERS 4
+#define MKSPAMEL 40000
+
+static long *table;
+static atomic_bool done;
+static atomic_bool broken;
+
+static void *writer(void *arg)
+{
+   unsigned int w = (unsigned int)(size_t)arg;
+
+   for (unsigned int x = w; x < MKSPAMEL; x += MKWRITERS) {
+      if (ca_set(table, ca_vh(table, x), (long)x * 3) != EM_STATUS_OKAY)
+         atomic_store(&broken, true);
+
+      /* Churn a second key range so shards keep reforming under readers */
+      ca_set(table, ca_vh(table, x + MKSPAMEL), (long)x * 3);
+      if (x % 3 == 0)
+         ca_del(table, ca_vh(table, x + MKSPAMEL));
+   }
+
+   return NULL;
+}
+
+static void *reader(void *arg)
+{
+   unsigned int r = (unsigned int)(size_t)arg;
+
+   while (!atomic_load(&done)) {
+      for (unsigned int x = r; x < MKSPAMEL; x += 97) {
+         long v;
+
+         /* Either not there yet, or exactly what was written */
+         if (ca_get(table, ca_vh(table, x), &v) && v != (long)x * 3)
+            atomic_store(&broken, true);
+      }
+   }
+
+   return NULL;
+}
+
+int main(void)
+{
+   pthread_t writers[MKWRITERS], readers[MKREADERS];
+   unsigned int x;
+
+   if (!(table = ca_make(long, 3))) {
+      printf("Allocation failure!\n");
+      return EXIT_FAILURE;
+   }
+
+   for (x = 0; x < MKREADERS; x++)
+      pthread_create(&readers[x], NULL, reader, (void *)(size_t)x);
+   for (x = 0; x < MKWRITERS; x++)
+      pthread_create(&writers[x], NULL, writer, (void *)(size_t)x);
+
+   for (x = 0; x < MKWRITERS; x++)
+      pthread_join(writers[x], NULL);
+   atomic_store(&done, true);
+   for (x = 0; x < MKREADERS; x++)
+      pthread_join(readers[x], NULL);
+
+   if (atomic_load(&broken)) {
+      printf("Readers saw a torn or wrong value!\n");
+      return EXIT_FAILURE;
+   }
+
+   if (ca_count(table) != MKSPAMEL + MKSPAMEL - (MKSPAMEL + 2) / 3) {
+      printf("Wrong element count after concurrent writes! (%lu)\n",
+             ca_count(table));
+      return EXIT_FAILURE;
+   }
+
+   for (x = 0; x < MKSPAMEL; x++) {
+      long v;
+
+      if (!ca_get(table, ca_vh(table, x), &v) || v != (long)x * 3) {
+         printf("%u missing or wrong after concurrent writes!\n", x);
+         return EXIT_FAILURE;
+      }
+
+      if (ca_in(table, ca_vh(table, x + MKSPAMEL)) == (x % 3 == 0)) {
+         printf("%u churn key in the wrong state!\n", x + MKSPAMEL);
+         return EXIT_FAILURE;
+      }
+   }
+
+   ca_free(table);
+
+   return EXIT_SUCCESS;
+}
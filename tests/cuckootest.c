@@ -0,0 +1,96 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../include/cuckoo.h"
+
+#define MKCKEL 50000
+
+int main(void)
+{
+   unsigned int widths[] = { 8, 16 };
+   em_status_t ts;
+   unsigned int x;
+
+   for (unsigned int w = 0; w < sizeof(widths) / sizeof(*widths); w++) {
+      em_cuckoo_t filter;
+
+      if ((ts = em_cuckoo_mkf(&filter, MKCKEL, widths[w])) != EM_STATUS_OKAY) {
+         printf("Filter could not be made! (%s)\n", em_status_str(ts));
+         return EXIT_FAILURE;
+      }
+
+      for (x = 0; x < MKCKEL; x++) {
+         if ((ts = em_cuckoo_add(&filter, &x, sizeof(x))) != EM_STATUS_OKAY) {
+            printf("%u-bit filter could not take %u! (%s)\n", widths[w], x,
+                   em_status_str(ts));
+            return EXIT_FAILURE;
+         }
+      }
+
+      for (x = 0; x < MKCKEL; x++) {
+         if (!em_cuckoo_in(&filter, &x, sizeof(x))) {
+            printf("%u-bit filter lost %u!\n", widths[w], x);
+            return EXIT_FAILURE;
+         }
+      }
+
+      for (x = 0; x < MKCKEL; x += 2) {
+         if (em_cuckoo_del(&filter, &x, sizeof(x)) != EM_STATUS_OKAY) {
+            printf("%u-bit filter could not delete %u!\n", widths[w], x);
+            return EXIT_FAILURE;
+         }
+      }
+
+      /* Deletes must never take anything else with them */
+      for (x = 1; x < MKCKEL; x += 2) {
+         if (!em_cuckoo_in(&filter, &x, sizeof(x))) {
+            printf("%u-bit filter lost %u after deletes!\n", widths[w], x);
+            return EXIT_FAILURE;
+         }
+      }
+
+      /* Deleted and never added keys should mostly be turned away: the
+       * expected rate is about 1.5% with 8 bits, and next to none with 16 */
+      unsigned int hits = 0;
+
+      for (x = 0; x < MKCKEL; x += 2)
+         hits += em_cuckoo_in(&filter, &x, sizeof(x));
+      for (x = MKCKEL; x < MKCKEL * 2; x++)
+         hits += em_cuckoo_in(&filter, &x, sizeof(x));
+
+      if (filter.count != MKCKEL / 2 ||
+          hits > (widths[w] == 8 ? MKCKEL * 3 / 2 / 25 : MKCKEL / 1000)) {
+         printf("%u-bit filter let too much through! (%u)\n", widths[w],
+                hits);
+         return EXIT_FAILURE;
+      }
+
+      /* Fill it way past capacity: inserts eventually fail, but nothing that
+       * got in is lost on the way */
+      for (x = MKCKEL; x < MKCKEL * 4; x++)
+         if (em_cuckoo_add(&filter, &x, sizeof(x)) != EM_STATUS_OKAY)
+            break;
+
+      if (x == MKCKEL * 4) {
+         printf("%u-bit filter never filled up!\n", widths[w]);
+         return EXIT_FAILURE;
+      }
+
+      for (unsigned int y = MKCKEL; y < x; y++) {
+         if (!em_cuckoo_in(&filter, &y, sizeof(y))) {
+            printf("%u-bit filter lost %u when full!\n", widths[w], y);
+            return EXIT_FAILURE;
+         }
+      }
+
+      em_cuckoo_empty(&filter);
+      if (filter.count || em_cuckoo_in(&filter, &x, sizeof(x))) {
+         printf("%u-bit filter was not emptied!\n", widths[w]);
+         return EXIT_FAILURE;
+      }
+
+      em_cuckoo_free(&filter);
+   }
+
+   return EXIT_SUCCESS;
+}
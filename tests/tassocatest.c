@@ -0,0 +1,122 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../include/tassoca.h"
+
+#define MKTAEL 200000
+
+EM_TASA_DEFINE(u64u32, uint64_t, uint32_t)
+EM_TASA_DEFINE(ptr, const char *, int)
+
+int main(void)
+{
+   em_tasa_u64u32_t *t = ta_make(u64u32);
+   em_status_t ts;
+   uint64_t x;
+
+   if (!t) {
+      puts("Table could not be made!");
+      return EXIT_FAILURE;
+   }
+
+   for (x = 0; x < MKTAEL; x++) {
+      if ((ts = ta_set(u64u32, t, x * 0x9E3779B97F4A7C15ULL, x)) !=
+          EM_STATUS_OKAY) {
+         printf("Could not set %lu! (%s)\n", (unsigned long)x,
+                em_status_str(ts));
+         return EXIT_FAILURE;
+      }
+   }
+
+   if (ta_count(u64u32, t) != MKTAEL) {
+      printf("Table holds %zu, not %d!\n", ta_count(u64u32, t), MKTAEL);
+      return EXIT_FAILURE;
+   }
+
+   for (x = 0; x < MKTAEL; x++) {
+      uint32_t *v = ta_getptr(u64u32, t, x * 0x9E3779B97F4A7C15ULL);
+
+      if (!v || *v != x) {
+         printf("Got the wrong value back for %lu!\n", (unsigned long)x);
+         return EXIT_FAILURE;
+      }
+   }
+
+   if (ta_in(u64u32, t, 1)) {
+      puts("Found a key that was never set!");
+      return EXIT_FAILURE;
+   }
+
+   /* Overwrites, then churn through deletes and re-adds, which should keep
+    * rebuilding the table in place rather than growing it */
+   ta_set(u64u32, t, 0, 12345);
+   if (ta_get(u64u32, t, 0) != 12345 || ta_count(u64u32, t) != MKTAEL) {
+      puts("Overwriting a key did not replace its value!");
+      return EXIT_FAILURE;
+   }
+
+   for (x = 0; x < MKTAEL; x += 2) {
+      if ((ts = ta_del(u64u32, t, x * 0x9E3779B97F4A7C15ULL)) !=
+          EM_STATUS_OKAY) {
+         printf("Could not delete %lu! (%s)\n", (unsigned long)x,
+                em_status_str(ts));
+         return EXIT_FAILURE;
+      }
+   }
+
+   if (ta_del(u64u32, t, 0) != EM_EL_NOT_FOUND) {
+      puts("Deleting a missing key did not say so!");
+      return EXIT_FAILURE;
+   }
+
+   size_t groups = t->mask + 1;
+
+   for (unsigned int round = 0; round < 8; round++) {
+      for (x = 0; x < MKTAEL / 2; x++)
+         ta_set(u64u32, t, ~x - round * MKTAEL, round);
+      for (x = 0; x < MKTAEL / 2; x++)
+         ta_del(u64u32, t, ~x - round * MKTAEL);
+   }
+
+   if (t->mask + 1 != groups || ta_count(u64u32, t) != MKTAEL / 2) {
+      printf("Churn left %zu groups (from %zu) and %zu elements!\n",
+             t->mask + 1, groups, ta_count(u64u32, t));
+      return EXIT_FAILURE;
+   }
+
+   for (x = 0; x < MKTAEL; x++) {
+      if (ta_in(u64u32, t, x * 0x9E3779B97F4A7C15ULL) != (x & 1)) {
+         printf("%lu is %s after the churn!\n", (unsigned long)x,
+                x & 1 ? "missing" : "still there");
+         return EXIT_FAILURE;
+      }
+   }
+
+   ta_free(u64u32, t);
+
+   /* Pointer keys compare by address, and reserve avoids rebuilds */
+   static const char names[4][8] = { "one", "two", "three", "four" };
+   em_tasa_ptr_t *p = ta_make_alloc(ptr, EM_GLOBAL_ALLOC);
+
+   if (!p || ta_reserve(ptr, p, 1000) != EM_STATUS_OKAY) {
+      puts("Pointer table could not be made!");
+      return EXIT_FAILURE;
+   }
+
+   signed char *ctrl = p->ctrl;
+
+   for (int y = 0; y < 4; y++)
+      ta_set(ptr, p, names[y], y);
+
+   char copy[8] = "one";
+
+   if (ta_get(ptr, p, names[2]) != 2 || ta_in(ptr, p, copy) ||
+       p->ctrl != ctrl) {
+      puts("Pointer keys did not behave!");
+      return EXIT_FAILURE;
+   }
+
+   ta_free(ptr, p);
+
+   return EXIT_SUCCESS;
+}